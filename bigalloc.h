@@ -0,0 +1,144 @@
+// Placement of the big arrays on multi-socket machines.
+// Linux puts a page on the NUMA node of the thread that first writes it, so
+// bigAlloc only reserves address space and callers fill the array with the
+// same static OpenMP schedule that later processes it. Optional huge pages
+// cut TLB misses, and pinThreads keeps each OpenMP thread on one CPU so the
+// pages it touched stay local. Mappings are counted under a memtrack.h tag.
+// Including files must define _GNU_SOURCE before any system header.
+
+#ifndef BIGALLOC_H
+#define BIGALLOC_H
+
+#include <omp.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "memtrack.h"
+
+#define BIG_HEADER_BYTES 64 // Keeps the array cache-line aligned after the size and tag header
+#define HUGE_PAGE_BYTES (2UL << 20)
+
+enum { HUGE_PAGES_NONE, HUGE_PAGES_TRANSPARENT, HUGE_PAGES_EXPLICIT };
+
+static int hugePageMode = HUGE_PAGES_NONE;
+static cpu_set_t unpinnedCpus; // What the process could run on before pinThreads
+static int threadsPinned = 0;
+
+// "thp" asks for transparent huge pages, "explicit" for preallocated hugetlbfs pages
+static inline int parseHugePages(const char* mode) {
+    if (strcmp(mode, "thp") == 0) return HUGE_PAGES_TRANSPARENT;
+    if (strcmp(mode, "explicit") == 0) return HUGE_PAGES_EXPLICIT;
+    return HUGE_PAGES_NONE;
+}
+
+// Whether an array of this many bytes goes on huge pages: only when they are
+// asked for and it fills at least one, a small array would waste most of it
+static inline int bigAllocHuge(size_t bytes) {
+    return hugePageMode != HUGE_PAGES_NONE && bytes + BIG_HEADER_BYTES >= HUGE_PAGE_BYTES;
+}
+
+// What bigAlloc maps for an array: whole huge pages or whole normal pages
+static inline size_t bigAllocBytes(size_t bytes) {
+    size_t page = bigAllocHuge(bytes) ? HUGE_PAGE_BYTES : (size_t)sysconf(_SC_PAGESIZE);
+    return (bytes + BIG_HEADER_BYTES + page - 1) & ~(page - 1);
+}
+
+// Anonymous mapping, untouched; exits when the memory is not available
+static inline void* bigAlloc(int tag, size_t bytes) {
+    size_t total = bigAllocBytes(bytes);
+    int huge = bigAllocHuge(bytes);
+    void* map = MAP_FAILED;
+
+    if (huge && hugePageMode == HUGE_PAGES_EXPLICIT) {
+        map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "No explicit huge pages for %zu MB, using normal pages\n", total >> 20);
+        }
+    }
+    if (map == MAP_FAILED) {
+        map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Cannot allocate %zu MB for %s\n", total >> 20, memTags[tag].name);
+            exit(1);
+        }
+        if (huge) {
+            madvise(map, total, MADV_HUGEPAGE);
+        }
+    }
+
+    // Only the header's page is touched here, by the calling thread
+    ((size_t*)map)[0] = total;
+    ((size_t*)map)[1] = (size_t)tag;
+    memAccount(tag, (long)total);
+    return (char*)map + BIG_HEADER_BYTES;
+}
+
+static inline void bigFree(void* p) {
+    if (p == NULL) return;
+    char* map = (char*)p - BIG_HEADER_BYTES;
+    size_t total = ((size_t*)map)[0];
+    memAccount((int)((size_t*)map)[1], -(long)total);
+    munmap(map, total);
+}
+
+static inline int cpuPackage(int cpu) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    FILE* file = fopen(path, "r");
+    int package = 0;
+    if (file != NULL) {
+        if (fscanf(file, "%d", &package) != 1) package = 0;
+        fclose(file);
+    }
+    return package;
+}
+
+// Binds OpenMP thread t to a CPU from an ordered list, socket by socket,
+// so consecutive threads (and the consecutive chunks a static schedule
+// gives them) share a socket. Threads are reused between parallel regions,
+// so this holds for the rest of the run.
+static inline void pinThreads(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    unpinnedCpus = allowed;
+
+    static int cpus[CPU_SETSIZE], packages[CPU_SETSIZE];
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        int package = cpuPackage(cpu);
+        int k = count++;
+        for (; k > 0 && packages[k - 1] > package; k--) {
+            cpus[k] = cpus[k - 1];
+            packages[k] = packages[k - 1];
+        }
+        cpus[k] = cpu;
+        packages[k] = package;
+    }
+    if (count == 0) return;
+
+    #pragma omp parallel
+    {
+        int slot = (int)((long)omp_get_thread_num() * count / omp_get_num_threads());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[slot], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    threadsPinned = 1;
+    printf("Pinned %d threads over %d CPUs on %d socket(s)\n",
+           omp_get_max_threads(), count, packages[count - 1] + 1);
+}
+
+// A thread the program starts itself inherits the one CPU its creator was
+// pinned to, and so would every thread of an OpenMP team it opens; this
+// gives it back all the CPUs the process had
+static inline void unpinThread(void) {
+    if (threadsPinned) pthread_setaffinity_np(pthread_self(), sizeof(unpinnedCpus), &unpinnedCpus);
+}
+
+#endif
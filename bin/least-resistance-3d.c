@@ -0,0 +1,369 @@
+// Least-resistance expansion in 3D.
+// Same rule as 2d.py and least-resistance.c: every walker moves to the
+// neighbouring voxel with the fewest visits, trying directions in a shuffled
+// order. Voxels live in a sparse hash of 4x4x4 bricks, so memory grows with
+// the visited region instead of the bounding box.
+
+#include <GL/glut.h>
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <omp.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h> // Include this header for memset
+#include <stdint.h>
+#include <time.h>
+#include "../rng.h"
+#include "../pacing.h"
+
+#define DEFAULT_WALKERS 10000
+#define DEFAULT_NEIGHBOURS 6 // 6 (faces) or 26 (faces, edges and corners)
+#define DEFAULT_MAX_BRICKS (1 << 20) // 256 bytes each, only touched bricks use memory
+#define STEPS_PER_FRAME 1
+#define VOXEL_SIZE 0.05f
+#define BRICK_BITS 2 // Bricks are 4x4x4 voxels
+#define BRICK_VOXELS (1 << (3 * BRICK_BITS))
+#define BRICK_MASK ((1 << BRICK_BITS) - 1)
+#define COORD_OFFSET (1 << 20) // Brick coordinates are packed as 3 x 21 bits
+
+typedef struct {
+    int32_t x, y, z;
+} Walker;
+
+typedef struct {
+    uint64_t* keys;     // Packed brick coordinate + 1, 0 marks an empty slot
+    uint32_t* values;   // Brick index + 1, 0 until the inserting thread publishes it
+    uint64_t mask;      // Table capacity - 1
+    uint32_t (*counts)[BRICK_VOXELS]; // Visit counts, one row per brick
+    uint64_t* brickKeys; // Packed coordinate of every allocated brick, for drawing
+    uint32_t numBricks;
+    uint32_t maxBricks;
+    int full; // A brick did not fit in maxBricks
+} VoxelGrid;
+
+float cameraX = 0.0f, cameraY = 0.0f, cameraZ = 10.0f;
+float cameraYaw = 0.0f, cameraPitch = 0.0f;
+float cameraSpeed = 0.1f;
+int lastMouseX, lastMouseY;
+
+int keys[256];
+
+VoxelGrid grid;
+Walker* walkers = NULL;
+unsigned char* unplaced = NULL; // Walkers whose voxel is in a brick that is not allocated yet
+long numWalkers;
+int numNeighbours;
+int neighbours[26][3];
+long stepCount = 0;
+uint64_t seed;
+
+// A walker's draw for a step is keyed by (walker, step), so the direction
+// shuffles are reproducible no matter how walkers are spread over threads
+static inline uint64_t walkerRandom(long walker, long step) {
+    return rngBits(seed, walker, step);
+}
+
+static inline uint64_t brickKey(int32_t x, int32_t y, int32_t z) {
+    uint64_t bx = (uint64_t)((x >> BRICK_BITS) + COORD_OFFSET);
+    uint64_t by = (uint64_t)((y >> BRICK_BITS) + COORD_OFFSET);
+    uint64_t bz = (uint64_t)((z >> BRICK_BITS) + COORD_OFFSET);
+    return ((bx << 42) | (by << 21) | bz) + 1;
+}
+
+static inline int voxelIndex(int32_t x, int32_t y, int32_t z) {
+    return (x & BRICK_MASK) | ((y & BRICK_MASK) << BRICK_BITS) | ((z & BRICK_MASK) << (2 * BRICK_BITS));
+}
+
+void initGrid(VoxelGrid* g, uint32_t maxBricks) {
+    uint64_t capacity = 1;
+    while (capacity < 2 * (uint64_t)maxBricks) capacity <<= 1;
+
+    g->keys = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    g->values = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    g->counts = calloc(maxBricks, sizeof(*g->counts));
+    g->brickKeys = (uint64_t*)calloc(maxBricks, sizeof(uint64_t));
+    if (g->keys == NULL || g->values == NULL || g->counts == NULL || g->brickKeys == NULL) {
+        fprintf(stderr, "Cannot allocate a voxel grid of %u bricks\n", maxBricks);
+        exit(1);
+    }
+    g->mask = capacity - 1;
+    g->numBricks = 0;
+    g->maxBricks = maxBricks;
+    g->full = 0;
+}
+
+// Counts of a brick, or NULL when nothing in it has been visited yet. The
+// table only changes between the parallel passes, so lookups need no atomics.
+static inline uint32_t* findBrick(const VoxelGrid* g, uint64_t key) {
+    for (uint64_t slot = mix64(key) & g->mask;; slot = (slot + 1) & g->mask) {
+        uint64_t k = g->keys[slot];
+        if (k == 0) return NULL;
+        if (k == key) return g->counts[g->values[slot] - 1];
+    }
+}
+
+// Single threaded, called in walker order, so which bricks still fit when the
+// grid fills up (and every brick's index) does not depend on the thread count
+static inline uint32_t* findOrCreateBrick(VoxelGrid* g, uint64_t key) {
+    for (uint64_t slot = mix64(key) & g->mask;; slot = (slot + 1) & g->mask) {
+        uint64_t k = g->keys[slot];
+        if (k == key) return g->counts[g->values[slot] - 1];
+        if (k == 0) {
+            if (g->numBricks == g->maxBricks) {
+                g->full = 1;
+                return NULL;
+            }
+            uint32_t index = g->numBricks++;
+            g->keys[slot] = key;
+            g->values[slot] = index + 1;
+            g->brickKeys[index] = key;
+            return g->counts[index];
+        }
+    }
+}
+
+void initNeighbours(int count) {
+    int n = 0;
+    for (int dx = -1; dx <= 1; dx++)
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dz = -1; dz <= 1; dz++) {
+                int manhattan = abs(dx) + abs(dy) + abs(dz);
+                if (manhattan == 0 || (count == 6 && manhattan != 1)) continue;
+                neighbours[n][0] = dx;
+                neighbours[n][1] = dy;
+                neighbours[n][2] = dz;
+                n++;
+            }
+    numNeighbours = n;
+}
+
+// Visits every neighbour once, in a per-step random order, and keeps the
+// first one with the strictly smallest count. The neighbours fall in at most
+// 8 bricks around the walker's; each is looked up once, the first time the
+// shuffled order reaches it, so a query touches a few hash slots at most.
+static inline Walker findLeastResistance(const VoxelGrid* g, Walker w, uint64_t random) {
+    int order[26];
+    for (int k = 0; k < numNeighbours; k++) order[k] = k;
+    for (int k = numNeighbours - 1; k > 0; k--) {
+        random = mix64(random + k);
+        int j = (int)(random % (uint64_t)(k + 1));
+        int t = order[k];
+        order[k] = order[j];
+        order[j] = t;
+    }
+
+    const uint32_t* bricks[27]; // By brick offset from the walker's, -1..1 on each axis
+    unsigned char found[27] = {0};
+    uint32_t minResistance = UINT32_MAX;
+    Walker best = w;
+
+    for (int k = 0; k < numNeighbours; k++) {
+        Walker n = {w.x + neighbours[order[k]][0], w.y + neighbours[order[k]][1], w.z + neighbours[order[k]][2]};
+        int near = ((n.x >> BRICK_BITS) - (w.x >> BRICK_BITS) + 1) * 9 +
+                   ((n.y >> BRICK_BITS) - (w.y >> BRICK_BITS) + 1) * 3 + ((n.z >> BRICK_BITS) - (w.z >> BRICK_BITS) + 1);
+        if (!found[near]) {
+            bricks[near] = findBrick(g, brickKey(n.x, n.y, n.z));
+            found[near] = 1;
+        }
+        const uint32_t* brick = bricks[near];
+        uint32_t resistance = brick ? __atomic_load_n(&brick[voxelIndex(n.x, n.y, n.z)], __ATOMIC_RELAXED) : 0;
+        if (resistance < minResistance) {
+            minResistance = resistance;
+            best = n;
+            if (resistance == 0) break; // Nothing can beat an unvisited voxel
+        }
+    }
+    return best;
+}
+
+// Walkers move in lockstep like least-resistance.c: choose from the grid as it
+// stood at the start of the step, then apply all increments, so counts do not
+// depend on the thread count. Increments into existing bricks are made in
+// parallel; the few walkers that stepped into new bricks are placed after,
+// on one thread in walker order.
+void simulate(long steps) {
+    for (long s = 0; s < steps; s++) {
+        long step = stepCount + s;
+
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < numWalkers; i++) {
+            walkers[i] = findLeastResistance(&grid, walkers[i], walkerRandom(i, step));
+        }
+
+        long missing = 0;
+        #pragma omp parallel for schedule(static) reduction(+:missing)
+        for (long i = 0; i < numWalkers; i++) {
+            Walker w = walkers[i];
+            uint32_t* brick = findBrick(&grid, brickKey(w.x, w.y, w.z));
+            if (brick != NULL) {
+                __atomic_fetch_add(&brick[voxelIndex(w.x, w.y, w.z)], 1, __ATOMIC_RELAXED);
+            } else {
+                unplaced[i] = 1;
+                missing++;
+            }
+        }
+
+        for (long i = 0; missing > 0 && i < numWalkers; i++) {
+            if (!unplaced[i]) continue;
+            unplaced[i] = 0;
+            missing--;
+            Walker w = walkers[i];
+            uint32_t* brick = findOrCreateBrick(&grid, brickKey(w.x, w.y, w.z));
+            if (brick != NULL) brick[voxelIndex(w.x, w.y, w.z)]++;
+        }
+    }
+    stepCount += steps;
+}
+
+void init(void) {
+    glClearColor(0.0, 0.0, 0.0, 0.0);
+    glShadeModel(GL_FLAT);
+    glEnable(GL_DEPTH_TEST);
+    glutSetCursor(GLUT_CURSOR_NONE);
+    glutWarpPointer(glutGet(GLUT_WINDOW_WIDTH) / 2, glutGet(GLUT_WINDOW_HEIGHT) / 2);
+    lastMouseX = glutGet(GLUT_WINDOW_WIDTH) / 2;
+    lastMouseY = glutGet(GLUT_WINDOW_HEIGHT) / 2;
+    memset(keys, 0, sizeof(keys));
+}
+
+// Visited voxels as points, coloured with the 'hot' map on a log scale
+void drawVoxels(void) {
+    uint32_t numBricks = grid.numBricks;
+    uint32_t maxCount = 1;
+    for (uint32_t b = 0; b < numBricks; b++) {
+        for (int v = 0; v < BRICK_VOXELS; v++) {
+            if (grid.counts[b][v] > maxCount) maxCount = grid.counts[b][v];
+        }
+    }
+    float scale = 1.0f / log1pf((float)maxCount);
+
+    glBegin(GL_POINTS);
+    for (uint32_t b = 0; b < numBricks; b++) {
+        uint64_t key = grid.brickKeys[b] - 1;
+        int32_t bx = (int32_t)((key >> 42) & 0x1fffff) - COORD_OFFSET;
+        int32_t by = (int32_t)((key >> 21) & 0x1fffff) - COORD_OFFSET;
+        int32_t bz = (int32_t)(key & 0x1fffff) - COORD_OFFSET;
+
+        for (int v = 0; v < BRICK_VOXELS; v++) {
+            uint32_t count = grid.counts[b][v];
+            if (count == 0) continue;
+
+            float t = log1pf((float)count) * scale;
+            glColor3f(fminf(3.0f * t, 1.0f), fminf(fmaxf(3.0f * t - 1.0f, 0.0f), 1.0f), fmaxf(3.0f * t - 2.0f, 0.0f));
+            int32_t x = (bx << BRICK_BITS) + (v & BRICK_MASK);
+            int32_t y = (by << BRICK_BITS) + ((v >> BRICK_BITS) & BRICK_MASK);
+            int32_t z = (bz << BRICK_BITS) + (v >> (2 * BRICK_BITS));
+            glVertex3f(x * VOXEL_SIZE, y * VOXEL_SIZE, z * VOXEL_SIZE);
+        }
+    }
+    glEnd();
+}
+
+void display(void) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glLoadIdentity();
+
+    float lookX = sin(cameraYaw) * cos(cameraPitch);
+    float lookY = sin(cameraPitch);
+    float lookZ = -cos(cameraYaw) * cos(cameraPitch);
+
+    gluLookAt(cameraX, cameraY, cameraZ,
+              cameraX + lookX, cameraY + lookY, cameraZ + lookZ,
+              0.0, 1.0, 0.0);
+
+    drawVoxels();
+
+    glutSwapBuffers();
+}
+
+void reshape(int w, int h) {
+    glViewport(0, 0, (GLsizei)w, (GLsizei)h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(60.0, (GLfloat)w / (GLfloat)h, 1.0, 100.0);
+    glMatrixMode(GL_MODELVIEW);
+}
+
+void keyboardDown(unsigned char key, int x, int y) {
+    keys[key] = 1;
+    if (key == 'p') pacerTogglePause();
+}
+
+void keyboardUp(unsigned char key, int x, int y) {
+    keys[key] = 0;
+}
+
+// Returns 1 when a movement key is held, so the pacer knows to redraw
+int updateCameraPosition(void) {
+    float lookX = sin(cameraYaw) * cos(cameraPitch);
+    float lookZ = -cos(cameraYaw) * cos(cameraPitch);
+
+    if (keys['w']) {
+        cameraX += lookX * cameraSpeed;
+        cameraZ += lookZ * cameraSpeed;
+    }
+    if (keys['s']) {
+        cameraX -= lookX * cameraSpeed;
+        cameraZ -= lookZ * cameraSpeed;
+    }
+    if (keys['a']) {
+        cameraX += lookZ * cameraSpeed;
+        cameraZ -= lookX * cameraSpeed;
+    }
+    if (keys['d']) {
+        cameraX -= lookZ * cameraSpeed;
+        cameraZ += lookX * cameraSpeed;
+    }
+    return keys['w'] || keys['s'] || keys['a'] || keys['d'];
+}
+
+// One simulation tick, called by the frame pacer; a full grid pauses it
+void stepVoxels(void) {
+    if (grid.full) return;
+    simulate(1);
+    if (grid.full) {
+        printf("Voxel grid full after %ld steps (%u bricks), simulation stopped\n", stepCount, grid.maxBricks);
+        pacerTogglePause();
+    }
+}
+
+int main(int argc, char **argv) {
+    glutInit(&argc, argv);
+
+    numWalkers = (argc > 1) ? atol(argv[1]) : DEFAULT_WALKERS;
+    int neighbourCount = (argc > 2) ? atoi(argv[2]) : DEFAULT_NEIGHBOURS;
+    long maxBricks = (argc > 3) ? atol(argv[3]) : DEFAULT_MAX_BRICKS;
+    seed = (argc > 4) ? strtoull(argv[4], NULL, 10) : (uint64_t)time(NULL);
+    if (numWalkers < 1 || (neighbourCount != 6 && neighbourCount != 26) || maxBricks < 1 || maxBricks > UINT32_MAX / 2) {
+        fprintf(stderr, "usage: %s [walkers] [neighbours 6|26] [max_bricks] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    initNeighbours(neighbourCount);
+    initGrid(&grid, (uint32_t)maxBricks);
+    walkers = (Walker*)calloc(numWalkers, sizeof(Walker)); // Everyone starts at the origin
+    unplaced = (unsigned char*)calloc(numWalkers, 1);
+    if (walkers == NULL || unplaced == NULL) {
+        fprintf(stderr, "Cannot allocate %ld walkers\n", numWalkers);
+        return 1;
+    }
+    findOrCreateBrick(&grid, brickKey(0, 0, 0))[voxelIndex(0, 0, 0)] = 1;
+    printf("%ld walkers, %d neighbours, up to %ld bricks, seed %llu\n",
+           numWalkers, numNeighbours, maxBricks, (unsigned long long)seed);
+
+    pacerInit(PACING_DEFAULT_FPS, STEPS_PER_FRAME, stepVoxels, updateCameraPosition, NULL);
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+    glutInitWindowSize(800, 600);
+    glutInitWindowPosition(100, 100);
+    glutCreateWindow("Least Resistance Expansion in 3D");
+
+    init();
+    glutDisplayFunc(display);
+    glutReshapeFunc(reshape);
+    glutKeyboardFunc(keyboardDown);
+    glutKeyboardUpFunc(keyboardUp);
+    pacerStart(1);
+    glutMainLoop();
+    return 0;
+}
@@ -0,0 +1,188 @@
+// Native engine for the least-resistance walk in 2d.py.
+// Every walker repeatedly moves to the neighbouring cell with the fewest
+// visits (directions shuffled to avoid biased expansion) and marks it.
+// Many walkers run at once on one shared grid and the heatmap is written
+// as a binary PPM image.
+
+#include <omp.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "../rng.h"
+
+#define DEFAULT_GRID_SIZE 100
+#define DEFAULT_WALKERS 1
+#define DEFAULT_STEPS 5000
+#define MAX_IMAGE_SIZE 4096 // Larger grids are reduced (block maximum) to fit this
+
+typedef struct {
+    uint32_t x, y;
+} Walker;
+
+int directions[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+int shuffles[24][4]; // Every ordering of the four directions
+uint64_t seed;
+
+// A walker's draw for a step is keyed by (walker, step), so the direction
+// shuffles are reproducible no matter how walkers are spread over threads
+static inline uint64_t walkerRandom(long walker, long step) {
+    return rngBits(seed, walker, step);
+}
+
+void initShuffles(void) {
+    int n = 0;
+    for (int a = 0; a < 4; a++)
+        for (int b = 0; b < 4; b++)
+            for (int c = 0; c < 4; c++) {
+                int d = 6 - a - b - c;
+                if (a == b || a == c || b == c || d == a || d == b || d == c) continue;
+                shuffles[n][0] = a;
+                shuffles[n][1] = b;
+                shuffles[n][2] = c;
+                shuffles[n][3] = d;
+                n++;
+            }
+}
+
+// Same rule as find_least_resistance in 2d.py: first cell in shuffled order
+// with the strictly smallest count, ignoring cells outside the grid
+static inline Walker findLeastResistance(const uint32_t* grid, long size, Walker w, uint64_t random) {
+    const int* order = shuffles[random % 24];
+    uint32_t minResistance = UINT32_MAX;
+    int found = 0;
+    Walker best = w;
+
+    for (int k = 0; k < 4; k++) {
+        long nx = (long)w.x + directions[order[k]][0];
+        long ny = (long)w.y + directions[order[k]][1];
+        if (nx < 0 || nx >= size || ny < 0 || ny >= size) continue;
+
+        uint32_t resistance = __atomic_load_n(&grid[nx * size + ny], __ATOMIC_RELAXED);
+        if (!found || resistance < minResistance) {
+            minResistance = resistance;
+            best.x = (uint32_t)nx;
+            best.y = (uint32_t)ny;
+            found = 1;
+        }
+    }
+    return best;
+}
+
+// Walkers move in lockstep: every walker picks its next cell from the grid as
+// it stood at the start of the step, then all the increments land. Increments
+// commute, so the grid after each step is the same for any thread count.
+void simulate(uint32_t* grid, long size, Walker* walkers, long numWalkers, long steps) {
+    #pragma omp parallel
+    for (long step = 0; step < steps; step++) {
+        #pragma omp for schedule(static)
+        for (long i = 0; i < numWalkers; i++) {
+            walkers[i] = findLeastResistance(grid, size, walkers[i], walkerRandom(i, step));
+        }
+
+        #pragma omp for schedule(static)
+        for (long i = 0; i < numWalkers; i++) {
+            __atomic_fetch_add(&grid[(long)walkers[i].x * size + walkers[i].y], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// 'hot' colour map on a log scale, so sparse outer cells stay visible next to
+// the heavily revisited centre
+void writeHeatmap(const char* path, const uint32_t* grid, long size) {
+    long factor = (size + MAX_IMAGE_SIZE - 1) / MAX_IMAGE_SIZE;
+    long imageSize = (size + factor - 1) / factor;
+    uint32_t* image = (uint32_t*)calloc(imageSize * imageSize, sizeof(uint32_t));
+    unsigned char* pixels = (unsigned char*)malloc(imageSize * imageSize * 3);
+    if (image == NULL || pixels == NULL) {
+        fprintf(stderr, "Cannot allocate %ldx%ld image\n", imageSize, imageSize);
+        exit(1);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (long row = 0; row < imageSize; row++) {
+        for (long x = row * factor; x < size && x < (row + 1) * factor; x++) {
+            for (long y = 0; y < size; y++) {
+                uint32_t* pixel = &image[row * imageSize + y / factor];
+                if (grid[x * size + y] > *pixel) *pixel = grid[x * size + y];
+            }
+        }
+    }
+
+    uint32_t maxCount = 1;
+    for (long i = 0; i < imageSize * imageSize; i++) {
+        if (image[i] > maxCount) maxCount = image[i];
+    }
+
+    float scale = 1.0f / log1pf((float)maxCount);
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < imageSize * imageSize; i++) {
+        float t = log1pf((float)image[i]) * scale;
+        float r = fminf(fmaxf(3.0f * t, 0.0f), 1.0f);
+        float g = fminf(fmaxf(3.0f * t - 1.0f, 0.0f), 1.0f);
+        float b = fminf(fmaxf(3.0f * t - 2.0f, 0.0f), 1.0f);
+        pixels[i * 3 + 0] = (unsigned char)(r * 255.0f);
+        pixels[i * 3 + 1] = (unsigned char)(g * 255.0f);
+        pixels[i * 3 + 2] = (unsigned char)(b * 255.0f);
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(file, "P6\n%ld %ld\n255\n", imageSize, imageSize);
+    fwrite(pixels, 3, imageSize * imageSize, file);
+    fclose(file);
+    printf("Heatmap %ldx%ld (max %u visits) written to %s\n", imageSize, imageSize, maxCount, path);
+
+    free(image);
+    free(pixels);
+}
+
+int main(int argc, char **argv) {
+    long size = (argc > 1) ? atol(argv[1]) : DEFAULT_GRID_SIZE;
+    long numWalkers = (argc > 2) ? atol(argv[2]) : DEFAULT_WALKERS;
+    long steps = (argc > 3) ? atol(argv[3]) : DEFAULT_STEPS;
+    seed = (argc > 4) ? strtoull(argv[4], NULL, 10) : (uint64_t)time(NULL);
+    const char* output = (argc > 5) ? argv[5] : "least-resistance.ppm";
+
+    if (size < 2 || numWalkers < 1 || steps < 0) {
+        fprintf(stderr, "usage: %s [grid_size] [walkers] [steps] [seed] [output.ppm]\n", argv[0]);
+        return 1;
+    }
+
+    initShuffles();
+
+    // calloc of a big grid maps zero pages lazily, so only visited rows use memory
+    uint32_t* grid = (uint32_t*)calloc((size_t)size * size, sizeof(uint32_t));
+    Walker* walkers = (Walker*)malloc(numWalkers * sizeof(Walker));
+    if (grid == NULL || walkers == NULL) {
+        fprintf(stderr, "Cannot allocate a %ldx%ld grid with %ld walkers\n", size, size, numWalkers);
+        return 1;
+    }
+
+    // Everything expands from the same zero-dimensional point
+    Walker start = {(uint32_t)(size / 2), (uint32_t)(size / 2)};
+    grid[(long)start.x * size + start.y] = 1;
+    for (long i = 0; i < numWalkers; i++) {
+        walkers[i] = start;
+    }
+
+    printf("%ld walkers x %ld steps on a %ldx%ld grid, seed %llu, %d threads\n",
+           numWalkers, steps, size, size, (unsigned long long)seed, omp_get_max_threads());
+    double startTime = omp_get_wtime();
+    simulate(grid, size, walkers, numWalkers, steps);
+    double elapsed = omp_get_wtime() - startTime;
+    double totalSteps = (double)numWalkers * steps;
+    printf("%.0f walk steps in %.3fs (%.3g steps/minute)\n",
+           totalSteps, elapsed, elapsed > 0.0 ? totalSteps / elapsed * 60.0 : 0.0);
+
+    writeHeatmap(output, grid, size);
+
+    free(grid);
+    free(walkers);
+    return 0;
+}
@@ -6,11 +6,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "../rng.h"
 
 #define MAX_DEPTH 3
 #define NUM_POINTS 5 // Number of points to generate on the sphere
 #define G 0.001f // Gravitational constant
 #define TIME_STEP 0.1f // Time step for the simulation
+#define TASK_MIN_SUBTREE 4096 // Subtrees smaller than this are generated inline by one thread
 
 typedef struct {
     float x, y, z;
@@ -20,8 +24,15 @@ typedef struct {
 float cameraX = 0.0f, cameraY = 0.0f, cameraZ = 10.0f;
 float cameraYaw = 0.0f, cameraPitch = 0.0f;
 float speed = 0.1f;
-Point3D* points = NULL; // Array of points
-int pointIndex = 0; // Index to keep track of points
+Point3D* points = NULL; // Every generated point, in depth-first order
+long subtreeSize[MAX_DEPTH + 1]; // Nodes in a subtree whose root sits at each depth
+uint64_t seed;
+
+// A point's slot encodes its path from the origin, so expand() gives the same
+// points for a given seed no matter how subtrees are spread over threads
+static inline float slotRandom(long slot, int draw) {
+    return rngUniform(seed, slot, draw);
+}
 
 void init(void) {
     glClearColor(0.0, 0.0, 0.0, 0.0);
@@ -35,13 +46,14 @@ void drawLine(Point3D p1, Point3D p2) {
     glEnd();
 }
 
-void expand(Point3D point, int depth) {
+// slot is the depth-first index of point (the origin is slot 0 and is not stored)
+void expand(Point3D point, int depth, long slot) {
     if (depth >= MAX_DEPTH) return;
 
-    #pragma omp parallel for
     for (int i = 0; i < NUM_POINTS; i++) {
-        float theta = ((float)rand() / RAND_MAX) * 2.0 * M_PI; // Angle around the Z-axis
-        float phi = ((float)rand() / RAND_MAX) * M_PI;        // Angle from the Z-axis
+        long childSlot = slot + 1 + i * subtreeSize[depth + 1];
+        float theta = slotRandom(childSlot, 0) * 2.0 * M_PI; // Angle around the Z-axis
+        float phi = slotRandom(childSlot, 1) * M_PI;        // Angle from the Z-axis
 
         // Convert spherical coordinates to Cartesian coordinates
         float x = point.x + sin(phi) * cos(theta);
@@ -49,15 +61,16 @@ void expand(Point3D point, int depth) {
         float z = point.z + cos(phi);
 
         // Initial velocity
-        float vx = ((float)rand() / RAND_MAX - 0.5) * 0.1f;
-        float vy = ((float)rand() / RAND_MAX - 0.5) * 0.1f;
-        float vz = ((float)rand() / RAND_MAX - 0.5) * 0.1f;
+        float vx = (slotRandom(childSlot, 2) - 0.5) * 0.1f;
+        float vy = (slotRandom(childSlot, 3) - 0.5) * 0.1f;
+        float vz = (slotRandom(childSlot, 4) - 0.5) * 0.1f;
 
         Point3D newPoint = {x, y, z, vx, vy, vz};
-        points[pointIndex++] = newPoint;
+        points[childSlot - 1] = newPoint;
 
-        drawLine(point, newPoint);
-        expand(newPoint, depth + 1);
+        // Large subtrees become tasks; each one writes only its own slot range
+        #pragma omp task firstprivate(newPoint, childSlot) if(subtreeSize[depth + 1] >= TASK_MIN_SUBTREE)
+        expand(newPoint, depth + 1, childSlot);
     }
 }
 
@@ -97,12 +110,19 @@ void updatePoints(Point3D* points, int numPoints) {
 
 void display(void) {
     static bool initialized = false;
-    static int numPoints = NUM_POINTS * (int)pow(NUM_POINTS, MAX_DEPTH);
+    static int numPoints = 0;
 
     if (!initialized) {
+        subtreeSize[MAX_DEPTH] = 1;
+        for (int d = MAX_DEPTH - 1; d >= 0; d--) {
+            subtreeSize[d] = 1 + NUM_POINTS * subtreeSize[d + 1];
+        }
+        numPoints = subtreeSize[0] - 1;
         points = (Point3D*)malloc(numPoints * sizeof(Point3D));
         Point3D start = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
-        expand(start, 0);
+        #pragma omp parallel
+        #pragma omp single
+        expand(start, 0, 0);
         initialized = true;
     }
 
@@ -197,6 +217,10 @@ int main(int argc, char **argv) {
     glutInitWindowPosition(100, 100);
     glutCreateWindow("Expansion in 3D Space with Gravity");
 
+    // Optional seed argument reproduces a previous run exactly
+    seed = (argc > 1) ? strtoull(argv[1], NULL, 10) : (uint64_t)time(NULL);
+    printf("Seed: %llu\n", (unsigned long long)seed);
+
     init();
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
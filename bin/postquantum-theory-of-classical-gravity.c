@@ -2,14 +2,37 @@
 // code of mmtmn
 
 
+#define _GNU_SOURCE // For thread pinning in bigalloc.h
+#ifndef POSTQUANTUM_LIBRARY // The library build (bin/postquantum.py) has no window
 #include <GL/glut.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
+#endif
 #include <omp.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../softrender.h"
+#include "../bigalloc.h"
+#include "../kdtree.h"
+#include "../quality.h"
+#ifndef POSTQUANTUM_LIBRARY
+#include "../pacing.h"
+#endif
+#include "../metrics.h"
+#include "../reduce.h"
+#include "../memtrack.h"
+#include "../trajectory.h"
+#include "../rng.h"
 
 #define NUM_QUANTUM_SYSTEMS 1000
 #define G 0.001f
@@ -18,6 +41,14 @@
 #define DECOHERENCE_RATE 0.01f
 #define MASS_FACTOR 1.0f
 #define CURVATURE_FLUCTUATION_SCALE 1e-9f
+#define PM_DEFAULT_GRID_SIZE 64
+#define PM_TAIL 0.01f          // Fraction of systems on each side that may be left off the mesh
+#define PM_HISTOGRAM_BINS 1024 // Per level of the histograms that place the mesh
+#define PICK_TAN_ANGLE 0.01f // Pick cone half-angle, about 5 pixels at 800x600
+#define NEIGHBOURHOOD_RADIUS 2.0f
+#define REORDER_DEFAULT_INTERVAL 64 // Steps between Morton reorders, 0 = never
+#define MORTON_BITS 10              // Per axis, so keys have 30 bits
+#define RADIX_BITS 8                // Key bits per radix sort pass
 
 typedef struct {
     float x, y, z;
@@ -26,15 +57,72 @@ typedef struct {
     float coherence;
     float mass;
     float curvatureInfluence;
+    int id; // Stable through reordering: random streams and output follow it
 } System;
 
 float cameraX = 0.0f, cameraY = 0.0f, cameraZ = 50.0f;
 float cameraYaw = 0.0f, cameraPitch = 0.0f;
 float speed = 0.1f;
-System* systems = NULL;
+// Every phase works on the state after the previous phase and gives the same
+// result on any number of threads. Most change each system in place, since
+// no system reads a field another one writes in that phase. A phase that
+// writes what it reads of the other systems (path integral: positions)
+// writes a new state into the second buffer instead, and the two swap by
+// pointer.
+System* systems = NULL;     // Current state
+System* systemsNext = NULL; // Scratch for the phases that write a new state
 int numSystems = 0;
-float totalEnergy = 0.0f;
+double totalEnergy = 0.0;
+double initialEnergy = 0.0; // For the energy drift metric
+double* energyTerms = NULL; // Per-system terms for reduce.h, also used by the diagnostics
+long energyTermsCapacity = 0;
+const char* framePattern = NULL; // When set, frames are rendered in software to these files, no window
+const char* recordPath = NULL;   // When set, the state after every step is appended to this trajectory
+bool playing = false;            // Showing a recorded trajectory (--play) instead of simulating
+int numFrames = 1;
+int frameWidth = 800, frameHeight = 600;
+int pinning = 0;
+uint64_t seed;
+long simulationStep = 0;
+float gravity = G; // Runtime copies of the constants above, so one binary can sweep them
+float decoherenceRate = DECOHERENCE_RATE;
+float curvatureFluctuationScale = CURVATURE_FLUCTUATION_SCALE;
+int requestedSystems = NUM_QUANTUM_SYSTEMS;
+KdTree systemIndex; // Spatial index over systems, brought up to date only when queried
+bool systemIndexStale = true;
+int selectedSystem = -1; // Id, not index
+int* systemSlot = NULL;  // Index of each id in systems, rebuilt when the order changed
+bool systemSlotStale = true;
+int reorderInterval = REORDER_DEFAULT_INTERVAL;
+int memSystems, memMorton, memMesh, memHistory, memIndex, memCsl; // Tags, see memtrack.h
+QualityController quality;
+int physicsInterval = 1; // Frames per simulation step
+int drawStride = 1;      // Every n-th system is drawn
+int sphereDetail = 10;   // Slices and stacks per sphere, 0 draws plain points
+int meshShift = 0;       // The particle mesh runs at meshSize >> meshShift per side
+
+// What each quality level gives up: {physics interval, draw stride, sphere detail, mesh shift}
+static const int qualityLevels[][4] = {
+    {1, 1, 10, 0}, {1, 1, 6, 0}, {1, 2, 6, 0}, {2, 2, 0, 0},
+    {2, 4, 0, 0}, {4, 4, 0, 1}, {4, 8, 0, 1}, {8, 8, 0, 2}
+};
+#define NUM_QUALITY_LEVELS (int)(sizeof(qualityLevels) / sizeof(qualityLevels[0]))
+
+// Initial draws are keyed by the system's index, so systems can be
+// initialised by whichever thread first touches their memory
+static inline float indexRandom(long index, int draw) {
+    return rngUniform(seed, index, draw);
+}
+
+// Draws made during a step are keyed by the step as well, so a run depends
+// only on its seed, not on how threads would have interleaved calls to rand().
+// Phases pass the system's id, so its stream follows it when systems are reordered.
+static inline float stepRandom(long index, int draw) {
+    uint64_t counter = ((uint64_t)(simulationStep + 1) << 8) + (uint64_t)draw; // Counters below 256 belong to the initial state
+    return rngUniform(seed, index, counter);
+}
 
+#ifndef POSTQUANTUM_LIBRARY
 void init(void) {
     glClearColor(0.0, 0.0, 0.0, 0.0);
     glShadeModel(GL_FLAT);
@@ -46,80 +134,593 @@ void drawPoint(System s) {
     glTranslatef(s.x, s.y, s.z);
     if (s.isQuantum) {
         glColor3f(0.0, 1.0, 0.0);
-        glutSolidSphere(0.1, 10, 10);
+        glutSolidSphere(0.1, sphereDetail, sphereDetail);
     } else {
         glColor3f(1.0, 0.0, 0.0);
         glutSolidCube(0.2);  // Different shape for classical systems
     }
     glPopMatrix();
 }
+#endif
 
 
+// Filled in parallel with the static schedule the phases use, so on a
+// multi-socket machine each system's page lives next to the thread that updates it
 void initializeSystems(void) {
-    systems = (System*)malloc(NUM_QUANTUM_SYSTEMS * sizeof(System));
-    for (int i = 0; i < NUM_QUANTUM_SYSTEMS; i++) {
-        float x = ((float)rand() / RAND_MAX - 0.5) * 20.0f;
-        float y = ((float)rand() / RAND_MAX - 0.5) * 20.0f;
-        float z = ((float)rand() / RAND_MAX - 0.5) * 20.0f;
+    systems = (System*)bigAlloc(memSystems, requestedSystems * sizeof(System));
+    systemsNext = (System*)bigAlloc(memSystems, requestedSystems * sizeof(System));
+    numSystems = requestedSystems;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        float x = (indexRandom(i, 0) - 0.5) * 20.0f;
+        float y = (indexRandom(i, 1) - 0.5) * 20.0f;
+        float z = (indexRandom(i, 2) - 0.5) * 20.0f;
 
-        float vx = ((float)rand() / RAND_MAX - 0.5) * 0.1f;
-        float vy = ((float)rand() / RAND_MAX - 0.5) * 0.1f;
-        float vz = ((float)rand() / RAND_MAX - 0.5) * 0.1f;
+        float vx = (indexRandom(i, 3) - 0.5) * 0.1f;
+        float vy = (indexRandom(i, 4) - 0.5) * 0.1f;
+        float vz = (indexRandom(i, 5) - 0.5) * 0.1f;
 
-        bool isQuantum = (rand() % 2) == 0;
+        bool isQuantum = indexRandom(i, 6) < 0.5f;
         float coherence = 1.0f;
-        float mass = ((float)rand() / RAND_MAX) * MASS_FACTOR;
+        float mass = indexRandom(i, 7) * MASS_FACTOR;
         float curvatureInfluence = 0.0f;
 
-        System s = {x, y, z, vx, vy, vz, isQuantum, coherence, mass, curvatureInfluence};
-        systems[numSystems++] = s;
+        System s = {x, y, z, vx, vy, vz, isQuantum, coherence, mass, curvatureInfluence, i};
+        systems[i] = s;
+        systemsNext[i] = s;
+    }
+}
+
+// Particle-mesh field solver.
+// Masses are deposited on a grid (CIC or TSC) and convolved with 1/r and 1/r^2
+// through one zero-padded FFT round trip. That gives the potential and the
+// local curvature on the grid, and central differences of the potential give
+// the field. All three are interpolated back with the same weights, so one
+// O(N + G log G) pass replaces the O(N^2) sums in the gravity, decoherence
+// and path-integral phases.
+
+typedef struct {
+    float re, im;
+} Complex;
+
+bool useParticleMesh = false;
+int meshSize = PM_DEFAULT_GRID_SIZE; // Nodes per side holding mass, a power of two
+int meshOrder = 2;                   // 2 = cloud-in-cell, 3 = triangular-shaped cloud
+Complex* meshBuffer = NULL;          // (2 * meshSize)^3, padded so the convolution is not periodic
+Complex* meshLines = NULL;           // One line of meshBuffer per thread, fft3d's scratch
+int meshLineThreads = 0;
+float* meshPotentialKernel = NULL;   // Transforms of 1/r and 1/r^2 in grid units
+float* meshCurvatureKernel = NULL;
+float* meshPotentialGrid = NULL;     // meshSize^3 results
+float* meshCurvatureGrid = NULL;
+float* meshCouplingGrid = NULL;      // Potential of mass * curvatureInfluence, for the hybrid Hamiltonian
+int* meshCellStart = NULL;           // Systems binned by their first assignment node
+int* meshCellSystems = NULL;
+float* meshPotential = NULL;         // Per system: sum of mass / distance
+float* meshCurvature = NULL;         // Per system: sum of mass / distance^2
+float (*meshField)[3] = NULL;        // Per system: sum of mass * (r_j - r_i) / distance^3
+float (*meshCoupling)[3] = NULL;     // Per system: the same with mass * curvatureInfluence
+int meshSystems = 0;                 // Systems the five per-system arrays above are sized for
+float meshSelfKernel[2][5][5][5];    // Kernels at small offsets, to remove each system's own mass
+
+// In-place radix-2 FFT of n points spaced stride apart
+static void fft(Complex* data, int n, int inverse) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            Complex t = data[i];
+            data[i] = data[j];
+            data[j] = t;
+        }
+    }
+    for (int length = 2; length <= n; length <<= 1) {
+        double angle = (inverse ? 2.0 : -2.0) * M_PI / length;
+        for (int k = 0; k < length / 2; k++) {
+            float wr = (float)cos(angle * k), wi = (float)sin(angle * k);
+            for (int i = k; i < n; i += length) {
+                Complex* a = &data[i];
+                Complex* b = &data[i + length / 2];
+                float tr = b->re * wr - b->im * wi;
+                float ti = b->re * wi + b->im * wr;
+                b->re = a->re - tr;
+                b->im = a->im - ti;
+                a->re += tr;
+                a->im += ti;
+            }
+        }
+    }
+}
+
+// 3D FFT of an n^3 grid (n = 2 * meshSize), one axis at a time; lines are
+// copied out to meshLines so the butterflies always run on contiguous memory
+static void fft3d(Complex* grid, int n, int inverse) {
+    long strides[3] = {1, n, (long)n * n};
+    for (int axis = 0; axis < 3; axis++) {
+        long stride = strides[axis];
+        #pragma omp parallel num_threads(meshLineThreads)
+        {
+            Complex* line = meshLines + (long)omp_get_thread_num() * n;
+            #pragma omp for schedule(static)
+            for (long l = 0; l < (long)n * n; l++) {
+                // Start of the l-th line along this axis
+                long a = l % n, b = l / n;
+                long start = axis == 0 ? a * n + b * n * n : axis == 1 ? a + b * n * n : a + b * n;
+                for (int i = 0; i < n; i++) line[i] = grid[start + i * stride];
+                fft(line, n, inverse);
+                for (int i = 0; i < n; i++) grid[start + i * stride] = line[i];
+            }
+        }
+    }
+}
+
+// Kernel value at an offset in grid cells; the zero offset is softened to half a cell
+static float meshKernel(int dx, int dy, int dz, int power) {
+    float r2 = (float)(dx * dx + dy * dy + dz * dz);
+    if (r2 == 0.0f) r2 = 0.25f;
+    return power == 1 ? 1.0f / sqrtf(r2) : 1.0f / r2;
+}
+
+void initializeParticleMesh(void) {
+    int n = 2 * meshSize;
+    long padded = (long)n * n * n;
+    long cells = (long)meshSize * meshSize * meshSize;
+    meshBuffer = (Complex*)bigAlloc(memMesh, padded * sizeof(Complex));
+    meshPotentialKernel = (float*)bigAlloc(memMesh, padded * sizeof(float));
+    meshCurvatureKernel = (float*)bigAlloc(memMesh, padded * sizeof(float));
+    meshPotentialGrid = (float*)bigAlloc(memMesh, cells * sizeof(float));
+    meshCurvatureGrid = (float*)bigAlloc(memMesh, cells * sizeof(float));
+    meshCouplingGrid = (float*)bigAlloc(memMesh, cells * sizeof(float));
+    meshCellStart = (int*)memAlloc(memMesh, (cells + 1) * sizeof(int));
+    meshLineThreads = omp_get_max_threads();
+    meshLines = (Complex*)memAlloc(memMesh, (long)meshLineThreads * n * sizeof(Complex));
+    if (meshCellStart == NULL || meshLines == NULL) {
+        fprintf(stderr, "Cannot allocate a %d^3 particle mesh\n", meshSize);
+        exit(1);
+    }
+
+    // Kernels are fixed in grid units; the cell size only rescales the results
+    for (int power = 1; power <= 2; power++) {
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < padded; i++) {
+            int x = i % n, y = (i / n) % n, z = i / ((long)n * n);
+            meshBuffer[i].re = meshKernel(x < n / 2 ? x : x - n, y < n / 2 ? y : y - n, z < n / 2 ? z : z - n, power);
+            meshBuffer[i].im = 0.0f;
+        }
+        fft3d(meshBuffer, n, 0);
+        float* kernel = power == 1 ? meshPotentialKernel : meshCurvatureKernel;
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < padded; i++) kernel[i] = meshBuffer[i].re / padded;
+    }
+
+    for (int power = 1; power <= 2; power++)
+        for (int dx = -2; dx <= 2; dx++)
+            for (int dy = -2; dy <= 2; dy++)
+                for (int dz = -2; dz <= 2; dz++)
+                    meshSelfKernel[power - 1][dx + 2][dy + 2][dz + 2] = meshKernel(dx, dy, dz, power);
+}
+
+void releaseParticleMesh(void) {
+    bigFree(meshBuffer);
+    bigFree(meshPotentialKernel);
+    bigFree(meshCurvatureKernel);
+    bigFree(meshPotentialGrid);
+    bigFree(meshCurvatureGrid);
+    bigFree(meshCouplingGrid);
+    memFree(meshCellStart);
+    memFree(meshLines);
+    meshBuffer = NULL;
+    meshLines = NULL;
+    meshPotentialKernel = meshCurvatureKernel = meshPotentialGrid = meshCurvatureGrid = meshCouplingGrid = NULL;
+    meshCellStart = NULL;
+}
+
+// First node and weights along one axis for a coordinate in grid units
+static inline int meshWeights(float u, float w[3]) {
+    if (meshOrder == 2) {
+        int first = (int)floorf(u);
+        float f = u - first;
+        w[0] = 1.0f - f;
+        w[1] = f;
+        return first;
+    }
+    int nearest = (int)floorf(u + 0.5f);
+    float f = u - nearest;
+    w[0] = 0.5f * (0.5f - f) * (0.5f - f);
+    w[1] = 0.75f - f * f;
+    w[2] = 0.5f * (0.5f + f) * (0.5f + f);
+    return nearest - 1;
+}
+
+// meshWeights, with the first node kept where every weight and the central
+// differences around it stay on the mesh
+static inline int meshFirstNode(float u, float w[3]) {
+    int first = meshWeights(u, w);
+    if (first < 1) return 1;
+    if (first > meshSize - meshOrder - 1) return meshSize - meshOrder - 1;
+    return first;
+}
+
+static inline bool meshPlaced(const System* s, const float lo[3], float extent) {
+    return s->x >= lo[0] && s->x <= lo[0] + extent && s->y >= lo[1] && s->y <= lo[1] + extent &&
+           s->z >= lo[2] && s->z <= lo[2] + extent;
+}
+
+// Coordinate along axis with rank finite systems below it, to within
+// (hi - lo) / PM_HISTOGRAM_BINS^2: a histogram over [lo, hi], then another
+// over the bin the rank falls in
+static float meshRank(const System* systems, int numSystems, int axis, float lo, float hi, long rank) {
+    long count[PM_HISTOGRAM_BINS];
+    for (int level = 0; level < 2; level++) {
+        float width = (hi - lo) / PM_HISTOGRAM_BINS;
+        if (!(width > 0.0f)) break;
+        long below = 0;
+        memset(count, 0, sizeof(count));
+        #pragma omp parallel for schedule(static) reduction(+:below) reduction(+:count[:PM_HISTOGRAM_BINS])
+        for (int i = 0; i < numSystems; i++) {
+            const System* s = &systems[i];
+            if (!isfinite(s->x) || !isfinite(s->y) || !isfinite(s->z)) continue;
+            float p = axis == 0 ? s->x : axis == 1 ? s->y : s->z;
+            if (p < lo) {
+                below++;
+            } else if (p <= hi) {
+                int bin = (int)((p - lo) / width);
+                count[bin < PM_HISTOGRAM_BINS ? bin : PM_HISTOGRAM_BINS - 1]++;
+            }
+        }
+        int bin = 0;
+        while (bin < PM_HISTOGRAM_BINS - 1 && below + count[bin] <= rank) below += count[bin++];
+        lo += bin * width;
+        hi = lo + width;
+    }
+    return lo;
+}
+
+// Cell of the first node a system deposits to
+static inline long meshCell(const System* s, const float origin[3], float h) {
+    float w[3];
+    int fx = meshFirstNode((s->x - origin[0]) / h, w);
+    int fy = meshFirstNode((s->y - origin[1]) / h, w);
+    int fz = meshFirstNode((s->z - origin[2]) / h, w);
+    return ((long)fz * meshSize + fy) * meshSize + fx;
+}
+
+// Running sum of values[0..n) in place: every thread adds up its own chunk,
+// then adds on the ends of the chunks before it
+static void meshPrefixSum(int* values, long n) {
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num(), threads = omp_get_num_threads();
+        long chunk = (n + threads - 1) / threads;
+        long begin = t * chunk < n ? t * chunk : n;
+        long end = begin + chunk < n ? begin + chunk : n;
+        for (long i = begin + 1; i < end; i++) values[i] += values[i - 1];
+        #pragma omp barrier
+        int before = 0;
+        for (long last = chunk; last <= begin; last += chunk) before += values[last - 1];
+        #pragma omp barrier
+        for (long i = begin; i < end; i++) values[i] += before;
+    }
+}
+
+static int compareInts(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Only fills the mesh fields, the systems are read
+void computeParticleMeshFields(System* systems, int numSystems) {
+    int m = meshSize, n = 2 * m;
+    long cells = (long)m * m * m, padded = (long)n * n * n;
+
+    if (meshSystems != numSystems) {
+        bigFree(meshCellSystems);
+        bigFree(meshPotential);
+        bigFree(meshCurvature);
+        bigFree(meshField);
+        bigFree(meshCoupling);
+        meshCellSystems = (int*)bigAlloc(memMesh, numSystems * sizeof(int));
+        meshPotential = (float*)bigAlloc(memMesh, numSystems * sizeof(float));
+        meshCurvature = (float*)bigAlloc(memMesh, numSystems * sizeof(float));
+        meshField = bigAlloc(memMesh, numSystems * sizeof(*meshField));
+        meshCoupling = bigAlloc(memMesh, numSystems * sizeof(*meshCoupling));
+        meshSystems = numSystems;
+    }
+
+    // Cube around the systems, with a margin so every weight lands on the
+    // mesh. A few systems flung far out would stretch it until the cells are
+    // wider than the whole cloud and the curvature, which the nearest
+    // neighbours dominate, comes out orders of magnitude low; then nothing
+    // collapses and the emergent-gravity push grows without limit. So each
+    // axis spans the PM_TAIL to 1 - PM_TAIL quantiles plus half that width
+    // again, clipped to the systems. Systems outside, and any at inf or NaN,
+    // leave no mass on the mesh.
+    float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    long finite = 0;
+    #pragma omp parallel for reduction(min:lo[:3]) reduction(max:hi[:3]) reduction(+:finite)
+    for (int i = 0; i < numSystems; i++) {
+        float p[3] = {systems[i].x, systems[i].y, systems[i].z};
+        if (!isfinite(p[0]) || !isfinite(p[1]) || !isfinite(p[2])) continue;
+        finite++;
+        for (int k = 0; k < 3; k++) {
+            if (p[k] < lo[k]) lo[k] = p[k];
+            if (p[k] > hi[k]) hi[k] = p[k];
+        }
+    }
+    if (finite == 0) {
+        for (int k = 0; k < 3; k++) lo[k] = hi[k] = 0.0f;
+    }
+    long tail = (long)(PM_TAIL * finite);
+    for (int k = 0; k < 3 && tail > 0; k++) {
+        float first = meshRank(systems, numSystems, k, lo[k], hi[k], tail);
+        float last = meshRank(systems, numSystems, k, lo[k], hi[k], finite - 1 - tail);
+        float margin = 0.25f * (last - first);
+        lo[k] = fmaxf(lo[k], first - margin);
+        hi[k] = fminf(hi[k], last + margin);
+    }
+    float extent = fmaxf(fmaxf(hi[0] - lo[0], hi[1] - lo[1]), fmaxf(hi[2] - lo[2], 1e-6f));
+    float h = extent / (m - 6);
+    float origin[3] = {lo[0] - 3.0f * h, lo[1] - 3.0f * h, lo[2] - 3.0f * h};
+
+    // What the systems left off see of the mesh: its mass (and coupling) at
+    // its centre. Summed through reduce.h, so the same on any thread count.
+    double* terms = reduceTerms(&energyTerms, &energyTermsCapacity, numSystems);
+    double placed[5]; // Mass, coupling, mass-weighted x, y, z
+    for (int q = 0; q < 5; q++) {
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < numSystems; i++) {
+            const System* s = &systems[i];
+            double factor = q == 0 ? 1.0 : q == 1 ? s->curvatureInfluence : q == 2 ? s->x : q == 3 ? s->y : s->z;
+            terms[i] = meshPlaced(s, lo, extent) ? s->mass * factor : 0.0;
+        }
+        placed[q] = reduceSum(terms, numSystems);
+    }
+    double placedMass = placed[0], placedCoupling = placed[1], centre[3];
+    for (int k = 0; k < 3; k++) centre[k] = placedMass > 0.0 ? placed[2 + k] / placedMass : 0.0;
+
+    // Bin systems by first node (counting sort), so deposits can be gathered
+    // per node in a fixed order: no atomics there, same sums for any thread
+    // count. Counting and placing use atomics, so each cell's systems are
+    // sorted back into index order afterwards.
+    #pragma omp parallel for schedule(static)
+    for (long c = 0; c <= cells; c++) meshCellStart[c] = 0;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        if (!meshPlaced(&systems[i], lo, extent)) continue;
+        long c = meshCell(&systems[i], origin, h);
+        #pragma omp atomic
+        meshCellStart[c + 1]++;
+    }
+    meshPrefixSum(meshCellStart, cells + 1);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        if (!meshPlaced(&systems[i], lo, extent)) continue;
+        long c = meshCell(&systems[i], origin, h);
+        int slot;
+        #pragma omp atomic capture
+        slot = meshCellStart[c]++;
+        meshCellSystems[slot] = i;
+    }
+    memmove(meshCellStart + 1, meshCellStart, cells * sizeof(int));
+    meshCellStart[0] = 0;
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for (long c = 0; c < cells; c++) {
+        int* list = meshCellSystems + meshCellStart[c];
+        int count = meshCellStart[c + 1] - meshCellStart[c];
+        if (count > 32) {
+            qsort(list, count, sizeof(*list), compareInts);
+        } else {
+            for (int k = 1; k < count; k++) {
+                int i = list[k], j = k;
+                for (; j > 0 && list[j - 1] > i; j--) list[j] = list[j - 1];
+                list[j] = i;
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < padded; i++) {
+        meshBuffer[i].re = 0.0f;
+        meshBuffer[i].im = 0.0f;
+    }
+
+    // Mass goes in the real part, mass * curvatureInfluence in the imaginary
+    // part; the mass is kept in meshCurvatureGrid for the second transform
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int z = 0; z < m; z++) {
+        for (int y = 0; y < m; y++) {
+            for (int x = 0; x < m; x++) {
+                float mass = 0.0f, coupling = 0.0f;
+                for (int cz = z - meshOrder + 1; cz <= z; cz++) {
+                    for (int cy = y - meshOrder + 1; cy <= y; cy++) {
+                        for (int cx = x - meshOrder + 1; cx <= x; cx++) {
+                            if (cx < 0 || cy < 0 || cz < 0) continue;
+                            long c = ((long)cz * m + cy) * m + cx;
+                            for (int k = meshCellStart[c]; k < meshCellStart[c + 1]; k++) {
+                                const System* s = &systems[meshCellSystems[k]];
+                                float wx[3], wy[3], wz[3];
+                                meshFirstNode((s->x - origin[0]) / h, wx);
+                                meshFirstNode((s->y - origin[1]) / h, wy);
+                                meshFirstNode((s->z - origin[2]) / h, wz);
+                                float w = s->mass * wx[x - cx] * wy[y - cy] * wz[z - cz];
+                                mass += w;
+                                coupling += w * s->curvatureInfluence;
+                            }
+                        }
+                    }
+                }
+                meshBuffer[((long)z * n + y) * n + x].re = mass;
+                meshBuffer[((long)z * n + y) * n + x].im = coupling;
+                meshCurvatureGrid[((long)z * m + y) * m + x] = mass;
+            }
+        }
+    }
+
+    // The kernels are real and even, so the real and imaginary parts are
+    // convolved separately: one pair of transforms gives the potential of
+    // the mass and of the coupling, a second one the curvature
+    fft3d(meshBuffer, n, 0);
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < padded; i++) {
+        meshBuffer[i].re *= meshPotentialKernel[i];
+        meshBuffer[i].im *= meshPotentialKernel[i];
+    }
+    fft3d(meshBuffer, n, 1);
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int z = 0; z < m; z++) {
+        for (int y = 0; y < m; y++) {
+            for (int x = 0; x < m; x++) {
+                const Complex* value = &meshBuffer[((long)z * n + y) * n + x];
+                long node = ((long)z * m + y) * m + x;
+                meshPotentialGrid[node] = value->re / h;
+                meshCouplingGrid[node] = value->im / h;
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < padded; i++) {
+        meshBuffer[i].re = 0.0f;
+        meshBuffer[i].im = 0.0f;
+    }
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int z = 0; z < m; z++) {
+        for (int y = 0; y < m; y++) {
+            for (int x = 0; x < m; x++) {
+                meshBuffer[((long)z * n + y) * n + x].re = meshCurvatureGrid[((long)z * m + y) * m + x];
+            }
+        }
+    }
+    fft3d(meshBuffer, n, 0);
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < padded; i++) {
+        meshBuffer[i].re *= meshCurvatureKernel[i];
+        meshBuffer[i].im *= meshCurvatureKernel[i];
+    }
+    fft3d(meshBuffer, n, 1);
+
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int z = 0; z < m; z++) {
+        for (int y = 0; y < m; y++) {
+            for (int x = 0; x < m; x++) {
+                meshCurvatureGrid[((long)z * m + y) * m + x] = meshBuffer[((long)z * n + y) * n + x].re / (h * h);
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        if (!meshPlaced(&systems[i], lo, extent)) {
+            float d[3] = {(float)centre[0] - systems[i].x, (float)centre[1] - systems[i].y, (float)centre[2] - systems[i].z};
+            float distance = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            bool far = isfinite(distance) && distance > 0.0f;
+            meshPotential[i] = far ? placedMass / distance : 0.0f;
+            meshCurvature[i] = far ? placedMass / (distance * distance) : 0.0f;
+            for (int k = 0; k < 3; k++) {
+                meshField[i][k] = far ? placedMass * d[k] / (distance * distance * distance) : 0.0f;
+                meshCoupling[i][k] = far ? placedCoupling * d[k] / (distance * distance * distance) : 0.0f;
+            }
+            continue;
+        }
+        float wx[3], wy[3], wz[3];
+        int fx = meshFirstNode((systems[i].x - origin[0]) / h, wx);
+        int fy = meshFirstNode((systems[i].y - origin[1]) / h, wy);
+        int fz = meshFirstNode((systems[i].z - origin[2]) / h, wz);
+
+        float potential = 0.0f, curvature = 0.0f, field[3] = {0.0f, 0.0f, 0.0f}, coupling[3] = {0.0f, 0.0f, 0.0f};
+        float selfPotential = 0.0f, selfCurvature = 0.0f;
+        for (int a = 0; a < meshOrder; a++) {
+            for (int b = 0; b < meshOrder; b++) {
+                for (int c = 0; c < meshOrder; c++) {
+                    int x = fx + c, y = fy + b, z = fz + a;
+                    float w = wx[c] * wy[b] * wz[a];
+                    long node = ((long)z * m + y) * m + x;
+                    potential += w * meshPotentialGrid[node];
+                    curvature += w * meshCurvatureGrid[node];
+                    // The field points up the potential (toward mass)
+                    field[0] += w * (meshPotentialGrid[node + 1] - meshPotentialGrid[node - 1]);
+                    field[1] += w * (meshPotentialGrid[node + m] - meshPotentialGrid[node - m]);
+                    field[2] += w * (meshPotentialGrid[node + (long)m * m] - meshPotentialGrid[node - (long)m * m]);
+                    coupling[0] += w * (meshCouplingGrid[node + 1] - meshCouplingGrid[node - 1]);
+                    coupling[1] += w * (meshCouplingGrid[node + m] - meshCouplingGrid[node - m]);
+                    coupling[2] += w * (meshCouplingGrid[node + (long)m * m] - meshCouplingGrid[node - (long)m * m]);
+
+                    // What this system's own deposit adds back at its position
+                    for (int a2 = 0; a2 < meshOrder; a2++)
+                        for (int b2 = 0; b2 < meshOrder; b2++)
+                            for (int c2 = 0; c2 < meshOrder; c2++) {
+                                float w2 = w * wx[c2] * wy[b2] * wz[a2];
+                                selfPotential += w2 * meshSelfKernel[0][c2 - c + 2][b2 - b + 2][a2 - a + 2];
+                                selfCurvature += w2 * meshSelfKernel[1][c2 - c + 2][b2 - b + 2][a2 - a + 2];
+                            }
+                }
+            }
+        }
+        meshPotential[i] = potential - systems[i].mass * selfPotential / h;
+        meshCurvature[i] = curvature - systems[i].mass * selfCurvature / (h * h);
+        for (int k = 0; k < 3; k++) {
+            meshField[i][k] = field[k] / (2.0f * h);
+            meshCoupling[i][k] = coupling[k] / (2.0f * h);
+        }
     }
 }
 
 void applySpacetimeFluctuations(System* systems, int numSystems) {
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
-            float fluctuationScale = INITIAL_SPACETIME_FLUCTUATION_SCALE * systems[i].mass;
-            systems[i].x += ((float)rand() / RAND_MAX - 0.5) * fluctuationScale;
-            systems[i].y += ((float)rand() / RAND_MAX - 0.5) * fluctuationScale;
-            systems[i].z += ((float)rand() / RAND_MAX - 0.5) * fluctuationScale;
+        System s = systems[i];
+        if (s.isQuantum) {
+            float fluctuationScale = INITIAL_SPACETIME_FLUCTUATION_SCALE * s.mass;
+            s.x += (stepRandom(s.id, 0) - 0.5) * fluctuationScale;
+            s.y += (stepRandom(s.id, 1) - 0.5) * fluctuationScale;
+            s.z += (stepRandom(s.id, 2) - 0.5) * fluctuationScale;
         }
+        systems[i] = s;
     }
 }
 
 void applyStochasticCurvatureFluctuations(System* systems, int numSystems) {
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
-            systems[i].curvatureInfluence += ((float)rand() / RAND_MAX - 0.5) * CURVATURE_FLUCTUATION_SCALE;
-            float fluctuationScale = INITIAL_SPACETIME_FLUCTUATION_SCALE * systems[i].mass;
+        System s = systems[i];
+        if (s.isQuantum) {
+            s.curvatureInfluence += (stepRandom(s.id, 3) - 0.5) * curvatureFluctuationScale;
+            float fluctuationScale = INITIAL_SPACETIME_FLUCTUATION_SCALE * s.mass;
             // Reduced fluctuation impact to a more physically meaningful scale
-            systems[i].x += ((float)rand() / RAND_MAX - 0.5) * fluctuationScale * 0.05f; 
-            systems[i].y += ((float)rand() / RAND_MAX - 0.5) * fluctuationScale * 0.05f;
-            systems[i].z += ((float)rand() / RAND_MAX - 0.5) * fluctuationScale * 0.05f;
+            s.x += (stepRandom(s.id, 4) - 0.5) * fluctuationScale * 0.05f; 
+            s.y += (stepRandom(s.id, 5) - 0.5) * fluctuationScale * 0.05f;
+            s.z += (stepRandom(s.id, 6) - 0.5) * fluctuationScale * 0.05f;
         }
+        systems[i] = s;
     }
 }
 
 
 
 void applyGravitationalInteraction(System* systems, int numSystems) {
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
+        System s = systems[i];
         float fx = 0.0f;
         float fy = 0.0f;
         float fz = 0.0f;
 
-        for (int j = 0; j < numSystems; j++) {
+        if (useParticleMesh) {
+            // Mesh field, without the pairwise velocity correction
+            fx = gravity * s.mass * meshField[i][0];
+            fy = gravity * s.mass * meshField[i][1];
+            fz = gravity * s.mass * meshField[i][2];
+        } else for (int j = 0; j < numSystems; j++) {
             if (i != j) {
-                float dx = systems[j].x - systems[i].x;
-                float dy = systems[j].y - systems[i].y;
-                float dz = systems[j].z - systems[i].z;
+                float dx = systems[j].x - s.x;
+                float dy = systems[j].y - s.y;
+                float dz = systems[j].z - s.z;
                 float distance = sqrt(dx * dx + dy * dy + dz * dz);
                 if (distance > 0.01f) {
                     // Incorporate relativistic corrections
-                    float force = (G * systems[i].mass * systems[j].mass) / (distance * distance * (1.0f + 0.5f * (systems[i].vx * systems[i].vx + systems[i].vy * systems[i].vy + systems[i].vz * systems[i].vz) / (distance * distance)));
+                    float force = (gravity * s.mass * systems[j].mass) / (distance * distance * (1.0f + 0.5f * (s.vx * s.vx + s.vy * s.vy + s.vz * s.vz) / (distance * distance)));
                     fx += force * dx / distance;
                     fy += force * dy / distance;
                     fz += force * dz / distance;
@@ -127,94 +728,122 @@ void applyGravitationalInteraction(System* systems, int numSystems) {
             }
         }
 
-        systems[i].vx += fx * TIME_STEP / systems[i].mass;
-        systems[i].vy += fy * TIME_STEP / systems[i].mass;
-        systems[i].vz += fz * TIME_STEP / systems[i].mass;
+        // Only the velocity is stored: the other threads are reading positions and masses
+        systems[i].vx = s.vx + fx * TIME_STEP / s.mass;
+        systems[i].vy = s.vy + fy * TIME_STEP / s.mass;
+        systems[i].vz = s.vz + fz * TIME_STEP / s.mass;
     }
 }
 
 
 void quantumClassicalFeedback(System* systems, int numSystems) {
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
-            float curvatureChange = systems[i].coherence * 0.01f; // Reduce influence change rate
-            systems[i].curvatureInfluence += curvatureChange;
-            if (systems[i].curvatureInfluence > 1.0f) systems[i].curvatureInfluence = 1.0f; // Cap the influence
-            if (systems[i].curvatureInfluence < -1.0f) systems[i].curvatureInfluence = -1.0f;
+        System s = systems[i];
+        if (s.isQuantum) {
+            float curvatureChange = s.coherence * 0.01f; // Reduce influence change rate
+            s.curvatureInfluence += curvatureChange;
+            if (s.curvatureInfluence > 1.0f) s.curvatureInfluence = 1.0f; // Cap the influence
+            if (s.curvatureInfluence < -1.0f) s.curvatureInfluence = -1.0f;
         }
+        systems[i] = s;
     }
 }
 
 
 void updateSystems(System* systems, int numSystems) {
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        systems[i].x += systems[i].vx * TIME_STEP;
-        systems[i].y += systems[i].vy * TIME_STEP;
-        systems[i].z += systems[i].vz * TIME_STEP;
+        System s = systems[i];
+        s.x += s.vx * TIME_STEP;
+        s.y += s.vy * TIME_STEP;
+        s.z += s.vz * TIME_STEP;
+        systems[i] = s;
     }
 }
 
-void ensureEnergyConservation(System* systems, int numSystems) {
-    float newTotalEnergy = 0.0f;
+// Kinetic plus pairwise potential energy. One thread adds up each system's
+// term (its kinetic energy and its pairs with later systems) in order, and
+// reduce.h sums the terms, so the total has the same bits on any number of
+// threads and the correction fed back from it does too. With the particle
+// mesh each system's share of the potential is half its mass times the mesh
+// potential of this step instead, O(N); pairs closer than a cell are as soft
+// there as the mesh forces are.
+double computeTotalEnergy(const System* systems, int numSystems) {
+    double* terms = reduceTerms(&energyTerms, &energyTermsCapacity, numSystems);
+    #pragma omp parallel for schedule(dynamic, 16)
     for (int i = 0; i < numSystems; i++) {
-        float kineticEnergy = 0.5f * systems[i].mass * (systems[i].vx * systems[i].vx + systems[i].vy * systems[i].vy + systems[i].vz * systems[i].vz);
-        newTotalEnergy += kineticEnergy;
+        double term = 0.5f * systems[i].mass * (systems[i].vx * systems[i].vx + systems[i].vy * systems[i].vy + systems[i].vz * systems[i].vz);
+        if (useParticleMesh) {
+            terms[i] = term - 0.5 * gravity * systems[i].mass * meshPotential[i];
+            continue;
+        }
         for (int j = i + 1; j < numSystems; j++) {
             float dx = systems[j].x - systems[i].x;
             float dy = systems[j].y - systems[i].y;
             float dz = systems[j].z - systems[i].z;
             float distance = sqrt(dx * dx + dy * dy + dz * dz);
             if (distance > 0.01f) {
-                float potentialEnergy = -G * systems[i].mass * systems[j].mass / distance;
-                newTotalEnergy += potentialEnergy;
+                term += -gravity * systems[i].mass * systems[j].mass / distance;
             }
         }
+        terms[i] = term;
     }
-    float energyCorrection = (totalEnergy - newTotalEnergy) / numSystems * 0.1f; // Reduce correction factor
+    return reduceSum(terms, numSystems);
+}
+
+void ensureEnergyConservation(const System* prev, System* next, int numSystems) {
+    double newTotalEnergy = computeTotalEnergy(prev, numSystems);
+    float energyCorrection = (totalEnergy - newTotalEnergy) / numSystems * 0.1; // Reduce correction factor
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        systems[i].vx += energyCorrection / systems[i].mass; // Adjust based on mass
-        systems[i].vy += energyCorrection / systems[i].mass;
-        systems[i].vz += energyCorrection / systems[i].mass;
+        System s = prev[i];
+        s.vx += energyCorrection / s.mass; // Adjust based on mass
+        s.vy += energyCorrection / s.mass;
+        s.vz += energyCorrection / s.mass;
+        next[i] = s;
     }
     totalEnergy = newTotalEnergy;
 }
 
 
-void applyQuantumClassicalCoupling(System* systems, int numSystems) {
-    #pragma omp parallel for
+void applyQuantumClassicalCoupling(const System* prev, System* next, int numSystems) {
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
+        System s = prev[i];
+        if (s.isQuantum) {
             for (int j = 0; j < numSystems; j++) {
                 if (i != j) {
-                    float dx = systems[j].x - systems[i].x;
-                    float dy = systems[j].y - systems[i].y;
-                    float dz = systems[j].z - systems[i].z;
+                    float dx = prev[j].x - s.x;
+                    float dy = prev[j].y - s.y;
+                    float dz = prev[j].z - s.z;
                     float distance = sqrt(dx * dx + dy * dy + dz * dz);
                     // Interaction term with normalization to avoid singularity
-                    float influence = (G * systems[i].mass * systems[j].mass) / (distance * distance * distance + 1e-5f); // Avoid division by zero
-                    systems[i].vx += influence * dx * systems[j].curvatureInfluence;
-                    systems[i].vy += influence * dy * systems[j].curvatureInfluence;
-                    systems[i].vz += influence * dz * systems[j].curvatureInfluence;
+                    float influence = (gravity * s.mass * prev[j].mass) / (distance * distance * distance + 1e-5f); // Avoid division by zero
+                    s.vx += influence * dx * prev[j].curvatureInfluence;
+                    s.vy += influence * dy * prev[j].curvatureInfluence;
+                    s.vz += influence * dz * prev[j].curvatureInfluence;
                 }
             }
         }
+        next[i] = s;
     }
 }
 
 
 
 void applyEmergentGravity(System* systems, int numSystems) {
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
+        System s = systems[i];
+        if (s.isQuantum) {
             // Use curvature influence and coherence
-            float entropyForce = systems[i].coherence * systems[i].mass * 0.001f * systems[i].curvatureInfluence;
-            systems[i].vx += entropyForce * systems[i].x * TIME_STEP;
-            systems[i].vy += entropyForce * systems[i].y * TIME_STEP;
-            systems[i].vz += entropyForce * systems[i].z * TIME_STEP;
+            float entropyForce = s.coherence * s.mass * 0.001f * s.curvatureInfluence;
+            s.vx += entropyForce * s.x * TIME_STEP;
+            s.vy += entropyForce * s.y * TIME_STEP;
+            s.vz += entropyForce * s.z * TIME_STEP;
         }
+        systems[i] = s;
     }
 }
 
@@ -222,129 +851,319 @@ void applyEmergentGravity(System* systems, int numSystems) {
 
 
 void applyViolentSpacetimeFluctuations(System* systems, int numSystems) {
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
-            float violentFluctuation = ((float)rand() / RAND_MAX - 0.5) * 2 * CURVATURE_FLUCTUATION_SCALE;
-            systems[i].x += violentFluctuation * TIME_STEP;
-            systems[i].y += violentFluctuation * TIME_STEP;
-            systems[i].z += violentFluctuation * TIME_STEP;
+        System s = systems[i];
+        if (s.isQuantum) {
+            float violentFluctuation = (stepRandom(s.id, 7) - 0.5) * 2 * curvatureFluctuationScale;
+            s.x += violentFluctuation * TIME_STEP;
+            s.y += violentFluctuation * TIME_STEP;
+            s.z += violentFluctuation * TIME_STEP;
         }
+        systems[i] = s;
     }
 }
 
-void applyModifiedDecoherence(System* systems, int numSystems) {
-    #pragma omp parallel for
+void applyModifiedDecoherence(const System* prev, System* next, int numSystems) {
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
+        System s = prev[i];
+        if (s.isQuantum) {
             float localCurvature = 0.0f;
-            for (int j = 0; j < numSystems; j++) {
+            if (useParticleMesh) {
+                localCurvature = meshCurvature[i];
+            } else for (int j = 0; j < numSystems; j++) {
                 if (i != j) {
-                    float dx = systems[j].x - systems[i].x;
-                    float dy = systems[j].y - systems[i].y;
-                    float dz = systems[j].z - systems[i].z;
+                    float dx = prev[j].x - s.x;
+                    float dy = prev[j].y - s.y;
+                    float dz = prev[j].z - s.z;
                     float distance = sqrt(dx * dx + dy * dy + dz * dz);
-                    localCurvature += systems[j].mass / (distance * distance);
+                    localCurvature += prev[j].mass / (distance * distance);
                 }
             }
-            systems[i].coherence -= DECOHERENCE_RATE * TIME_STEP * localCurvature;
-            if (systems[i].coherence <= 0.0f) {
-                systems[i].isQuantum = false;
-                systems[i].coherence = 0.0f;
+            s.coherence -= decoherenceRate * TIME_STEP * localCurvature;
+            if (s.coherence <= 0.0f) {
+                s.isQuantum = false;
+                s.coherence = 0.0f;
             }
         }
+        next[i] = s;
     }
 }
 
 void applyHybridHamiltonian(System* systems, int numSystems) {
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
+        System s = systems[i];
+        if (s.isQuantum && useParticleMesh) {
+            s.vx += s.mass * meshCoupling[i][0] * TIME_STEP;
+            s.vy += s.mass * meshCoupling[i][1] * TIME_STEP;
+            s.vz += s.mass * meshCoupling[i][2] * TIME_STEP;
+        } else if (s.isQuantum) {
             for (int j = 0; j < numSystems; j++) {
                 if (i != j) {
-                    float dx = systems[j].x - systems[i].x;
-                    float dy = systems[j].y - systems[i].y;
-                    float dz = systems[j].z - systems[i].z;
+                    float dx = systems[j].x - s.x;
+                    float dy = systems[j].y - s.y;
+                    float dz = systems[j].z - s.z;
                     float distance = sqrt(dx * dx + dy * dy + dz * dz);
-                    float couplingStrength = (systems[i].mass * systems[j].mass) / (distance * distance * distance + 1e-5f); // Normalized interaction term
-                    systems[i].vx += couplingStrength * dx * systems[j].curvatureInfluence * TIME_STEP;
-                    systems[i].vy += couplingStrength * dy * systems[j].curvatureInfluence * TIME_STEP;
-                    systems[i].vz += couplingStrength * dz * systems[j].curvatureInfluence * TIME_STEP;
+                    float couplingStrength = (s.mass * systems[j].mass) / (distance * distance * distance + 1e-5f); // Normalized interaction term
+                    s.vx += couplingStrength * dx * systems[j].curvatureInfluence * TIME_STEP;
+                    s.vy += couplingStrength * dy * systems[j].curvatureInfluence * TIME_STEP;
+                    s.vz += couplingStrength * dz * systems[j].curvatureInfluence * TIME_STEP;
                 }
             }
         }
+        systems[i].vx = s.vx; // Only the velocity, as in applyGravitationalInteraction
+        systems[i].vy = s.vy;
+        systems[i].vz = s.vz;
     }
 }
 
 
 
 
-void applyEntropicForce(System* systems, int numSystems) {
-    #pragma omp parallel for
+void applyEntropicForce(const System* prev, System* next, int numSystems) {
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
-            float entropyForce = systems[i].coherence * systems[i].mass * 0.001f * (rand() / (float)RAND_MAX);
-            systems[i].vx += entropyForce * systems[i].x * TIME_STEP;
-            systems[i].vy += entropyForce * systems[i].y * TIME_STEP;
-            systems[i].vz += entropyForce * systems[i].z * TIME_STEP;
+        System s = prev[i];
+        if (s.isQuantum) {
+            float entropyForce = s.coherence * s.mass * 0.001f * stepRandom(s.id, 8);
+            s.vx += entropyForce * s.x * TIME_STEP;
+            s.vy += entropyForce * s.y * TIME_STEP;
+            s.vz += entropyForce * s.z * TIME_STEP;
         }
+        next[i] = s;
     }
 }
 
 
-void applyCSLDecoherence(System* systems, int numSystems) {
-    #pragma omp parallel for
-    for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
-            float localCurvature = 0.0f;
-            for (int j = 0; j < numSystems; j++) {
-                if (i != j) {
-                    float dx = systems[j].x - systems[i].x;
-                    float dy = systems[j].y - systems[i].y;
-                    float dz = systems[j].z - systems[i].z;
-                    float distance = sqrt(dx * dx + dy * dy + dz * dz);
-                    localCurvature += systems[j].mass / (distance * distance + 1e-5f);
-                }
-            }
-            float collapseProbability = DECOHERENCE_RATE * TIME_STEP * localCurvature;
-            if (((float)rand() / RAND_MAX) < collapseProbability) {
-                systems[i].isQuantum = false;
-                systems[i].coherence = 0.0f;
-            } else {
-                systems[i].coherence -= collapseProbability * 0.1f; // Adjusting coherence reduction rate
-                if (systems[i].coherence < 0.0f) systems[i].coherence = 0.0f;
-            }
+// Event-driven CSL collapse.
+// A quantum system collapses with probability rate = decoherenceRate * dt *
+// local curvature per step. Instead of a Bernoulli trial every step, every
+// system draws one Exp(1) threshold and collapses in the step where its
+// hazard, -log(1 - rate) summed over the steps so far, reaches it: the same
+// survival law as the trials, the product of (1 - rate). The rate needs the O(N) curvature sum,
+// so it is refreshed only when the system has moved CSL_REFRESH_DISTANCE
+// since the last refresh, or every cslRefreshInterval steps (staggered by
+// id); in between the cached rate keeps draining coherence. Predicted
+// collapse steps are kept in a binary heap, so a step only touches the
+// systems that are due. With the particle mesh the curvature costs O(1), so
+// it is read every step and a system is requeued only when its rate moved by
+// more than CSL_RATE_TOLERANCE. The thresholds are memoryless, so when the
+// state is rebuilt (start, file restore) every system simply draws a new
+// one from the current step. The history keeps this state with every step,
+// so a rewound run collapses exactly as it did the first time.
+#define CSL_REFRESH_DEFAULT_INTERVAL 16
+#define CSL_REFRESH_DISTANCE 0.5f
+#define CSL_RATE_TOLERANCE 0.05f
+#define CSL_COHERENCE_LOSS 0.1f // Coherence lost per unit of collapse probability
+#define CSL_NEVER LONG_MAX
+
+typedef struct {
+    float rate;       // Collapse probability per step at the last refresh
+    double hazard;    // -log(1 - rate) summed over the steps since the threshold was drawn
+    double threshold; // Exp(1) draw, the system collapses when hazard reaches it
+    float anchor[3];  // Position at the last refresh
+    long due;         // Step in which hazard reaches threshold at this rate
+    int heapSlot;     // Position in cslHeap, -1 when not queued
+} CslState;
+
+CslState* cslState = NULL;          // By id
+int* cslHeap = NULL;                // Ids, earliest due first, ties by id
+int cslHeapSize = 0;
+unsigned char* cslRefreshed = NULL; // By index, rates refreshed in this step
+bool cslStale = true;               // Rebuild from the systems (start, file restore)
+int cslRefreshInterval = CSL_REFRESH_DEFAULT_INTERVAL;
+long cslRefreshes = 0;              // Rates refreshed in the last step
+
+int systemWithId(int id);
+
+static inline bool cslBefore(int a, int b) {
+    return cslState[a].due < cslState[b].due || (cslState[a].due == cslState[b].due && a < b);
+}
+
+static inline void cslHeapSet(int slot, int id) {
+    cslHeap[slot] = id;
+    cslState[id].heapSlot = slot;
+}
+
+static void cslSiftUp(int slot) {
+    int id = cslHeap[slot];
+    while (slot > 0 && cslBefore(id, cslHeap[(slot - 1) / 2])) {
+        cslHeapSet(slot, cslHeap[(slot - 1) / 2]);
+        slot = (slot - 1) / 2;
+    }
+    cslHeapSet(slot, id);
+}
+
+static void cslSiftDown(int slot) {
+    int id = cslHeap[slot];
+    for (;;) {
+        int child = 2 * slot + 1;
+        if (child >= cslHeapSize) break;
+        if (child + 1 < cslHeapSize && cslBefore(cslHeap[child + 1], cslHeap[child])) child++;
+        if (!cslBefore(cslHeap[child], id)) break;
+        cslHeapSet(slot, cslHeap[child]);
+        slot = child;
+    }
+    cslHeapSet(slot, id);
+}
+
+// Puts an id where its due step belongs: queued, moved, or dropped when never due
+static void cslSchedule(int id) {
+    CslState* st = &cslState[id];
+    int slot = st->heapSlot;
+    if (st->due == CSL_NEVER) {
+        if (slot < 0) return;
+        st->heapSlot = -1;
+        int last = cslHeap[--cslHeapSize];
+        if (slot < cslHeapSize) {
+            cslHeapSet(slot, last);
+            cslSiftUp(slot);
+            cslSiftDown(cslState[last].heapSlot);
         }
+    } else if (slot < 0) {
+        cslHeapSet(cslHeapSize++, id);
+        cslSiftUp(st->heapSlot);
+    } else {
+        cslSiftUp(slot);
+        cslSiftDown(st->heapSlot);
     }
 }
 
+// Hazard of one step at a collapse probability; certain collapse is infinite
+static inline double cslStepHazard(float rate) {
+    return rate >= 1.0f ? INFINITY : -log1p(-(double)rate);
+}
 
+// First step, counting this one, whose hazard reaches the threshold
+static long cslDue(const CslState* st, long step) {
+    if (st->hazard >= st->threshold) return step;
+    if (st->rate <= 0.0f) return CSL_NEVER;
+    if (st->rate >= 1.0f) return step;
+    double steps = ceil((st->threshold - st->hazard) / cslStepHazard(st->rate));
+    return steps > 1e15 ? CSL_NEVER : step - 1 + (long)steps;
+}
 
+static float cslRate(const System* prev, int numSystems, int i) {
+    float localCurvature = 0.0f;
+    if (useParticleMesh) {
+        localCurvature = meshCurvature[i];
+    } else for (int j = 0; j < numSystems; j++) {
+        if (i != j) {
+            float dx = prev[j].x - prev[i].x;
+            float dy = prev[j].y - prev[i].y;
+            float dz = prev[j].z - prev[i].z;
+            float distance = sqrt(dx * dx + dy * dy + dz * dz);
+            localCurvature += prev[j].mass / (distance * distance + 1e-5f);
+        }
+    }
+    return decoherenceRate * TIME_STEP * localCurvature;
+}
 
+static void cslReserve(void) {
+    if (cslState != NULL) return;
+    cslState = (CslState*)bigAlloc(memCsl, numSystems * sizeof(CslState));
+    cslHeap = (int*)bigAlloc(memCsl, numSystems * sizeof(int));
+    cslRefreshed = (unsigned char*)bigAlloc(memCsl, numSystems);
+}
 
+// Queues every id that has a due step again, after cslState was copied in.
+// Ids leave the heap in (due, id) order whatever its layout, so collapses
+// happen as they did before.
+static void cslRequeue(void) {
+    cslHeapSize = 0;
+    for (int id = 0; id < numSystems; id++) cslState[id].heapSlot = -1;
+    for (int id = 0; id < numSystems; id++) cslSchedule(id);
+}
 
+void applyCSLDecoherence(System* systems, int numSystems) {
+    cslReserve();
+    bool all = cslStale;
+    long step = simulationStep;
 
-void ensureContinuousEnergyConservation(System* systems, int numSystems) {
-    float newTotalEnergy = 0.0f;
+    // Refresh the rates that are due; only these pay for the curvature sum
+    long refreshes = 0;
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:refreshes)
     for (int i = 0; i < numSystems; i++) {
-        float kineticEnergy = 0.5f * systems[i].mass * (systems[i].vx * systems[i].vx + systems[i].vy * systems[i].vy + systems[i].vz * systems[i].vz);
-        newTotalEnergy += kineticEnergy;
-        for (int j = i + 1; j < numSystems; j++) {
-            float dx = systems[j].x - systems[i].x;
-            float dy = systems[j].y - systems[i].y;
-            float dz = systems[j].z - systems[i].z;
-            float distance = sqrt(dx * dx + dy * dy + dz * dz);
-            if (distance > 0.01f) {
-                float potentialEnergy = -G * systems[i].mass * systems[j].mass / distance;
-                newTotalEnergy += potentialEnergy;
-            }
+        const System* s = &systems[i];
+        CslState* st = &cslState[s->id];
+        cslRefreshed[i] = 0;
+        if (all) {
+            st->threshold = -log(1.0 - stepRandom(s->id, 9));
+            st->hazard = 0.0;
+            st->rate = 0.0f;
+            st->due = CSL_NEVER;
+            st->heapSlot = -1;
         }
+        if (!s->isQuantum) continue;
+
+        bool due = all || (s->id + step) % cslRefreshInterval == 0;
+        if (!due && !useParticleMesh) {
+            float dx = s->x - st->anchor[0], dy = s->y - st->anchor[1], dz = s->z - st->anchor[2];
+            due = dx * dx + dy * dy + dz * dz > CSL_REFRESH_DISTANCE * CSL_REFRESH_DISTANCE;
+        }
+        if (!due && !useParticleMesh) continue;
+        float rate = cslRate(systems, numSystems, i);
+        if (!due && fabsf(rate - st->rate) <= CSL_RATE_TOLERANCE * st->rate) continue;
+
+        st->rate = rate;
+        st->anchor[0] = s->x;
+        st->anchor[1] = s->y;
+        st->anchor[2] = s->z;
+        st->due = cslDue(st, step);
+        cslRefreshed[i] = 1;
+        refreshes++;
+    }
+    cslRefreshes = refreshes;
+
+    // Requeue in index order, so the heap is the same on any number of threads
+    if (all) cslHeapSize = 0;
+    for (int i = 0; i < numSystems; i++) {
+        if (cslRefreshed[i]) cslSchedule(systems[i].id);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        System s = systems[i];
+        if (s.isQuantum) {
+            CslState* st = &cslState[s.id];
+            st->hazard += cslStepHazard(st->rate);
+            s.coherence -= st->rate * CSL_COHERENCE_LOSS;
+            if (s.coherence < 0.0f) s.coherence = 0.0f;
+        }
+        systems[i] = s;
+    }
+
+    // Collapse whatever is due; rounding can leave a hazard just short, those wait a step
+    while (cslHeapSize > 0 && cslState[cslHeap[0]].due <= step) {
+        int id = cslHeap[0];
+        CslState* st = &cslState[id];
+        if (st->hazard < st->threshold) {
+            long due = cslDue(st, step + 1);
+            st->due = due > step ? due : step + 1;
+            cslSchedule(id);
+            continue;
+        }
+        st->due = CSL_NEVER;
+        cslSchedule(id);
+        System* s = &systems[systemWithId(id)];
+        s->isQuantum = false;
+        s->coherence = 0.0f;
     }
-    float energyCorrection = (totalEnergy - newTotalEnergy) / numSystems * 0.1f; // Adjust correction factor to 0.1f
+    cslStale = false;
+}
+
+void ensureContinuousEnergyConservation(System* systems, int numSystems) {
+    double newTotalEnergy = computeTotalEnergy(systems, numSystems);
+    float energyCorrection = (totalEnergy - newTotalEnergy) / numSystems * 0.1; // Adjust correction factor to 0.1f
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        systems[i].vx += energyCorrection / systems[i].mass; // Adjust based on mass
-        systems[i].vy += energyCorrection / systems[i].mass;
-        systems[i].vz += energyCorrection / systems[i].mass;
+        System s = systems[i];
+        s.vx += energyCorrection / s.mass; // Adjust based on mass
+        s.vy += energyCorrection / s.mass;
+        s.vz += energyCorrection / s.mass;
+        systems[i] = s;
     }
     totalEnergy = newTotalEnergy;
 }
@@ -352,56 +1171,1237 @@ void ensureContinuousEnergyConservation(System* systems, int numSystems) {
 
 
 
-void applyPathIntegralDynamics(System* systems, int numSystems) {
-    #pragma omp parallel for
+void applyPathIntegralDynamics(const System* prev, System* next, int numSystems) {
+    #pragma omp parallel for schedule(static)
     for (int i = 0; i < numSystems; i++) {
-        if (systems[i].isQuantum) {
+        System s = prev[i];
+        if (s.isQuantum) {
             float action = 0.0f;
-            for (int j = 0; j < numSystems; j++) {
+            if (useParticleMesh) {
+                action = -gravity * s.mass * meshPotential[i] * TIME_STEP;
+            } else for (int j = 0; j < numSystems; j++) {
                 if (i != j) {
-                    float dx = systems[j].x - systems[i].x;
-                    float dy = systems[j].y - systems[i].y;
-                    float dz = systems[j].z - systems[i].z;
+                    float dx = prev[j].x - s.x;
+                    float dy = prev[j].y - s.y;
+                    float dz = prev[j].z - s.z;
                     float distance = sqrt(dx * dx + dy * dy + dz * dz);
-                    float potentialEnergy = -G * systems[i].mass * systems[j].mass / distance;
+                    float potentialEnergy = -gravity * s.mass * prev[j].mass / distance;
                     action += potentialEnergy * TIME_STEP;
                 }
             }
-            systems[i].vx += action * systems[i].x * TIME_STEP;
-            systems[i].vy += action * systems[i].y * TIME_STEP;
-            systems[i].vz += action * systems[i].z * TIME_STEP;
+            s.vx += action * s.x * TIME_STEP;
+            s.vy += action * s.y * TIME_STEP;
+            s.vz += action * s.z * TIME_STEP;
             
             // Consolidating violent fluctuations
-            float violentFluctuation = ((float)rand() / RAND_MAX - 0.5) * 2 * CURVATURE_FLUCTUATION_SCALE;
-            systems[i].x += violentFluctuation * TIME_STEP;
-            systems[i].y += violentFluctuation * TIME_STEP;
-            systems[i].z += violentFluctuation * TIME_STEP;
+            float violentFluctuation = (stepRandom(s.id, 10) - 0.5) * 2 * curvatureFluctuationScale;
+            s.x += violentFluctuation * TIME_STEP;
+            s.y += violentFluctuation * TIME_STEP;
+            s.z += violentFluctuation * TIME_STEP;
         }
+        next[i] = s;
     }
 }
 
 
+void recordStep(void);
 
-void display(void) {
-    static bool initialized = false;
+void initializeSimulation(void) {
+    initializeSystems();
+    if (useParticleMesh) {
+        initializeParticleMesh();
+        computeParticleMeshFields(systems, numSystems); // The energy reads the mesh potential
+    }
+    totalEnergy = computeTotalEnergy(systems, numSystems);
+    initialEnergy = totalEnergy;
+    cslStale = true;
+    recordStep();
+}
 
-    if (!initialized) {
-        initializeSystems();
-        for (int i = 0; i < numSystems; i++) {
-            float kineticEnergy = 0.5f * systems[i].mass * (systems[i].vx * systems[i].vx + systems[i].vy * systems[i].vy + systems[i].vz * systems[i].vz);
-            totalEnergy += kineticEnergy;
-            for (int j = i + 1; j < numSystems; j++) {
-                float dx = systems[j].x - systems[i].x;
-                float dy = systems[j].y - systems[i].y;
-                float dz = systems[j].z - systems[i].z;
-                float distance = sqrt(dx * dx + dy * dy + dz * dz);
-                if (distance > 0.01f) {
-                    float potentialEnergy = -G * systems[i].mass * systems[j].mass / distance;
-                    totalEnergy += potentialEnergy;
+// Morton reordering.
+// Systems drift, so after a while neighbours in space are far apart in
+// memory and every pairwise sweep, mesh deposit and k-d tree build jumps
+// around. Every reorderInterval steps the systems are sorted by the Z-order
+// key of their quantised position. Ids stay with the systems; the k-d tree
+// is remapped and the id -> index table rebuilt on demand.
+uint32_t* mortonKeys = NULL;
+uint32_t* mortonKeysScratch = NULL;
+int* mortonOrder = NULL;
+int* mortonOrderScratch = NULL;
+long* mortonNewIndex = NULL;
+
+// Spreads the low 10 bits of v so there are two zero bits between each
+static inline uint32_t mortonSpread(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Stable LSD radix sort of (key, value) pairs, RADIX_BITS per pass. Each
+// thread counts the digits of its own static chunk, one prefix sum over
+// (digit, thread) gives every thread its output offsets, and the scatter
+// keeps chunk order. No atomics, and the result is the same for any thread
+// count because a stable sort has only one answer. Ends in keys/values.
+static void radixSort(uint32_t* keys, int* values, uint32_t* keysScratch, int* valuesScratch, long n, int bits) {
+    int maxThreads = omp_get_max_threads();
+    long* counts = (long*)memAlloc(memMorton, (long)maxThreads * (1 << RADIX_BITS) * sizeof(long));
+    if (counts == NULL) {
+        fprintf(stderr, "Cannot allocate the radix sort counts\n");
+        exit(1);
+    }
+    uint32_t* fromKeys = keys;
+    int* fromValues = values;
+    uint32_t* toKeys = keysScratch;
+    int* toValues = valuesScratch;
+    for (int shift = 0; shift < bits; shift += RADIX_BITS) {
+        #pragma omp parallel
+        {
+            int t = omp_get_thread_num(), threads = omp_get_num_threads();
+            long begin = n * t / threads, end = n * (t + 1) / threads;
+            long* count = &counts[(long)t << RADIX_BITS];
+            memset(count, 0, sizeof(long) << RADIX_BITS);
+            for (long i = begin; i < end; i++) {
+                count[(fromKeys[i] >> shift) & ((1 << RADIX_BITS) - 1)]++;
+            }
+            #pragma omp barrier
+            #pragma omp single
+            {
+                long offset = 0;
+                for (int digit = 0; digit < (1 << RADIX_BITS); digit++) {
+                    for (int u = 0; u < threads; u++) {
+                        long c = counts[((long)u << RADIX_BITS) + digit];
+                        counts[((long)u << RADIX_BITS) + digit] = offset;
+                        offset += c;
+                    }
                 }
             }
+            for (long i = begin; i < end; i++) {
+                long slot = count[(fromKeys[i] >> shift) & ((1 << RADIX_BITS) - 1)]++;
+                toKeys[slot] = fromKeys[i];
+                toValues[slot] = fromValues[i];
+            }
+        }
+        uint32_t* swapKeys = fromKeys;
+        fromKeys = toKeys;
+        toKeys = swapKeys;
+        int* swapValues = fromValues;
+        fromValues = toValues;
+        toValues = swapValues;
+    }
+    if (fromKeys != keys) {
+        memcpy(keys, fromKeys, n * sizeof(uint32_t));
+        memcpy(values, fromValues, n * sizeof(int));
+    }
+    memFree(counts);
+}
+
+void reorderSystems(void) {
+    if (mortonKeys == NULL) {
+        mortonKeys = (uint32_t*)bigAlloc(memMorton, numSystems * sizeof(uint32_t));
+        mortonKeysScratch = (uint32_t*)bigAlloc(memMorton, numSystems * sizeof(uint32_t));
+        mortonOrder = (int*)bigAlloc(memMorton, numSystems * sizeof(int));
+        mortonOrderScratch = (int*)bigAlloc(memMorton, numSystems * sizeof(int));
+        mortonNewIndex = (long*)bigAlloc(memMorton, numSystems * sizeof(long));
+    }
+
+    float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    #pragma omp parallel for reduction(min:lo[:3]) reduction(max:hi[:3])
+    for (int i = 0; i < numSystems; i++) {
+        float p[3] = {systems[i].x, systems[i].y, systems[i].z};
+        for (int k = 0; k < 3; k++) {
+            if (p[k] < lo[k]) lo[k] = p[k];
+            if (p[k] > hi[k]) hi[k] = p[k];
+        }
+    }
+    float extent = fmaxf(fmaxf(hi[0] - lo[0], hi[1] - lo[1]), fmaxf(hi[2] - lo[2], 1e-6f));
+    float scale = ((1 << MORTON_BITS) - 1) / extent;
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        uint32_t q[3];
+        float p[3] = {systems[i].x, systems[i].y, systems[i].z};
+        for (int k = 0; k < 3; k++) {
+            float v = (p[k] - lo[k]) * scale;
+            q[k] = isfinite(v) ? (uint32_t)fminf(fmaxf(v, 0.0f), (1 << MORTON_BITS) - 1) : 0;
+        }
+        mortonKeys[i] = mortonSpread(q[0]) | (mortonSpread(q[1]) << 1) | (mortonSpread(q[2]) << 2);
+        mortonOrder[i] = i;
+    }
+    radixSort(mortonKeys, mortonOrder, mortonKeysScratch, mortonOrderScratch, numSystems, 3 * MORTON_BITS);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        systemsNext[i] = systems[mortonOrder[i]];
+        mortonNewIndex[mortonOrder[i]] = i;
+    }
+    System* swap = systems;
+    systems = systemsNext;
+    systemsNext = swap;
+
+    kdRemap(&systemIndex, mortonNewIndex);
+    systemSlotStale = true;
+}
+
+// Index of a system in systems[] by its id
+int systemWithId(int id) {
+    if (systemSlotStale) {
+        if (systemSlot == NULL) systemSlot = (int*)bigAlloc(memIndex, numSystems * sizeof(int));
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < numSystems; i++) {
+            systemSlot[systems[i].id] = i;
+        }
+        systemSlotStale = false;
+    }
+    return systemSlot[id];
+}
+
+// Fields of a system, for what a phase writes and what it reads of the others
+#define FIELD_POSITION 1  // x, y, z
+#define FIELD_VELOCITY 2  // vx, vy, vz
+#define FIELD_QUANTUM 4   // isQuantum, coherence
+#define FIELD_MASS 8
+#define FIELD_CURVATURE 16 // curvatureInfluence
+
+// The phases of one step in order, timed one by one. An in-place phase is
+// race-free only while it writes none of the fields it reads of other
+// systems as it writes (gravity and the hybrid Hamiltonian read positions
+// and write velocities). The table says which is which; checkPhases refuses
+// to step with an in-place phase that breaks this, and a build with
+// -DPHASE_CHECK also compares every system before and after each in-place
+// phase against what it declares. Anything that has to write what it reads
+// (path integral: positions) goes through run and the second buffer.
+typedef struct {
+    const char* name;
+    void (*update)(System* systems, int numSystems);               // Changes the state in place, or
+    void (*run)(const System* prev, System* next, int numSystems); // fills next, which then becomes the state
+    bool* enabled;   // NULL = always runs
+    int writes;      // FIELD_ bits the phase may change
+    int readsOthers; // FIELD_ bits it reads of other systems while writing
+} Phase;
+
+Phase phases[] = {
+    // Shared by every O(N^2) phase below, writes only the mesh arrays
+    {"particle_mesh", computeParticleMeshFields, NULL, &useParticleMesh,
+     0, FIELD_POSITION | FIELD_MASS | FIELD_CURVATURE},
+    {"spacetime_fluctuations", applySpacetimeFluctuations, NULL, NULL, FIELD_POSITION, 0},
+    {"curvature_fluctuations", applyStochasticCurvatureFluctuations, NULL, NULL, FIELD_POSITION | FIELD_CURVATURE, 0},
+    {"gravity", applyGravitationalInteraction, NULL, NULL, FIELD_VELOCITY, FIELD_POSITION | FIELD_MASS},
+    {"csl_decoherence", applyCSLDecoherence, NULL, NULL, FIELD_QUANTUM, FIELD_POSITION | FIELD_MASS},
+    {"feedback", quantumClassicalFeedback, NULL, NULL, FIELD_CURVATURE, 0},
+    {"hybrid_hamiltonian", applyHybridHamiltonian, NULL, NULL,
+     FIELD_VELOCITY, FIELD_POSITION | FIELD_MASS | FIELD_CURVATURE},
+    {"emergent_gravity", applyEmergentGravity, NULL, NULL, FIELD_VELOCITY, 0},
+    {"violent_fluctuations", applyViolentSpacetimeFluctuations, NULL, NULL, FIELD_POSITION, 0},
+    {"path_integral", NULL, applyPathIntegralDynamics, NULL, FIELD_POSITION | FIELD_VELOCITY, FIELD_POSITION | FIELD_MASS},
+    {"update", updateSystems, NULL, NULL, FIELD_POSITION, 0},
+    // The total is summed over every system before any velocity changes
+    {"energy_conservation", ensureContinuousEnergyConservation, NULL, NULL, FIELD_VELOCITY, 0},
+};
+#define NUM_PHASES (int)(sizeof(phases) / sizeof(phases[0]))
+
+void checkPhases(void) {
+    for (int p = 0; p < NUM_PHASES; p++) {
+        if (phases[p].update != NULL && (phases[p].writes & phases[p].readsOthers)) {
+            fprintf(stderr, "Phase %s writes fields it reads of other systems, it has to run double buffered\n",
+                    phases[p].name);
+            exit(1);
+        }
+    }
+}
+
+#ifdef PHASE_CHECK
+// Exits when a phase changed a field it does not declare; before is the state going in
+static void checkPhaseWrites(const Phase* phase, const System* before, const System* after, int numSystems) {
+    for (int i = 0; i < numSystems; i++) {
+        const System* a = &before[i];
+        const System* b = &after[i];
+        // Bits, not values: a NaN that stays put has not changed
+        #define DIFFERS(field) (memcmp(&a->field, &b->field, sizeof(a->field)) != 0)
+        int changed = (DIFFERS(x) || DIFFERS(y) || DIFFERS(z) ? FIELD_POSITION : 0) |
+                      (DIFFERS(vx) || DIFFERS(vy) || DIFFERS(vz) ? FIELD_VELOCITY : 0) |
+                      (DIFFERS(isQuantum) || DIFFERS(coherence) ? FIELD_QUANTUM : 0) |
+                      (DIFFERS(mass) ? FIELD_MASS : 0) | (DIFFERS(curvatureInfluence) ? FIELD_CURVATURE : 0);
+        #undef DIFFERS
+        if ((changed & ~phase->writes) || a->id != b->id) {
+            fprintf(stderr, "Phase %s changed fields %#x of system %d, it declares %#x\n",
+                    phase->name, changed, a->id, phase->writes);
+            exit(1);
+        }
+    }
+}
+#endif
+double phaseSeconds[NUM_PHASES]; // Time each phase took in the last step
+
+void publishMetrics(double stepSeconds);
+
+void stepSimulation(void) {
+    static bool checked = false;
+    if (!checked) checkPhases();
+    checked = true;
+    double stepStart = omp_get_wtime();
+    if (reorderInterval > 0 && simulationStep > 0 && simulationStep % reorderInterval == 0) {
+        reorderSystems();
+    }
+    for (int p = 0; p < NUM_PHASES; p++) {
+        phaseSeconds[p] = 0.0;
+        if (phases[p].enabled != NULL && !*phases[p].enabled) continue;
+        double startTime = omp_get_wtime();
+        if (phases[p].update != NULL) {
+#ifdef PHASE_CHECK
+            memcpy(systemsNext, systems, numSystems * sizeof(System));
+            phases[p].update(systems, numSystems);
+            checkPhaseWrites(&phases[p], systemsNext, systems, numSystems);
+#else
+            phases[p].update(systems, numSystems);
+#endif
+        } else {
+            phases[p].run(systems, systemsNext, numSystems);
+            System* swap = systems;
+            systems = systemsNext;
+            systemsNext = swap;
+        }
+        phaseSeconds[p] = omp_get_wtime() - startTime;
+    }
+    simulationStep++;
+    systemIndexStale = true;
+    recordStep();
+    if (metricsEnabled) {
+        publishMetrics(omp_get_wtime() - stepStart);
+    }
+}
+
+// Prometheus series, registered by registerMetrics before the server starts
+int metricSteps, metricFrames, metricStepSeconds, metricPhase[NUM_PHASES];
+int metricEnergy, metricEnergyDrift, metricQuantum, metricClassical, metricCoherence;
+int metricStep, metricHistoryBytes, metricQuality, metricCslRefreshes;
+int metricMemory[MEM_MAX_TAGS], metricMemoryPeak[MEM_MAX_TAGS];
+
+void registerMetrics(void) {
+    metricSteps = metricsRegister("postquantum_steps_total", "counter", "Simulation steps taken");
+    metricFrames = metricsRegister("postquantum_frames_total", "counter", "Frames drawn");
+    metricStepSeconds = metricsRegister("postquantum_step_seconds", "gauge", "Duration of the last step");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        char name[96];
+        snprintf(name, sizeof(name), "postquantum_phase_seconds{phase=\"%s\"}", phases[p].name);
+        metricPhase[p] = metricsRegister(name, "gauge", "Duration of each phase in the last step");
+    }
+    metricEnergy = metricsRegister("postquantum_energy", "gauge", "Total energy");
+    metricEnergyDrift = metricsRegister("postquantum_energy_drift", "gauge", "Relative change of total energy since the start");
+    metricQuantum = metricsRegister("postquantum_systems{kind=\"quantum\"}", "gauge", "Systems by kind");
+    metricClassical = metricsRegister("postquantum_systems{kind=\"classical\"}", "gauge", "Systems by kind");
+    metricCoherence = metricsRegister("postquantum_coherence_mean", "gauge", "Mean coherence over all systems");
+    metricStep = metricsRegister("postquantum_step", "gauge", "Current simulation step (moves back while scrubbing history)");
+    metricHistoryBytes = metricsRegister("postquantum_history_bytes", "gauge", "Memory held by the time-travel history");
+    metricQuality = metricsRegister("postquantum_quality_level", "gauge", "Adaptive quality level, 0 is full quality");
+    metricCslRefreshes = metricsRegister("postquantum_csl_refreshes", "gauge", "Collapse rates recomputed in the last step");
+    for (int t = 0; t < numMemTags; t++) {
+        char name[96];
+        snprintf(name, sizeof(name), "postquantum_memory_bytes{tag=\"%.23s\"}", memTags[t].name);
+        metricMemory[t] = metricsRegister(name, "gauge", "Memory allocated per subsystem");
+        snprintf(name, sizeof(name), "postquantum_memory_peak_bytes{tag=\"%.23s\"}", memTags[t].name);
+        metricMemoryPeak[t] = metricsRegister(name, "gauge", "Most memory ever allocated per subsystem");
+    }
+}
+
+void publishMetrics(double stepSeconds) {
+    long quantum = 0;
+    double* terms = reduceTerms(&energyTerms, &energyTermsCapacity, numSystems);
+    #pragma omp parallel for schedule(static) reduction(+:quantum)
+    for (int i = 0; i < numSystems; i++) {
+        quantum += systems[i].isQuantum;
+        terms[i] = systems[i].coherence;
+    }
+    double coherence = reduceSum(terms, numSystems);
+
+    metricsAdd(metricSteps, 1.0);
+    metricsSet(metricStepSeconds, stepSeconds);
+    for (int p = 0; p < NUM_PHASES; p++) metricsSet(metricPhase[p], phaseSeconds[p]);
+    metricsSet(metricEnergy, totalEnergy);
+    metricsSet(metricEnergyDrift, initialEnergy != 0.0 ? (totalEnergy - initialEnergy) / fabs(initialEnergy) : 0.0);
+    metricsSet(metricQuantum, (double)quantum);
+    metricsSet(metricClassical, (double)(numSystems - quantum));
+    metricsSet(metricCoherence, coherence / numSystems);
+    metricsSet(metricStep, (double)simulationStep);
+    metricsSet(metricCslRefreshes, (double)cslRefreshes);
+    for (int t = 0; t < numMemTags; t++) {
+        metricsSet(metricMemory[t], (double)memTags[t].live);
+        metricsSet(metricMemoryPeak[t], (double)memTags[t].peak);
+    }
+    metricsPublish();
+}
+
+// Refit (or rebuild) the index once per step, and only if something asks
+void refreshSystemIndex(void) {
+    if (systemIndexStale) {
+        if (playing) kdBuild(&systemIndex, systems, sizeof(System), numSystems); // Frames may be in another order
+        else kdUpdate(&systemIndex, systems, sizeof(System), numSystems);
+        systemIndexStale = false;
+    }
+}
+
+// Systems within radius of p; returns the count, stores up to capacity indices
+long systemsWithinRadius(const float p[3], float radius, long* out, long capacity) {
+    refreshSystemIndex();
+    return kdRadius(&systemIndex, p, radius, out, capacity);
+}
+
+#ifndef POSTQUANTUM_LIBRARY
+// Front-most system under the pixel, using the matrices of the last frame
+void pickSystem(int x, int y) {
+    GLdouble model[16], projection[16];
+    GLint viewport[4];
+    glGetDoublev(GL_MODELVIEW_MATRIX, model);
+    glGetDoublev(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    GLdouble nx, ny, nz, fx, fy, fz;
+    double winY = viewport[3] - y - 1;
+    gluUnProject(x, winY, 0.0, model, projection, viewport, &nx, &ny, &nz);
+    gluUnProject(x, winY, 1.0, model, projection, viewport, &fx, &fy, &fz);
+    float origin[3] = {(float)nx, (float)ny, (float)nz};
+    float dir[3] = {(float)(fx - nx), (float)(fy - ny), (float)(fz - nz)};
+    float length = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+    for (int k = 0; k < 3; k++) dir[k] /= length;
+
+    refreshSystemIndex();
+    long index = kdPick(&systemIndex, origin, dir, PICK_TAN_ANGLE);
+    if (index < 0) {
+        selectedSystem = -1;
+        printf("Nothing under the cursor\n");
+        return;
+    }
+
+    System* s = &systems[index];
+    selectedSystem = s->id;
+    printf("System %d (%s) at (%.3f, %.3f, %.3f)\n", selectedSystem, s->isQuantum ? "quantum" : "classical", s->x, s->y, s->z);
+    printf("  mass %.4f  coherence %.4f  curvature influence %.4g\n", s->mass, s->coherence, s->curvatureInfluence);
+
+    // Neighbourhood summary
+    float p[3] = {s->x, s->y, s->z};
+    long capacity = numSystems;
+    long* neighbours = (long*)memAlloc(memIndex, capacity * sizeof(long));
+    long count = systemsWithinRadius(p, NEIGHBOURHOOD_RADIUS, neighbours, capacity);
+    float coherence = 0.0f;
+    for (long i = 0; i < count; i++) {
+        coherence += systems[neighbours[i]].coherence;
+    }
+    printf("  %ld systems within %.1f, mean coherence %.4f\n", count - 1, NEIGHBOURHOOD_RADIUS, coherence / count);
+    memFree(neighbours);
+}
+#endif
+
+// Sprites stand in for glutSolidSphere(0.1) and glutSolidCube(0.2)
+void collectSprites(SoftRenderer* renderer) {
+    SoftSprite* sprites = softReserveSprites(renderer, numSystems);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        SoftSprite* sprite = &sprites[i];
+        sprite->p[0] = systems[i].x;
+        sprite->p[1] = systems[i].y;
+        sprite->p[2] = systems[i].z;
+        sprite->radius = 0.1f;
+        sprite->color[0] = systems[i].isQuantum ? 0 : 255;
+        sprite->color[1] = systems[i].isQuantum ? 255 : 0;
+        sprite->color[2] = 0;
+        sprite->shape = systems[i].isQuantum ? SOFT_DISC : SOFT_SQUARE;
+    }
+}
+
+// Ensemble runner.
+// A sweep file lists runs as key=value assignments, one group per line. A
+// value can be a list (G=0.0005,0.001,0.002), a range with a count
+// (G=0.0005:0.002:4), or for integers an inclusive range (seed=1..100).
+// Each line expands to the cartesian product of its keys. Every run gets
+// its own forked process: a run only touches its own globals and its own
+// OpenMP pool. Small runs are packed one per core, larger ones get threads
+// in proportion to the work in each step. Every run appends CSV lines to
+// one results file; each line is a single O_APPEND write, so lines from
+// different runs never interleave.
+
+#define ENSEMBLE_MAX_VALUES 4096
+#define ENSEMBLE_WORK_PER_THREAD 4e6 // Pair interactions per step that keep one more thread busy
+#define ENSEMBLE_REPORT_INTERVAL 10  // Steps between result lines
+
+typedef struct {
+    float gravity, decoherenceRate, curvatureFluctuationScale;
+    uint64_t seed;
+    int systems, steps, meshSize; // meshSize 0 sums pairs directly
+    double cost;
+    int threads, index;
+} EnsembleRun;
+
+typedef struct {
+    char key[32];
+    double values[ENSEMBLE_MAX_VALUES];
+    int count;
+} SweepAxis;
+
+EnsembleRun* ensembleRuns = NULL;
+int numEnsembleRuns = 0, ensembleCapacity = 0;
+int ensembleSteps = 100;
+
+// One value list: a,b,c  or  lo:hi:count  or  first..last
+static int parseSweepValues(const char* text, double* values) {
+    double lo, hi;
+    int count;
+    long first, last;
+    if (sscanf(text, "%lf:%lf:%d", &lo, &hi, &count) == 3 && count > 0) {
+        for (int i = 0; i < count && i < ENSEMBLE_MAX_VALUES; i++) {
+            values[i] = count == 1 ? lo : lo + (hi - lo) * i / (count - 1);
+        }
+        return count < ENSEMBLE_MAX_VALUES ? count : ENSEMBLE_MAX_VALUES;
+    }
+    if (strstr(text, "..") != NULL && sscanf(text, "%ld..%ld", &first, &last) == 2) {
+        int n = 0;
+        for (long v = first; v <= last && n < ENSEMBLE_MAX_VALUES; v++) values[n++] = (double)v;
+        return n;
+    }
+    int n = 0;
+    const char* p = text;
+    while (*p != '\0' && n < ENSEMBLE_MAX_VALUES) {
+        char* end;
+        values[n] = strtod(p, &end);
+        if (end == p) break;
+        n++;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+static void addEnsembleRun(SweepAxis* axes, int numAxes, const int* choice) {
+    EnsembleRun run = {G, DECOHERENCE_RATE, CURVATURE_FLUCTUATION_SCALE, 1, NUM_QUANTUM_SYSTEMS, ensembleSteps, 0, 0.0, 1, 0};
+    for (int a = 0; a < numAxes; a++) {
+        double v = axes[a].values[choice[a]];
+        if (strcmp(axes[a].key, "G") == 0) run.gravity = (float)v;
+        else if (strcmp(axes[a].key, "decoherence") == 0) run.decoherenceRate = (float)v;
+        else if (strcmp(axes[a].key, "curvature") == 0) run.curvatureFluctuationScale = (float)v;
+        else if (strcmp(axes[a].key, "seed") == 0) run.seed = (uint64_t)v;
+        else if (strcmp(axes[a].key, "N") == 0) run.systems = (int)v;
+        else if (strcmp(axes[a].key, "steps") == 0) run.steps = (int)v;
+        else if (strcmp(axes[a].key, "pm") == 0) run.meshSize = (int)v;
+    }
+
+    if (numEnsembleRuns == ensembleCapacity) {
+        ensembleCapacity = ensembleCapacity ? ensembleCapacity * 2 : 64;
+        ensembleRuns = (EnsembleRun*)realloc(ensembleRuns, ensembleCapacity * sizeof(EnsembleRun));
+        if (ensembleRuns == NULL) {
+            fprintf(stderr, "Cannot allocate %d ensemble runs\n", ensembleCapacity);
+            exit(1);
+        }
+    }
+    run.index = numEnsembleRuns;
+    ensembleRuns[numEnsembleRuns++] = run;
+}
+
+int loadSweep(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    static SweepAxis axes[8];
+    char line[4096];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char* hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+
+        int numAxes = 0;
+        for (char* token = strtok(line, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+            char* equals = strchr(token, '=');
+            if (equals == NULL || numAxes == 8 || equals - token >= (long)sizeof(axes[0].key)) {
+                fprintf(stderr, "%s:%d: cannot read '%s'\n", path, lineNumber, token);
+                fclose(file);
+                return -1;
+            }
+            *equals = '\0';
+            const char* keys[] = {"G", "decoherence", "curvature", "seed", "N", "steps", "pm"};
+            int known = 0;
+            for (int k = 0; k < 7; k++) known |= strcmp(token, keys[k]) == 0;
+            axes[numAxes].count = parseSweepValues(equals + 1, axes[numAxes].values);
+            if (!known || axes[numAxes].count == 0) {
+                fprintf(stderr, "%s:%d: bad assignment %s=%s\n", path, lineNumber, token, equals + 1);
+                fclose(file);
+                return -1;
+            }
+            strcpy(axes[numAxes].key, token);
+            numAxes++;
+        }
+        if (numAxes == 0) continue;
+
+        // Odometer over the axes
+        int choice[8] = {0};
+        for (;;) {
+            addEnsembleRun(axes, numAxes, choice);
+            int a = numAxes - 1;
+            while (a >= 0 && ++choice[a] == axes[a].count) choice[a--] = 0;
+            if (a < 0) break;
+        }
+    }
+    fclose(file);
+    return numEnsembleRuns;
+}
+
+// Work per step in pair interactions; with the particle mesh nothing is
+// pairwise any more, it is four transforms and O(N) per system
+static double ensembleStepCost(const EnsembleRun* run) {
+    double n = run->systems;
+    double pairs = 0.5 * n * n;
+    if (run->meshSize == 0) return pairs * 8.0; // Eight O(N^2) phases plus the energy sum
+    double cells = 8.0 * run->meshSize * run->meshSize * run->meshSize;
+    return 6.0 * cells * log2(cells) + 96.0 * n;
+}
+
+static void writeEnsembleLine(int fd, const EnsembleRun* run, int threads, double seconds) {
+    double* terms = reduceTerms(&energyTerms, &energyTermsCapacity, numSystems);
+    long quantum = 0;
+    #pragma omp parallel for schedule(static) reduction(+:quantum)
+    for (int i = 0; i < numSystems; i++) {
+        System* s = &systems[i];
+        terms[i] = 0.5 * s->mass * (s->vx * s->vx + s->vy * s->vy + s->vz * s->vz);
+        quantum += s->isQuantum;
+    }
+    double kinetic = reduceSum(terms, numSystems);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) terms[i] = systems[i].coherence;
+    double coherence = reduceSum(terms, numSystems);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numSystems; i++) {
+        terms[i] = systems[i].x * systems[i].x + systems[i].y * systems[i].y + systems[i].z * systems[i].z;
+    }
+    double radius2 = reduceSum(terms, numSystems);
+
+    char line[512];
+    int length = snprintf(line, sizeof(line), "%d,%llu,%d,%g,%g,%g,%d,%d,%ld,%.3f,%.6g,%.6g,%.6g,%.6g,%.6g\n",
+                          run->index, (unsigned long long)run->seed, run->systems, run->gravity,
+                          run->decoherenceRate, run->curvatureFluctuationScale, run->meshSize, threads,
+                          simulationStep, seconds, totalEnergy, kinetic, coherence / numSystems,
+                          (double)quantum / numSystems, sqrt(radius2 / numSystems));
+    if (write(fd, line, length) != length) {
+        perror("results");
+    }
+}
+
+int planMemory(int window, int degrade);
+
+// Body of one forked worker
+static void runEnsembleMember(const EnsembleRun* run, int fd) {
+    omp_set_num_threads(run->threads);
+    gravity = run->gravity;
+    decoherenceRate = run->decoherenceRate;
+    curvatureFluctuationScale = run->curvatureFluctuationScale;
+    seed = run->seed;
+    requestedSystems = run->systems;
+    useParticleMesh = run->meshSize > 0;
+    if (useParticleMesh) meshSize = run->meshSize;
+    // A smaller run would not be the run the sweep asked for, so no degrading here
+    if (planMemory(0, 0) != 0) exit(1);
+
+    double startTime = omp_get_wtime();
+    initializeSimulation();
+    while (simulationStep < run->steps) {
+        stepSimulation();
+        if (simulationStep % ENSEMBLE_REPORT_INTERVAL == 0 || simulationStep == run->steps) {
+            writeEnsembleLine(fd, run, run->threads, omp_get_wtime() - startTime);
+        }
+    }
+}
+
+static int compareRunCost(const void* a, const void* b) {
+    const EnsembleRun* ra = (const EnsembleRun*)a;
+    const EnsembleRun* rb = (const EnsembleRun*)b;
+    if (ra->cost != rb->cost) return ra->cost < rb->cost ? 1 : -1;
+    return ra->index - rb->index;
+}
+
+// Longest runs first; whenever cores free up, start the first pending run
+// that fits, so short single-thread runs fill the gaps around wide ones
+int runEnsemble(const char* sweepPath, const char* resultsPath) {
+    if (loadSweep(sweepPath) <= 0) {
+        fprintf(stderr, "No runs in %s\n", sweepPath);
+        return 1;
+    }
+
+    // No OpenMP region may run in this process before the forks: worker
+    // processes would inherit a thread pool whose threads did not survive
+    int cores = omp_get_max_threads();
+    for (int i = 0; i < numEnsembleRuns; i++) {
+        EnsembleRun* run = &ensembleRuns[i];
+        if (run->systems < 1 || run->steps < 0 ||
+            (run->meshSize != 0 && (run->meshSize < 16 || (run->meshSize & (run->meshSize - 1)) != 0))) {
+            fprintf(stderr, "Run %d: needs N >= 1, steps >= 0 and pm a power of two >= 16\n", i);
+            return 1;
+        }
+        double stepCost = ensembleStepCost(run);
+        run->threads = (int)(stepCost / ENSEMBLE_WORK_PER_THREAD);
+        if (run->threads < 1) run->threads = 1;
+        if (run->threads > cores) run->threads = cores;
+        run->cost = stepCost * run->steps;
+    }
+    qsort(ensembleRuns, numEnsembleRuns, sizeof(EnsembleRun), compareRunCost);
+
+    int fd = open(resultsPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        perror(resultsPath);
+        return 1;
+    }
+    const char* header = "run,seed,systems,G,decoherence,curvature,pm,threads,step,seconds,energy,kinetic,coherence,quantum_fraction,rms_radius\n";
+    if (write(fd, header, strlen(header)) < 0) perror(resultsPath);
+
+    printf("Ensemble of %d runs on %d cores, results in %s\n", numEnsembleRuns, cores, resultsPath);
+    fflush(stdout);
+
+    pid_t* pids = (pid_t*)calloc(numEnsembleRuns, sizeof(pid_t));
+    char* started = (char*)calloc(numEnsembleRuns, 1);
+    int freeCores = cores, running = 0, finished = 0, failed = 0;
+    double startTime = omp_get_wtime();
+    while (finished < numEnsembleRuns) {
+        int launched = 0;
+        for (int i = 0; i < numEnsembleRuns && freeCores > 0; i++) {
+            if (started[i] || ensembleRuns[i].threads > freeCores) continue;
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                break;
+            }
+            if (pid == 0) {
+                runEnsembleMember(&ensembleRuns[i], fd);
+                _exit(0);
+            }
+            pids[i] = pid;
+            started[i] = 1;
+            freeCores -= ensembleRuns[i].threads;
+            running++;
+            launched++;
+        }
+        if (running == 0 && launched == 0) {
+            fprintf(stderr, "Cannot start any more runs\n");
+            break;
+        }
+
+        int status;
+        pid_t done = wait(&status);
+        if (done < 0) break;
+        for (int i = 0; i < numEnsembleRuns; i++) {
+            if (pids[i] != done) continue;
+            pids[i] = 0;
+            freeCores += ensembleRuns[i].threads;
+            running--;
+            finished++;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "Run %d failed\n", ensembleRuns[i].index);
+                failed++;
+            }
+            printf("Run %d done (%d/%d, %d threads, %.1fs elapsed)\n",
+                   ensembleRuns[i].index, finished, numEnsembleRuns, ensembleRuns[i].threads, omp_get_wtime() - startTime);
+            fflush(stdout);
+        }
+    }
+
+    close(fd);
+    free(pids);
+    free(started);
+    printf("Ensemble finished in %.1fs, %d failed\n", omp_get_wtime() - startTime, failed);
+    return failed != 0;
+}
+
+// Recording and playback.
+// --record appends the state after every step to a trajectory file
+// (trajectory.h), --play shows one instead of simulating. A frame is the
+// System array as it is in memory, so while playing, systems points into the
+// mapped file and drawing, picking and the software renderer read the
+// recording in place (the mapping is read-only). Playback keeps its own
+// position and speed on top of the pacer: each tick moves speed frames, but
+// never past what the prefetch thread has read, so a recording bigger than
+// the disk can stream plays slower instead of freezing the window.
+
+#define PLAYER_SEEK_FRAMES 50 // Frames per '[' or ']'
+#define PLAYER_MIN_SPEED (1.0 / 16.0)
+#define PLAYER_MAX_SPEED 64.0
+
+TrajectoryWriter recorder = {.fd = -1};
+long recordedStep = -1; // Step of the last frame written
+TrajectoryReader player;
+double playerPosition = 0.0; // Frame on screen, fractional below speed 1
+double playerSpeed = 1.0;    // Frames per tick
+int playerDirection = 1;
+
+// One frame per step. A step that is not past the last frame follows a
+// history rewind: the frames from it on belong to the timeline that was left,
+// so they are cut off and the file stays one run, step after step.
+void recordStep(void) {
+    if (recorder.fd < 0) return;
+    if (simulationStep <= recordedStep) {
+        long frame = recorder.frames - (recordedStep - simulationStep + 1);
+        if (trajectoryTruncate(&recorder, frame > 0 ? frame : 0) != 0) {
+            perror(recordPath);
+            exit(1);
+        }
+    }
+    if (trajectoryAppend(&recorder, simulationStep, totalEnergy, systems) != 0) {
+        perror(recordPath);
+        exit(1);
+    }
+    recordedStep = simulationStep;
+}
+
+void playerShow(long frame) {
+    const TrajectoryFrame* recorded = trajectoryFrame(&player, frame);
+    systems = (System*)trajectoryRecords(&player, frame);
+    simulationStep = recorded->step;
+    totalEnergy = recorded->energy;
+    systemIndexStale = true;
+    systemSlotStale = true; // The order changes at every reorder
+}
+
+#ifndef POSTQUANTUM_LIBRARY
+void playerSeek(double frame) {
+    if (frame < 0.0) frame = 0.0;
+    if (frame > player.frames - 1) frame = player.frames - 1;
+    playerPosition = frame;
+    playerShow((long)frame);
+    trajectoryFollow(&player, (long)frame, playerDirection);
+    printf("Frame %ld of %ld, step %ld\n", (long)frame + 1, player.frames, simulationStep);
+}
+
+// One playback tick, called by the frame pacer
+void playerStep(void) {
+    double target = playerPosition + playerSpeed * playerDirection;
+    if (target < 0.0) target = 0.0;
+    if (target > player.frames - 1) target = player.frames - 1;
+    long ready = trajectoryReadyUntil(&player);
+    if (playerDirection > 0 && target >= ready + 1) target = fmax(playerPosition, ready);
+    if (playerDirection < 0 && target < ready) target = fmin(playerPosition, ready);
+    if (target == (playerDirection > 0 ? player.frames - 1 : 0.0) && !pacer.paused) {
+        printf("%s of the recording\n", playerDirection > 0 ? "End" : "Start");
+        pacerTogglePause();
+    }
+    long frame = (long)playerPosition;
+    playerPosition = target;
+    if ((long)target != frame) playerShow((long)target);
+    trajectoryFollow(&player, (long)target, playerDirection);
+}
+
+// Playback keys; returns false for keys that mean the same as when simulating
+bool playerKeyboard(unsigned char key) {
+    switch (key) {
+        case ',':
+        case '.':
+            if (!pacer.paused) pacerTogglePause();
+            playerSeek(playerPosition + (key == '.' ? 1 : -1));
+            return true;
+        case '[':
+            playerSeek(playerPosition - PLAYER_SEEK_FRAMES);
+            return true;
+        case ']':
+            playerSeek(playerPosition + PLAYER_SEEK_FRAMES);
+            return true;
+        case '+':
+        case '=':
+        case '-':
+            playerSpeed *= key == '-' ? 0.5 : 2.0;
+            if (playerSpeed < PLAYER_MIN_SPEED) playerSpeed = PLAYER_MIN_SPEED;
+            if (playerSpeed > PLAYER_MAX_SPEED) playerSpeed = PLAYER_MAX_SPEED;
+            printf("Speed %g frames per tick\n", playerSpeed);
+            return true;
+        case 'r':
+            playerDirection = -playerDirection;
+            trajectoryFollow(&player, (long)playerPosition, playerDirection);
+            printf("Playing %s\n", playerDirection > 0 ? "forward" : "backward");
+            return true;
+    }
+    if (key >= '0' && key <= '9') {
+        playerSeek((key - '0') / 10.0 * (player.frames - 1));
+        return true;
+    }
+    return false;
+}
+#endif
+
+// Headless counterpart of display(): same camera and step, frames go to files
+void renderFrames(void) {
+    SoftRenderer renderer;
+    softInit(&renderer, frameWidth, frameHeight);
+    softPerspective(&renderer, 60.0, (float)frameWidth / frameHeight, 1.0, 100.0);
+
+    if (!playing) initializeSimulation();
+    double startTime = omp_get_wtime();
+    for (int frame = 0; frame < numFrames; frame++) {
+        softLookAt(&renderer, cameraX, cameraY, cameraZ,
+                   cameraX + sin(cameraYaw * M_PI / 180.0),
+                   cameraY + tan(cameraPitch * M_PI / 180.0),
+                   cameraZ - cos(cameraYaw * M_PI / 180.0),
+                   0.0, 1.0, 0.0);
+
+        if (playing) {
+            long shown = frame < player.frames ? frame : player.frames - 1;
+            playerShow(shown);
+            trajectoryFollow(&player, shown, 1);
+        } else {
+            stepSimulation();
+        }
+
+        softBegin(&renderer, 0, 0, 0);
+        collectSprites(&renderer);
+        softRender(&renderer);
+
+        char path[4096];
+        snprintf(path, sizeof(path), framePattern, frame);
+        if (softWriteFrame(&renderer, path) != 0) exit(1);
+        if (metricsEnabled) {
+            metricsAdd(metricFrames, 1.0);
+            metricsPublish();
+        }
+    }
+    double elapsed = omp_get_wtime() - startTime;
+    printf("Rendered %d frames of %d systems in %.2fs (%.2f frames/s)\n",
+           numFrames, numSystems, elapsed, numFrames / elapsed);
+    softFree(&renderer);
+}
+
+// Headless timing run for bin/scaling.py: seconds spent in each phase over
+// the whole run, one "phase" line each
+void runBench(int steps) {
+    double total[NUM_PHASES] = {0.0};
+    double startTime = omp_get_wtime();
+    initializeSimulation();
+    double setup = omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    for (int step = 0; step < steps; step++) {
+        stepSimulation();
+        for (int p = 0; p < NUM_PHASES; p++) total[p] += phaseSeconds[p];
+    }
+    double elapsed = omp_get_wtime() - startTime;
+
+    printf("bench systems %d threads %d steps %d\n", numSystems, omp_get_max_threads(), steps);
+    printf("phase initialize %.9f\n", setup);
+    for (int p = 0; p < NUM_PHASES; p++) {
+        if (phases[p].enabled != NULL && !*phases[p].enabled) continue;
+        printf("phase %s %.9f\n", phases[p].name, total[p]);
+    }
+    printf("phase step %.9f\n", elapsed);
+}
+
+void applyQuality(int level) {
+    physicsInterval = qualityLevels[level][0];
+    drawStride = qualityLevels[level][1];
+    sphereDetail = qualityLevels[level][2];
+
+    // A coarser mesh is the accuracy lever; the kernels are rebuilt for the new size
+    int shift = qualityLevels[level][3];
+    while (shift > 0 && (meshSize << meshShift) >> shift < 16) shift--;
+    if (useParticleMesh && shift != meshShift) {
+        releaseParticleMesh();
+        meshSize = (meshSize << meshShift) >> shift;
+        meshShift = shift;
+        initializeParticleMesh();
+    }
+}
+
+// Time-travel history for the viewer.
+// The state after every step is kept in memory as segments: one full
+// keyframe, then up to HISTORY_KEYFRAME_INTERVAL deltas against the step
+// before. A delta XORs the new state with the old one. Each 32-bit word is
+// stored as a 4-bit byte count plus its non-zero low bytes. Nearby floats
+// share sign, exponent and top mantissa bits, so most words shrink to one to
+// three bytes. Restoring a step copies its segment's keyframe and applies at
+// most HISTORY_KEYFRAME_INTERVAL deltas. When the memory budget is exceeded,
+// the oldest segments are dropped.
+// A step's state is the systems followed by the CSL state by id, the one
+// thing a step carries over that is not in the systems (hazards, thresholds
+// and cached rates), so a restored step goes on exactly as it did.
+
+#define HISTORY_KEYFRAME_INTERVAL 32
+#define HISTORY_MAX_SEGMENTS 4096
+#define HISTORY_SCRUB_STEPS 50 // Steps per '[' or ']'
+
+typedef struct {
+    long firstStep; // Step held by the keyframe
+    int numDeltas;
+    unsigned char* data; // Keyframe, then deltas back to back
+    long size, capacity;
+    long deltaOffset[HISTORY_KEYFRAME_INTERVAL + 1];
+    double energy[HISTORY_KEYFRAME_INTERVAL + 1]; // totalEnergy after each step
+    bool csl[HISTORY_KEYFRAME_INTERVAL + 1];      // CSL state held; not before the first step builds it
+} HistorySegment;
+
+HistorySegment* historySegments = NULL; // Ring of segments, oldest at historyHead
+int historyHead = 0, historyCount = 0;
+long historyBytes = 0;
+long historyBudget = 256L << 20; // Bytes, 0 turns recording off
+long rewindCheckSteps = 0;       // --rewind-check, headless
+unsigned char* historyPrevious = NULL; // Last recorded state, for the next delta
+unsigned char* historyState = NULL;    // Scratch for the state being recorded or restored
+
+static long historyEncode(const uint32_t* previous, const uint32_t* current, long words, unsigned char* out) {
+    long pos = 0;
+    for (long w = 0; w < words; w += 2) {
+        unsigned char* tag = &out[pos++];
+        *tag = 0;
+        for (int k = 0; k < 2 && w + k < words; k++) {
+            uint32_t x = previous[w + k] ^ current[w + k];
+            int bytes = x == 0 ? 0 : x <= 0xff ? 1 : x <= 0xffff ? 2 : x <= 0xffffff ? 3 : 4;
+            *tag |= bytes << (4 * k);
+            for (int b = 0; b < bytes; b++) out[pos++] = (x >> (8 * b)) & 0xff;
+        }
+    }
+    return pos;
+}
+
+static void historyApply(uint32_t* state, const unsigned char* delta, long words) {
+    long pos = 0;
+    for (long w = 0; w < words; w += 2) {
+        unsigned char tag = delta[pos++];
+        for (int k = 0; k < 2 && w + k < words; k++) {
+            int bytes = (tag >> (4 * k)) & 15;
+            uint32_t x = 0;
+            for (int b = 0; b < bytes; b++) x |= (uint32_t)delta[pos++] << (8 * b);
+            state[w + k] ^= x;
+        }
+    }
+}
+
+static long historyStateBytes(void) {
+    return (long)numSystems * (sizeof(System) + sizeof(CslState));
+}
+
+// Copies the current state out; heap slots are left out, they depend on the
+// order ids were queued in
+static bool historyCapture(unsigned char* state) {
+    long systemBytes = (long)numSystems * sizeof(System);
+    memcpy(state, systems, systemBytes);
+    CslState* csl = (CslState*)(state + systemBytes);
+    if (cslState == NULL || cslStale) {
+        memset(csl, 0, numSystems * sizeof(CslState));
+        return false;
+    }
+    memcpy(csl, cslState, numSystems * sizeof(CslState));
+    for (int id = 0; id < numSystems; id++) csl[id].heapSlot = -1;
+    return true;
+}
+
+static HistorySegment* historySegment(int i) {
+    return &historySegments[(historyHead + i) % HISTORY_MAX_SEGMENTS];
+}
+
+#ifndef POSTQUANTUM_LIBRARY
+static long historyFirstStep(void) {
+    return historyCount ? historySegment(0)->firstStep : -1;
+}
+#endif
+
+static long historyLastStep(void) {
+    if (historyCount == 0) return -1;
+    HistorySegment* last = historySegment(historyCount - 1);
+    return last->firstStep + last->numDeltas;
+}
+
+static void historyReserve(HistorySegment* segment, long bytes) {
+    if (segment->size + bytes <= segment->capacity) return;
+    long capacity = segment->capacity ? segment->capacity : bytes;
+    while (capacity < segment->size + bytes) capacity *= 2;
+    segment->data = (unsigned char*)memRealloc(memHistory, segment->data, capacity);
+    if (segment->data == NULL) {
+        fprintf(stderr, "Cannot grow the history to %ld bytes\n", capacity);
+        exit(1);
+    }
+    historyBytes += capacity - segment->capacity;
+    segment->capacity = capacity;
+}
+
+static void historyDropOldest(void) {
+    HistorySegment* oldest = historySegment(0);
+    historyBytes -= oldest->capacity;
+    memFree(oldest->data);
+    memset(oldest, 0, sizeof(*oldest));
+    historyHead = (historyHead + 1) % HISTORY_MAX_SEGMENTS;
+    historyCount--;
+}
+
+// Appends the current state, which must be one step after the last recorded one
+void historyRecord(void) {
+    if (historyBudget <= 0) return;
+    long stateBytes = historyStateBytes();
+    long words = stateBytes / sizeof(uint32_t);
+    if (historySegments == NULL) {
+        historySegments = (HistorySegment*)memCalloc(memHistory, HISTORY_MAX_SEGMENTS, sizeof(HistorySegment));
+        historyPrevious = (unsigned char*)memAlloc(memHistory, stateBytes);
+        historyState = (unsigned char*)memAlloc(memHistory, stateBytes);
+        if (historySegments == NULL || historyPrevious == NULL || historyState == NULL) {
+            fprintf(stderr, "Cannot allocate the history\n");
+            exit(1);
         }
-        initialized = true;
+    }
+    bool csl = historyCapture(historyState);
+
+    HistorySegment* segment = historyCount ? historySegment(historyCount - 1) : NULL;
+    if (segment == NULL || segment->numDeltas == HISTORY_KEYFRAME_INTERVAL) {
+        if (segment != NULL) {
+            // Finished segments give back their doubling slack
+            historyBytes -= segment->capacity - segment->size;
+            segment->data = (unsigned char*)memRealloc(memHistory, segment->data, segment->size);
+            segment->capacity = segment->size;
+        }
+        if (historyCount == HISTORY_MAX_SEGMENTS) historyDropOldest();
+        segment = historySegment(historyCount++);
+        segment->firstStep = simulationStep;
+        segment->numDeltas = 0;
+        historyReserve(segment, stateBytes);
+        memcpy(segment->data, historyState, stateBytes);
+        segment->size = stateBytes;
+        segment->energy[0] = totalEnergy;
+        segment->csl[0] = csl;
+    } else {
+        historyReserve(segment, words * 4 + words / 2 + 1);
+        int d = ++segment->numDeltas;
+        segment->deltaOffset[d] = segment->size;
+        segment->size += historyEncode((const uint32_t*)historyPrevious, (const uint32_t*)historyState, words,
+                                       segment->data + segment->size);
+        segment->energy[d] = totalEnergy;
+        segment->csl[d] = csl;
+    }
+    unsigned char* swap = historyPrevious;
+    historyPrevious = historyState;
+    historyState = swap;
+
+    while (historyBytes > historyBudget && historyCount > 1) historyDropOldest();
+}
+
+// Decodes the state after the given step into historyState; returns the
+// segment holding it, NULL if it is not held
+static HistorySegment* historyDecode(long step) {
+    for (int i = historyCount - 1; i >= 0; i--) {
+        HistorySegment* segment = historySegment(i);
+        if (step < segment->firstStep) continue;
+        if (step > segment->firstStep + segment->numDeltas) return NULL;
+
+        long words = historyStateBytes() / sizeof(uint32_t);
+        memcpy(historyState, segment->data, historyStateBytes());
+        for (int k = 1; k <= step - segment->firstStep; k++) {
+            historyApply((uint32_t*)historyState, segment->data + segment->deltaOffset[k], words);
+        }
+        return segment;
+    }
+    return NULL;
+}
+
+// Brings back the state after the given step; returns 0 if it is not held
+int historyRestore(long step) {
+    HistorySegment* segment = historyDecode(step);
+    if (segment == NULL) return 0;
+    int d = (int)(step - segment->firstStep);
+    long systemBytes = (long)numSystems * sizeof(System);
+    memcpy(systems, historyState, systemBytes);
+    cslStale = !segment->csl[d];
+    if (!cslStale) {
+        cslReserve();
+        memcpy(cslState, historyState + systemBytes, numSystems * sizeof(CslState));
+        cslRequeue();
+    }
+    simulationStep = step;
+    totalEnergy = segment->energy[d];
+    systemIndexStale = true;
+    systemSlotStale = true; // The order may predate a reorder
+    return 1;
+}
+
+// Stepping on from an earlier point starts a new timeline: forget the old future
+void historyTruncate(void) {
+    if (historyCount == 0 || simulationStep >= historyLastStep()) return;
+    while (historyCount > 0 && historySegment(historyCount - 1)->firstStep > simulationStep) {
+        HistorySegment* last = historySegment(historyCount - 1);
+        historyBytes -= last->capacity;
+        memFree(last->data);
+        memset(last, 0, sizeof(*last));
+        historyCount--;
+    }
+    if (historyCount > 0) {
+        HistorySegment* segment = historySegment(historyCount - 1);
+        int keep = (int)(simulationStep - segment->firstStep);
+        if (keep < segment->numDeltas) segment->size = segment->deltaOffset[keep + 1];
+        segment->numDeltas = keep;
+    }
+    historyCapture(historyPrevious);
+}
+
+#ifndef POSTQUANTUM_LIBRARY
+// Moves through history by a number of steps; past the newest step the
+// simulation runs on (while paused) to produce the missing ones
+void historySeek(long steps) {
+    if (!pacer.paused) pacerTogglePause();
+    long target = simulationStep + steps;
+    if (target < historyFirstStep()) target = historyFirstStep();
+    double startTime = omp_get_wtime();
+    if (target <= historyLastStep()) {
+        historyRestore(target);
+    } else {
+        historyRestore(historyLastStep());
+        while (simulationStep < target) {
+            stepSimulation();
+            historyRecord();
+        }
+    }
+    printf("Step %ld of %ld..%ld (%.2f ms, %.1f MB of history)\n", simulationStep, historyFirstStep(),
+           historyLastStep(), (omp_get_wtime() - startTime) * 1000.0, historyBytes / 1048576.0);
+}
+#endif
+
+// Headless check for --rewind-check: runs 2 * steps steps into the history,
+// rewinds steps, steps again and compares every state with the recorded
+// one, bit for bit. Returns the number of steps that differ.
+int runRewindCheck(long steps) {
+    initializeSimulation();
+    historyRecord();
+    for (long k = 0; k < 2 * steps; k++) {
+        stepSimulation();
+        historyRecord();
+    }
+    if (!historyRestore(steps)) {
+        fprintf(stderr, "Step %ld is no longer in the history, raise --history\n", steps);
+        return 1;
+    }
+    unsigned char* replayed = (unsigned char*)memAlloc(memHistory, historyStateBytes());
+    if (replayed == NULL) {
+        fprintf(stderr, "Cannot allocate the rewind check\n");
+        return 1;
+    }
+    int differing = 0;
+    while (simulationStep < 2 * steps) {
+        stepSimulation();
+        historyCapture(replayed);
+        HistorySegment* segment = historyDecode(simulationStep);
+        if (memcmp(replayed, historyState, historyStateBytes()) != 0 ||
+            totalEnergy != segment->energy[simulationStep - segment->firstStep]) {
+            if (differing++ == 0) fprintf(stderr, "Step %ld differs after the rewind\n", simulationStep);
+        }
+    }
+    memFree(replayed);
+    printf("rewind check: %ld steps replayed, %d differ\n", steps, differing);
+    return differing;
+}
+
+#ifndef POSTQUANTUM_LIBRARY
+// One simulation tick, called by the frame pacer
+void stepSystems(void) {
+    static long tick = 0;
+    if (tick++ % physicsInterval == 0) {
+        historyTruncate();
+        double startTime = omp_get_wtime();
+        stepSimulation();
+        qualityStep(&quality, omp_get_wtime() - startTime, physicsInterval);
+        historyRecord();
+    }
+}
+
+void display(void) {
+    if (qualityFrame(&quality)) {
+        applyQuality(quality.level);
     }
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -413,24 +2413,38 @@ void display(void) {
               cameraZ - cos(cameraYaw * M_PI / 180.0), 
               0.0, 1.0, 0.0);
 
-    applySpacetimeFluctuations(systems, numSystems);
-    applyStochasticCurvatureFluctuations(systems, numSystems);
-    applyGravitationalInteraction(systems, numSystems);
-    applyCSLDecoherence(systems, numSystems);
-    quantumClassicalFeedback(systems, numSystems);
-    applyHybridHamiltonian(systems, numSystems);
-    applyEmergentGravity(systems, numSystems);
-    applyViolentSpacetimeFluctuations(systems, numSystems);
-    applyPathIntegralDynamics(systems, numSystems);
-    updateSystems(systems, numSystems);
-    ensureContinuousEnergyConservation(systems, numSystems);
-
-    for (int i = 0; i < numSystems; i++) {
-        drawPoint(systems[i]);
+    if (sphereDetail > 0) {
+        for (int i = 0; i < numSystems; i += drawStride) {
+            drawPoint(systems[i]);
+        }
+    } else {
+        glPointSize(2.0f);
+        glBegin(GL_POINTS);
+        for (int i = 0; i < numSystems; i += drawStride) {
+            if (systems[i].isQuantum) glColor3f(0.0, 1.0, 0.0);
+            else glColor3f(1.0, 0.0, 0.0);
+            glVertex3f(systems[i].x, systems[i].y, systems[i].z);
+        }
+        glEnd();
+    }
+    if (selectedSystem >= 0) {
+        System* s = &systems[systemWithId(selectedSystem)];
+        glPushMatrix();
+        glTranslatef(s->x, s->y, s->z);
+        glColor3f(1.0, 1.0, 0.0);
+        glutWireSphere(0.3, 10, 10);
+        glPopMatrix();
     }
 
     glutSwapBuffers();
-    glutPostRedisplay();
+
+    if (metricsEnabled) {
+        metricsAdd(metricFrames, 1.0);
+        metricsSet(metricStep, (double)simulationStep);
+        metricsSet(metricHistoryBytes, (double)historyBytes);
+        metricsSet(metricQuality, (double)quality.level);
+        metricsPublish();
+    }
 }
 
 
@@ -444,6 +2458,10 @@ void reshape(int w, int h) {
 }
 
 void keyboard(unsigned char key, int x, int y) {
+    if (playing && playerKeyboard(key)) {
+        pacerRequestRedraw();
+        return;
+    }
     switch (key) {
         case 'w':
             cameraX += speed * sin(cameraYaw * M_PI / 180.0);
@@ -467,10 +2485,25 @@ void keyboard(unsigned char key, int x, int y) {
         case 'e':
             cameraY += speed;
             break;
+        case 'p':
+            pacerTogglePause();
+            break;
+        case ',':
+            historySeek(-1);
+            break;
+        case '.':
+            historySeek(1);
+            break;
+        case '[':
+            historySeek(-HISTORY_SCRUB_STEPS);
+            break;
+        case ']':
+            historySeek(HISTORY_SCRUB_STEPS);
+            break;
         case 27:
             exit(0);
     }
-    glutPostRedisplay();
+    pacerRequestRedraw();
 }
 
 void mouseMotion(int x, int y) {
@@ -492,17 +2525,385 @@ void mouseMotion(int x, int y) {
     warp = true;
     glutWarpPointer(400, 300);
 
-    glutPostRedisplay();
+    pacerRequestRedraw();
+}
+
+void mouse(int button, int state, int x, int y) {
+    if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
+        pickSystem(x, y);
+        pacerRequestRedraw();
+    }
+}
+#endif
+
+// Fills in what a run with n systems needs per tag; the window adds the pick
+// index and the history, --render the software renderer
+void estimateMemory(long n, int window) {
+    int threads = omp_get_max_threads();
+    memClearEstimates();
+    if (!playing) { // A recording is read in place from the page cache
+        memEstimate(memSystems, 2 * bigAllocBytes(n * sizeof(System)));
+        if (reorderInterval > 0) {
+            memEstimate(memMorton, 4 * bigAllocBytes(n * sizeof(uint32_t)) + bigAllocBytes(n * sizeof(long)) +
+                                   threads * (long)(sizeof(long) << RADIX_BITS));
+        }
+        memEstimate(memCsl, bigAllocBytes(n * sizeof(CslState)) + bigAllocBytes(n * sizeof(int)) + bigAllocBytes(n));
+        memEstimate(memTag("reduce"), (n + reduceBlocks(n) + 1) * (long)sizeof(double));
+    }
+    if (useParticleMesh && !playing) {
+        long m = meshSize, cells = m * m * m, padded = 8 * cells;
+        memEstimate(memMesh, bigAllocBytes(padded * sizeof(Complex)) + 2 * bigAllocBytes(padded * sizeof(float)) +
+                             3 * bigAllocBytes(cells * sizeof(float)) + (cells + 1) * (long)sizeof(int) +
+                             bigAllocBytes(n * sizeof(int)) + 2 * bigAllocBytes(n * sizeof(float)) +
+                             2 * bigAllocBytes(n * sizeof(*meshField)) + threads * 2 * m * (long)sizeof(Complex));
+    }
+    if (!playing || window) { // Slots by id, for collapses and the selection
+        memEstimate(memIndex, bigAllocBytes(n * sizeof(int)));
+    }
+    if (framePattern != NULL) {
+        memEstimate(memTag("render"), softEstimateBytes(frameWidth, frameHeight, 0, n));
+    } else if (window) {
+        memEstimate(memIndex, kdEstimateBytes(n) + n * (long)sizeof(long));
+    }
+    if ((window || rewindCheckSteps > 0) && historyBudget > 0) {
+        memEstimate(memHistory, historyBudget + 2 * n * (long)(sizeof(System) + sizeof(CslState)) +
+                                HISTORY_MAX_SEGMENTS * (long)sizeof(HistorySegment));
+    }
+}
+
+static int overMemoryBudget(void) {
+    return memBudget > 0 && memEstimateTotal() > memBudget;
 }
 
+// Keeps the run within --memory: the window first gives up history, then
+// any run gives up systems. Returns -1, before anything big is allocated,
+// when it cannot degrade or even one system does not fit.
+int planMemory(int window, int degrade) {
+    memSystems = memTag("systems");
+    memMorton = memTag("morton");
+    memMesh = memTag("mesh");
+    memHistory = memTag("history");
+    memIndex = memTag("index");
+    memCsl = memTag("csl");
+    estimateMemory(requestedSystems, window);
+
+    if (overMemoryBudget() && degrade && window && historyBudget > 0) {
+        long room = memBudget - (memEstimateTotal() - historyBudget);
+        historyBudget = room >= (long)requestedSystems * (long)sizeof(System) ? room : 0;
+        estimateMemory(requestedSystems, window);
+        if (historyBudget > 0) printf("History cut to %ld MB to fit the memory budget\n", historyBudget >> 20);
+        else printf("History is off to fit the memory budget\n");
+    }
+    if (overMemoryBudget() && degrade) {
+        // The estimate grows with the systems, so bisect for the most that fit
+        long lo = 0, hi = requestedSystems;
+        while (lo < hi) {
+            long mid = (lo + hi + 1) / 2;
+            estimateMemory(mid, window);
+            if (overMemoryBudget()) hi = mid - 1;
+            else lo = mid;
+        }
+        if (lo > 0) {
+            printf("%d systems do not fit the memory budget, running %ld\n", requestedSystems, lo);
+            requestedSystems = (int)lo;
+        }
+        estimateMemory(requestedSystems, window);
+    }
+
+    if (overMemoryBudget()) {
+        memPrintEstimate(stderr);
+        fprintf(stderr, "Needs more memory than the budget; lower --systems or --pm, or raise --memory\n");
+        return -1;
+    }
+    if (degrade) memPrintEstimate(stdout);
+    return 0;
+}
+
+// Frees everything sized by the number of systems, so a run can start over
+// with another size (the library build does)
+void releaseSimulation(void) {
+    bigFree(systems);
+    bigFree(systemsNext);
+    bigFree(systemSlot);
+    bigFree(mortonKeys);
+    bigFree(mortonKeysScratch);
+    bigFree(mortonOrder);
+    bigFree(mortonOrderScratch);
+    bigFree(mortonNewIndex);
+    bigFree(cslState);
+    bigFree(cslHeap);
+    bigFree(cslRefreshed);
+    bigFree(meshCellSystems);
+    bigFree(meshPotential);
+    bigFree(meshCurvature);
+    bigFree(meshField);
+    systems = systemsNext = NULL;
+    systemSlot = NULL;
+    mortonKeys = mortonKeysScratch = NULL;
+    mortonOrder = mortonOrderScratch = NULL;
+    mortonNewIndex = NULL;
+    cslState = NULL;
+    cslHeap = NULL;
+    cslRefreshed = NULL;
+    meshCellSystems = NULL;
+    meshPotential = meshCurvature = NULL;
+    meshField = NULL;
+    meshSystems = 0;
+    releaseParticleMesh();
+    memFree(energyTerms);
+    energyTerms = NULL;
+    energyTermsCapacity = 0;
+    kdFree(&systemIndex);
+    numSystems = 0;
+    simulationStep = 0;
+    systemIndexStale = systemSlotStale = cslStale = true;
+}
 
 void cleanup(void) {
-    free(systems);
+    if (playing) systems = NULL; // Points into the recording
+    trajectoryRelease(&player);
+    trajectoryClose(&recorder);
+    releaseSimulation();
+}
+
+#ifdef POSTQUANTUM_LIBRARY
+// Library build for bin/postquantum.py (ctypes), main() and the window are left out:
+//   gcc -O2 -fopenmp -shared -fPIC -DPOSTQUANTUM_LIBRARY postquantum-theory-of-classical-gravity.c -lm
+// The parameters are the globals above (seed, gravity, decoherenceRate,
+// reorderInterval, ...), which Python sets directly. Python wraps systems as
+// NumPy arrays without copying. The phases swap the two buffers, so pqStep
+// copies the state back when a step ends in the other one; arrays taken
+// once then change in place as the run steps. While Python holds arrays on
+// the buffer (pqHold), a new run leaves it mapped with the last state of the
+// old one, and pqUnhold frees it once the last of those arrays is gone.
+
+// sizeof(System) and the offsets of its fields, for the NumPy views
+const long pqLayout[] = {
+    sizeof(System), offsetof(System, x), offsetof(System, vx), offsetof(System, isQuantum),
+    offsetof(System, coherence), offsetof(System, mass), offsetof(System, curvatureInfluence), offsetof(System, id),
+};
+System* pqHome = NULL; // The buffer the Python arrays point at
+bool pqHeld = false;   // Python has arrays on pqHome
+
+void* pqHold(void) {
+    pqHeld = pqHome != NULL;
+    return pqHome;
+}
+
+// home is a buffer pqHold returned; Python has no arrays on it any more
+void pqUnhold(void* home) {
+    if (home == pqHome) {
+        pqHeld = false;
+    } else {
+        bigFree(home); // Left to Python by a later run
+    }
+}
+
+// Starts a run of n systems, on the particle mesh when mesh > 0; -1 when it
+// does not fit --memory (memBudget)
+int pqInit(int n, int mesh) {
+    if (pqHeld) {
+        if (systems == pqHome) systems = NULL;
+        if (systemsNext == pqHome) systemsNext = NULL;
+        pqHeld = false;
+    }
+    pqHome = NULL;
+    releaseSimulation();
+    requestedSystems = n;
+    useParticleMesh = mesh > 0;
+    if (useParticleMesh) meshSize = mesh;
+    if (planMemory(0, 0) != 0) return -1;
+    initializeSimulation();
+    pqHome = systems;
+    return 0;
 }
 
+void pqStep(long steps) {
+    for (long s = 0; s < steps; s++) stepSimulation();
+    if (systems != pqHome) {
+        memcpy(pqHome, systems, (size_t)numSystems * sizeof(System));
+        systemsNext = systems;
+        systems = pqHome;
+    }
+}
+
+// Writes the state as a one-frame trajectory, which --play shows too
+int pqCheckpoint(const char* path) {
+    TrajectoryWriter writer;
+    if (trajectoryCreate(&writer, path, numSystems, sizeof(System), seed) != 0) return -1;
+    int failed = trajectoryAppend(&writer, simulationStep, totalEnergy, systems);
+    trajectoryClose(&writer);
+    return failed;
+}
+
+// Carries on from the last frame of a checkpoint or --record file. The
+// parameters are not in the file. The collapse thresholds are drawn afresh,
+// as at the start of a run, so the run goes on statistically, not bitwise,
+// the same.
+int pqRestore(const char* path, int mesh) {
+    TrajectoryReader reader;
+    if (trajectoryOpen(&reader, path, sizeof(System)) != 0) return -1;
+    long last = reader.frames - 1;
+    seed = reader.seed;
+    int status = pqInit((int)reader.records, mesh);
+    if (status == 0) {
+        memcpy(systems, trajectoryRecords(&reader, last), (size_t)numSystems * sizeof(System));
+        memcpy(systemsNext, systems, (size_t)numSystems * sizeof(System));
+        simulationStep = trajectoryFrame(&reader, last)->step;
+        totalEnergy = initialEnergy = trajectoryFrame(&reader, last)->energy;
+        cslStale = true;
+    }
+    trajectoryRelease(&reader);
+    return status;
+}
+#else
 int main(int argc, char **argv) {
     atexit(cleanup);  // Register cleanup function to be called at exit
 
+    // --render writes frames (printf pattern, e.g. frames/%05d.png) without a display,
+    // --pm [size] switches the O(N^2) sums to the particle-mesh solver,
+    // --pin and --hugepages thp|explicit place threads and memory on big machines,
+    // --budget ms sets the frame time the viewer degrades to hold (0 = never),
+    // --ensemble sweep.txt runs a whole parameter sweep into --results (CSV),
+    // --fps, --ticks (steps per frame) and --vsync 0|1 pace the window,
+    // --history MB bounds the time-travel buffer (0 = off),
+    // --metrics port|socket-path serves Prometheus metrics while running,
+    // --bench steps times each phase without a window (see bin/scaling.py),
+    // --reorder steps sets how often systems are sorted in Morton order (0 = never),
+    // --memory size (512M, 8G) is the most the run may allocate; over it, the run degrades or refuses,
+    // --csl-refresh steps bounds how stale a collapse rate may get (1 = every step),
+    // --record file writes every step to a trajectory, --play file shows one without simulating,
+    // --rewind-check steps runs twice that, rewinds and checks the replay matches bit for bit
+    seed = (uint64_t)time(NULL);
+    double budget = QUALITY_DEFAULT_BUDGET_MS;
+    double fps = PACING_DEFAULT_FPS;
+    int ticksPerFrame = 1, vsync = 1;
+    const char* sweepPath = NULL;
+    const char* resultsPath = "ensemble.csv";
+    const char* metricsAddress = NULL;
+    const char* playPath = NULL;
+    int benchSteps = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pinning = 1;
+        } else if (strcmp(argv[i], "--hugepages") == 0 && i + 1 < argc) {
+            hugePageMode = parseHugePages(argv[++i]);
+        } else if (strcmp(argv[i], "--pm") == 0) {
+            useParticleMesh = true;
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0) meshSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tsc") == 0) {
+            meshOrder = 3;
+        } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            framePattern = argv[++i];
+            softCheckPattern(framePattern);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            numFrames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            softParseSize(argv[++i], &frameWidth, &frameHeight);
+        } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            budget = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            fps = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+            ticksPerFrame = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--vsync") == 0 && i + 1 < argc) {
+            vsync = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            historyBudget = atol(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metricsAddress = argv[++i];
+        } else if (strcmp(argv[i], "--G") == 0 && i + 1 < argc) {
+            gravity = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--decoherence") == 0 && i + 1 < argc) {
+            decoherenceRate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--curvature") == 0 && i + 1 < argc) {
+            curvatureFluctuationScale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--systems") == 0 && i + 1 < argc) {
+            requestedSystems = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc) {
+            sweepPath = argv[++i];
+        } else if (strcmp(argv[i], "--results") == 0 && i + 1 < argc) {
+            resultsPath = argv[++i];
+        } else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            ensembleSteps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            benchSteps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+            reorderInterval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+            memBudget = memParseSize(argv[++i]);
+        } else if (strcmp(argv[i], "--csl-refresh") == 0 && i + 1 < argc) {
+            cslRefreshInterval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+            playPath = argv[++i];
+        } else if (strcmp(argv[i], "--rewind-check") == 0 && i + 1 < argc) {
+            rewindCheckSteps = atol(argv[++i]);
+        }
+    }
+
+    if (useParticleMesh && (meshSize < 16 || (meshSize & (meshSize - 1)) != 0)) {
+        fprintf(stderr, "Mesh size must be a power of two, at least 16\n");
+        return 1;
+    }
+
+    if (sweepPath != NULL) {
+        return runEnsemble(sweepPath, resultsPath);
+    }
+    if (requestedSystems < 1) {
+        fprintf(stderr, "Need at least one system\n");
+        return 1;
+    }
+    if (cslRefreshInterval < 1) {
+        fprintf(stderr, "--csl-refresh needs at least one step\n");
+        return 1;
+    }
+    if (playPath != NULL) {
+        if (recordPath != NULL || benchSteps > 0 || rewindCheckSteps > 0) {
+            fprintf(stderr, "--play shows a recording, it cannot be combined with --record, --bench or --rewind-check\n");
+            return 1;
+        }
+        if (trajectoryOpen(&player, playPath, sizeof(System)) != 0) return 1;
+        playing = true;
+        requestedSystems = (int)player.records;
+        numSystems = requestedSystems;
+        seed = player.seed;
+        historyBudget = 0; // The recording is the history
+        useParticleMesh = false;
+        printf("Playing %ld frames of %d systems from %s\n", player.frames, numSystems, playPath);
+    }
+
+    printf("Seed: %llu\n", (unsigned long long)seed);
+    if (planMemory(benchSteps == 0 && framePattern == NULL && rewindCheckSteps == 0, !playing) != 0) return 1;
+    if (recordPath != NULL && trajectoryCreate(&recorder, recordPath, requestedSystems, sizeof(System), seed) != 0) {
+        return 1;
+    }
+    atexit(memReportAtExit);
+    if (metricsAddress != NULL) {
+        registerMetrics();
+        if (metricsServe(metricsAddress) != 0) return 1;
+    }
+    if (pinning) {
+        pinThreads();
+    }
+
+    if (benchSteps > 0) {
+        runBench(benchSteps);
+        return 0;
+    }
+    if (rewindCheckSteps > 0) {
+        return runRewindCheck(rewindCheckSteps) == 0 ? 0 : 1;
+    }
+    if (framePattern != NULL) {
+        renderFrames();
+        return 0;
+    }
+    qualityInit(&quality, budget, NUM_QUALITY_LEVELS - 1);
+    pacerInit(fps, ticksPerFrame, playing ? playerStep : stepSystems, NULL, &quality);
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(800, 600);
@@ -514,8 +2915,17 @@ int main(int argc, char **argv) {
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
     glutPassiveMotionFunc(mouseMotion);
+    glutMouseFunc(mouse);
     glutWarpPointer(400, 300);
 
+    if (playing) {
+        playerSeek(0.0);
+    } else {
+        initializeSimulation();
+        historyRecord();
+    }
+    pacerStart(vsync);
     glutMainLoop();
     return 0;
 }
+#endif
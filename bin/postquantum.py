@@ -0,0 +1,186 @@
+# Python bindings for postquantum-theory-of-classical-gravity.c.
+#
+# The C file is built once as a shared library (-DPOSTQUANTUM_LIBRARY, kept
+# in ~/.cache/postquantum and rebuilt when the sources change) and driven
+# through ctypes, so there is nothing to install beyond gcc and NumPy.
+# ctypes lets go of the GIL for every call, so step() runs on all OpenMP
+# threads (OMP_NUM_THREADS, read at import) while other Python threads carry
+# on. The state comes back as NumPy arrays over the engine's own buffer
+# (nothing is copied): they change in place as the simulation steps. Arrays
+# taken before an init() or restore() keep the old run's last state (the
+# engine keeps that buffer until the last of them is gone); arrays taken
+# after it show the new run. There is one engine per process, so the module
+# is the simulation.
+#
+#   import postquantum as pq
+#   pq.init(100000, seed=1, pm=64)
+#   pq.step(100)
+#   radius = np.linalg.norm(pq.positions(), axis=1)
+#   print(pq.is_quantum().mean(), pq.energy())
+#   pq.checkpoint("run.traj")    # also plays with --play
+#
+# Systems are re-sorted along a Morton curve every 64 steps, which permutes
+# the rows; ids() says which system each row is, or init(reorder=0) keeps
+# row i = system i. Writing into the arrays changes the simulation.
+
+import ctypes
+import os
+import subprocess
+import weakref
+
+import numpy as np
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+SOURCE = os.path.join(HERE, "postquantum-theory-of-classical-gravity.c")
+CACHE = os.path.join(os.environ.get("XDG_CACHE_HOME", os.path.expanduser("~/.cache")), "postquantum")
+LIBRARY = os.path.join(CACHE, "libpostquantum.so")
+
+
+def _build():
+    sources = [SOURCE] + [os.path.join(ROOT, f) for f in os.listdir(ROOT) if f.endswith(".h")]
+    if os.path.exists(LIBRARY) and os.path.getmtime(LIBRARY) >= max(os.path.getmtime(s) for s in sources):
+        return
+    os.makedirs(CACHE, exist_ok=True)
+    partial = LIBRARY + ".%d" % os.getpid()
+    subprocess.run(["gcc", "-O2", "-fopenmp", "-shared", "-fPIC", "-DPOSTQUANTUM_LIBRARY", SOURCE,
+                    "-o", partial, "-lm"], check=True)
+    os.replace(partial, LIBRARY)  # Atomic, so two notebooks building at once both load a whole file
+
+
+_build()
+_lib = ctypes.CDLL(LIBRARY)
+_lib.pqInit.argtypes = [ctypes.c_int, ctypes.c_int]
+_lib.pqStep.argtypes = [ctypes.c_long]
+_lib.pqStep.restype = None
+_lib.pqCheckpoint.argtypes = [ctypes.c_char_p]
+_lib.pqRestore.argtypes = [ctypes.c_char_p, ctypes.c_int]
+_lib.pqHold.restype = ctypes.c_void_p
+_lib.pqUnhold.argtypes = [ctypes.c_void_p]
+_lib.pqUnhold.restype = None
+
+_SIZE, _X, _V, _QUANTUM, _COHERENCE, _MASS, _CURVATURE, _ID = (ctypes.c_long * 8).in_dll(_lib, "pqLayout")
+
+# Run-time parameters, the C globals of the same meaning
+_PARAMETERS = {
+    "G": ctypes.c_float.in_dll(_lib, "gravity"),
+    "decoherence": ctypes.c_float.in_dll(_lib, "decoherenceRate"),
+    "curvature": ctypes.c_float.in_dll(_lib, "curvatureFluctuationScale"),
+    "reorder": ctypes.c_int.in_dll(_lib, "reorderInterval"),
+    "csl_refresh": ctypes.c_int.in_dll(_lib, "cslRefreshInterval"),
+}
+
+
+def set_parameters(**values):
+    """G, decoherence, curvature, reorder (steps, 0 = never) and csl_refresh
+    (steps); they take effect from the next step."""
+    for name, value in values.items():
+        if name not in _PARAMETERS:
+            raise TypeError("unknown parameter " + name)
+        _PARAMETERS[name].value = value
+
+
+def parameters():
+    return {name: c.value for name, c in _PARAMETERS.items()}
+
+
+def init(systems=1000, seed=None, pm=0, **values):
+    """Starts a new run. pm > 0 (a power of two, at least 16) uses the
+    particle-mesh solver instead of the pairwise sums."""
+    if systems < 1:
+        raise ValueError("need at least one system")
+    if pm and (pm < 16 or pm & (pm - 1)):
+        raise ValueError("mesh size must be a power of two, at least 16")
+    set_parameters(**values)
+    ctypes.c_uint64.in_dll(_lib, "seed").value = seed if seed is not None else int.from_bytes(os.urandom(8), "little")
+    if _lib.pqInit(systems, pm) != 0:
+        raise MemoryError("%d systems do not fit the memory budget" % systems)
+
+
+def step(n=1):
+    _lib.pqStep(n)
+
+
+def checkpoint(path):
+    """Writes the state as a one-frame trajectory file."""
+    if _lib.pqCheckpoint(os.fsencode(path)) != 0:
+        raise OSError("cannot write " + path)
+
+
+def restore(path, pm=0):
+    """Carries on from the last frame of a checkpoint or a --record file. The
+    parameters are not in the file; the collapse thresholds are drawn again,
+    so the run goes on statistically the same, not bit for bit."""
+    if _lib.pqRestore(os.fsencode(path), pm) != 0:
+        raise OSError("cannot restore from " + path)
+
+
+def _count():
+    return ctypes.c_int.in_dll(_lib, "numSystems").value
+
+
+class _Buffer:
+    """The engine's state buffer as the base of every array on it: the
+    engine does not free it while this object lives."""
+
+    def __init__(self, n):
+        self.address = _lib.pqHold()
+        self.__array_interface__ = {"shape": (n * _SIZE,), "typestr": "|u1", "data": (self.address, False),
+                                    "version": 3}
+        weakref.finalize(self, _lib.pqUnhold, self.address)
+
+
+_buffer = lambda: None  # Weak reference to the _Buffer of the current run
+
+
+def _view(offset, dtype, columns=0):
+    global _buffer
+    n = _count()
+    if not n or not ctypes.c_void_p.in_dll(_lib, "pqHome").value:
+        raise RuntimeError("call init() or restore() first")
+    buffer = _buffer()
+    if buffer is None or buffer.address != ctypes.c_void_p.in_dll(_lib, "pqHome").value:
+        buffer = _Buffer(n)
+        _buffer = weakref.ref(buffer)
+    raw = np.asarray(buffer)
+    itemsize = np.dtype(dtype).itemsize
+    if columns:
+        return np.ndarray((n, columns), dtype, raw, offset, (_SIZE, itemsize))
+    return np.ndarray((n,), dtype, raw, offset, (_SIZE,))
+
+
+def positions():
+    return _view(_X, np.float32, 3)
+
+
+def velocities():
+    return _view(_V, np.float32, 3)
+
+
+def masses():
+    return _view(_MASS, np.float32)
+
+
+def coherence():
+    return _view(_COHERENCE, np.float32)
+
+
+def curvature_influence():
+    return _view(_CURVATURE, np.float32)
+
+
+def is_quantum():
+    return _view(_QUANTUM, np.bool_)
+
+
+def ids():
+    return _view(_ID, np.int32)
+
+
+def step_count():
+    return ctypes.c_long.in_dll(_lib, "simulationStep").value
+
+
+def energy():
+    """Total energy the energy correction holds the run to."""
+    return ctypes.c_double.in_dll(_lib, "totalEnergy").value
@@ -0,0 +1,288 @@
+#!/usr/bin/env python3
+# Strong and weak scaling of the OpenMP programs.
+#
+# Every variant is built once per compile-time size, then run headless with
+# OMP_NUM_THREADS = 1, 2, 4, ... up to all cores. The programs print one
+# "phase <name> <seconds>" line per phase (--bench), so every phase gets its
+# own numbers:
+#   strong scaling: same size, more threads -> speedup and parallel efficiency
+#   weak scaling:   the size grows with the threads so the work per thread
+#                   stays the same -> efficiency T(1) / T(p)
+#   Amdahl:         T(p) = serial + parallel / p fitted by least squares,
+#                   serial fraction = serial / (serial + parallel), and the
+#                   best speedup any number of cores can give, 1 / fraction
+#
+#   python3 scaling.py
+#   python3 scaling.py --variants postquantum --sizes 1000,2000,4000 --threads 1,2,4,8,16
+#   python3 scaling.py --variants tree --sizes 40,60,100 --depth 3 --csv tree.csv
+#   python3 scaling.py --variants tree --dimensions 8
+
+import argparse
+import csv
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+GL_LIBS = ["-lGL", "-lGLU", "-lglut", "-lm"]
+
+# Same model as ensembleStepCost in postquantum: eight pairwise phases, or
+# on the mesh four transforms of the padded grid plus O(N) per system. The
+# transforms cost the same at any size, so with --pm weak scaling only works
+# from sizes where the systems outweigh them (a 64^3 mesh: a million or so)
+def postquantum_work(n, pm):
+    if not pm:
+        return 0.5 * n * n * 8.0
+    cells = 8.0 * pm ** 3
+    return 6.0 * cells * math.log2(cells) + 96.0 * n
+
+
+# size is the knob that --sizes sets; work(size, args) is how the cost of a
+# step grows with it (work_name says so in the report), which weak scaling
+# inverts to keep the work per thread fixed. --work-exponent replaces it with
+# size ** exponent.
+VARIANTS = {
+    "postquantum": {
+        "source": os.path.join(HERE, "postquantum-theory-of-classical-gravity.c"),
+        "libs": GL_LIBS,
+        "sizes": [1000, 2000, 4000],
+        "size_name": "systems",
+        "work": lambda n, args: postquantum_work(n, args.pm),
+        "work_name": lambda args: "systems + fixed mesh transforms" if args.pm else "systems^2",
+    },
+    "tree": {
+        "source": os.path.join(ROOT, "main.c"),
+        "libs": GL_LIBS,
+        "sizes": [40, 60, 100],
+        "size_name": "points",
+        # Barnes-Hut over points^depth nodes
+        "work": lambda n, args: n ** args.depth * math.log2(max(n ** args.depth, 2)),
+        "work_name": lambda args: "N log N, N = points^%d" % args.depth,
+    },
+    "least-resistance": {
+        "source": os.path.join(HERE, "least-resistance.c"),
+        "libs": ["-lm"],
+        "sizes": [100000, 200000, 400000],
+        "size_name": "walkers",
+        "work": lambda n, args: n,
+        "work_name": lambda args: "walkers",
+    },
+}
+
+
+def build(variant, defines, builddir, cache):
+    key = (variant, tuple(defines))
+    if key not in cache:
+        name = variant + "".join("_" + d.split("=")[-1] for d in defines)
+        binary = os.path.join(builddir, name)
+        command = ["gcc", "-O2", "-fopenmp"] + ["-D" + d for d in defines]
+        command += [VARIANTS[variant]["source"], "-o", binary] + VARIANTS[variant]["libs"]
+        print("building " + name, file=sys.stderr)
+        subprocess.run(command, check=True)
+        cache[key] = binary
+    return cache[key]
+
+
+def command_for(variant, size, args, builddir, cache):
+    if variant == "postquantum":
+        binary = build(variant, [], builddir, cache)
+        command = [binary, "--bench", str(args.steps), "--systems", str(size), "--seed", "1"]
+        if args.pm:
+            command += ["--pm", str(args.pm)]
+        return command
+    if variant == "tree":
+        defines = ["MAX_DEPTH=%d" % args.depth, "NUM_POINTS=%d" % size, "DIMENSIONS=%d" % args.dimensions]
+        binary = build(variant, defines, builddir, cache)
+        return [binary, "--bench", str(args.steps), "1"]
+    binary = build(variant, [], builddir, cache)
+    return [binary, str(args.grid), str(size), str(args.steps), "1", os.path.join(builddir, "heatmap.ppm")]
+
+
+def parse_phases(output):
+    phases = {}
+    for line in output.splitlines():
+        match = re.match(r"phase (\S+) ([0-9.eE+-]+)$", line)
+        if match:
+            phases[match.group(1)] = float(match.group(2))
+        match = re.match(r"\d+ walk steps in ([0-9.]+)s", line)
+        if match:
+            phases["walk"] = float(match.group(1))
+    if not phases:
+        raise RuntimeError("no timings in output:\n" + output)
+    return phases
+
+
+# Best of several runs: noise only ever adds time
+def measure(command, threads, repeat):
+    env = dict(os.environ)
+    env["OMP_NUM_THREADS"] = str(threads)
+    env.setdefault("OMP_PROC_BIND", "close")
+    env.setdefault("OMP_PLACES", "cores")
+    best = None
+    for _ in range(repeat):
+        result = subprocess.run(command, env=env, check=True, stdout=subprocess.PIPE,
+                                stderr=subprocess.DEVNULL, universal_newlines=True)
+        phases = parse_phases(result.stdout)
+        best = phases if best is None else {p: min(best[p], phases[p]) for p in best}
+    return best
+
+
+# Least-squares fit of T(p) = serial + parallel / p, both kept non-negative
+def amdahl(threads, times):
+    if len(set(threads)) < 2:
+        return None
+    xs = [1.0 / p for p in threads]
+    n = len(xs)
+    mx, my = sum(xs) / n, sum(times) / n
+    sxx = sum((x - mx) ** 2 for x in xs)
+    sxy = sum((x - mx) * (t - my) for x, t in zip(xs, times))
+    parallel = sxy / sxx
+    serial = my - parallel * mx
+    if serial < 0.0:
+        serial, parallel = 0.0, sum(x * t for x, t in zip(xs, times)) / sum(x * x for x in xs)
+    if parallel < 0.0:
+        serial, parallel = my, 0.0
+    if serial + parallel <= 0.0:
+        return None
+    return serial / (serial + parallel)
+
+
+def table(headers, rows):
+    widths = [max(len(str(h)), *(len(str(r[i])) for r in rows)) for i, h in enumerate(headers)]
+    line = lambda cells: "| " + " | ".join(str(c).rjust(w) for c, w in zip(cells, widths)) + " |"
+    print(line(headers))
+    print("|" + "|".join("-" * (w + 2) for w in widths) + "|")
+    for row in rows:
+        print(line(row))
+    print()
+
+
+def strong_scaling(variant, size, args, builddir, cache, writer):
+    command = command_for(variant, size, args, builddir, cache)
+    results = {p: measure(command, p, args.repeat) for p in args.threads}
+    phases = list(results[args.threads[0]])
+    base = results[args.threads[0]]
+    first = args.threads[0]
+
+    print("### %s, strong scaling, %d %s\n" % (variant, size, VARIANTS[variant]["size_name"]))
+    rows = []
+    for phase in phases:
+        for p in args.threads:
+            t = results[p][phase]
+            speedup = base[phase] / t if t > 0.0 else float("nan")
+            efficiency = speedup * first / p
+            rows.append([phase, p, "%.4f" % t, "%.2f" % speedup, "%.0f%%" % (100.0 * efficiency)])
+            if writer:
+                writer.writerow([variant, "strong", size, p, phase, "%.9f" % t])
+    table(["phase", "threads", "seconds", "speedup", "efficiency"], rows)
+
+    rows = []
+    for phase in phases:
+        fraction = amdahl(args.threads, [results[p][phase] for p in args.threads])
+        if fraction is None:
+            rows.append([phase, "n/a", "n/a"])
+        else:
+            limit = "%.1f" % (1.0 / fraction) if fraction > 1e-4 else "unbounded"
+            rows.append([phase, "%.3f" % fraction, limit])
+    print("Amdahl fit, %d %s:\n" % (size, VARIANTS[variant]["size_name"]))
+    table(["phase", "serial fraction", "max speedup"], rows)
+
+
+def work_model(variant, args):
+    if args.work_exponent:
+        name = "%s^%g" % (VARIANTS[variant]["size_name"], args.work_exponent)
+        return (lambda size: size ** args.work_exponent), name
+    return (lambda size: VARIANTS[variant]["work"](size, args)), VARIANTS[variant]["work_name"](args)
+
+
+# Size whose work comes closest to target, by bisection (work only grows with size)
+def size_for_work(work, target):
+    lo, hi = 1, 1
+    while work(hi) < target:
+        lo, hi = hi, hi * 2
+    while hi - lo > 1:
+        mid = (lo + hi) // 2
+        if work(mid) < target:
+            lo = mid
+        else:
+            hi = mid
+    return min((lo, hi), key=lambda size: abs(work(size) - target))
+
+
+def weak_scaling(variant, args, builddir, cache, writer):
+    work, work_name = work_model(variant, args)
+    base_size = args.sizes[variant][0]
+    rows = []
+    base = None
+    for p in args.threads:
+        size = size_for_work(work, work(base_size) * p / args.threads[0])
+        command = command_for(variant, size, args, builddir, cache)
+        result = measure(command, p, args.repeat)
+        base = base or result
+        for phase, t in result.items():
+            efficiency = base[phase] / t if t > 0.0 else float("nan")
+            rows.append([phase, p, size, "%.4f" % t, "%.0f%%" % (100.0 * efficiency)])
+            if writer:
+                writer.writerow([variant, "weak", size, p, phase, "%.9f" % t])
+    rows.sort(key=lambda r: r[0])
+    print("### %s, weak scaling, work ~ %s\n" % (variant, work_name))
+    table(["phase", "threads", VARIANTS[variant]["size_name"], "seconds", "efficiency"], rows)
+
+
+def default_threads():
+    cores = os.cpu_count() or 1
+    threads = []
+    p = 1
+    while p < cores:
+        threads.append(p)
+        p *= 2
+    return threads + [cores]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Strong and weak OpenMP scaling with per-phase Amdahl fits")
+    parser.add_argument("--variants", default=",".join(VARIANTS), help="comma separated: " + ", ".join(VARIANTS))
+    parser.add_argument("--threads", help="comma separated thread counts (default 1, 2, 4, ... all cores)")
+    parser.add_argument("--sizes", help="comma separated sizes for strong scaling, the first is the weak-scaling base")
+    parser.add_argument("--steps", type=int, default=10, help="steps per run")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per point, the fastest counts")
+    parser.add_argument("--depth", type=int, default=3, help="tree depth (MAX_DEPTH)")
+    parser.add_argument("--dimensions", type=int, default=3, help="tree dimensions (DIMENSIONS, 2 to 8)")
+    parser.add_argument("--grid", type=int, default=4096, help="least-resistance grid size")
+    parser.add_argument("--pm", type=int, default=0, help="postquantum particle-mesh size (0 = pairwise sums)")
+    parser.add_argument("--work-exponent", type=float, help="weak scaling takes work ~ size ** this instead of "
+                        "each variant's own model")
+    parser.add_argument("--no-weak", action="store_true", help="skip weak scaling")
+    parser.add_argument("--csv", help="also write every measurement to this file")
+    args = parser.parse_args()
+
+    variants = args.variants.split(",")
+    for variant in variants:
+        if variant not in VARIANTS:
+            parser.error("unknown variant " + variant)
+    args.threads = [int(t) for t in args.threads.split(",")] if args.threads else default_threads()
+    sizes = [int(s) for s in args.sizes.split(",")] if args.sizes else None
+    args.sizes = {v: sizes or VARIANTS[v]["sizes"] for v in variants}
+
+    out = open(args.csv, "w", newline="") if args.csv else None
+    writer = csv.writer(out) if out else None
+    if writer:
+        writer.writerow(["variant", "mode", "size", "threads", "phase", "seconds"])
+
+    cache = {}
+    with tempfile.TemporaryDirectory() as builddir:
+        for variant in variants:
+            for size in args.sizes[variant]:
+                strong_scaling(variant, size, args, builddir, cache, writer)
+            if not args.no_weak:
+                weak_scaling(variant, args, builddir, cache, writer)
+    if out:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -1,3 +1,4 @@
+#define GL_GLEXT_PROTOTYPES // Buffer objects
 #include <GL/glut.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
@@ -6,9 +7,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h> // Include this header for memset
+#include <stdint.h>
+#include <time.h>
+#include "../rng.h"
+#include "../memtrack.h"
 
 #define MAX_DEPTH 3 // Adjusted for testing
 #define NUM_POINTS 100 // Adjusted for testing
+#define TASK_MIN_SUBTREE 4096 // Subtrees smaller than this are generated inline by one thread
+#define SPIN_DEGREES_PER_SECOND 20.0f
+#define DEFAULT_RESAMPLE 2 // Subtrees of the origin regenerated per frame
 
 typedef struct {
     float x, y, z;
@@ -21,6 +29,27 @@ int lastMouseX, lastMouseY;
 
 int keys[256];
 
+// The tree is generated once and kept as line vertices, in a client buffer and
+// a GL buffer object. Each frame regenerates only a few subtrees of the origin
+// (round robin) and uploads just their ranges; the spin itself is a rotation.
+float* lines = NULL; // Two xyz vertices per edge, the edge into slot s at index s - 1
+long numEdges;
+long subtreeSize[MAX_DEPTH + 1]; // Nodes in a subtree whose root sits at each depth
+uint64_t seed;
+uint64_t generation[NUM_POINTS]; // Times each subtree of the origin has been resampled
+int resamplePerFrame = DEFAULT_RESAMPLE;
+int nextResample = 0;
+GLuint lineBuffer;
+int memEdges, memBuffer; // Tags, see memtrack.h: the edges in memory and their copy in the vertex buffer
+double startTime;
+
+// A point's slot encodes its path from the origin and every subtree of the
+// origin has its own stream per generation, so the tree does not depend on
+// how threads split the work and one subtree can be redrawn alone
+static inline float slotRandom(uint64_t stream, long slot, int draw) {
+    return rngUniform(stream, slot, draw);
+}
+
 void init(void) {
     glClearColor(0.0, 0.0, 0.0, 0.0);
     glShadeModel(GL_FLAT);
@@ -30,33 +59,117 @@ void init(void) {
     lastMouseX = glutGet(GLUT_WINDOW_WIDTH) / 2;
     lastMouseY = glutGet(GLUT_WINDOW_HEIGHT) / 2;
     memset(keys, 0, sizeof(keys));
+
+    subtreeSize[MAX_DEPTH] = 1;
+    for (int d = MAX_DEPTH - 1; d >= 0; d--) {
+        subtreeSize[d] = 1 + NUM_POINTS * subtreeSize[d + 1];
+    }
+    numEdges = subtreeSize[0] - 1;
+    memEdges = memTag("edges");
+    memBuffer = memTag("buffer");
+    memEstimate(memEdges, numEdges * 6 * (long)sizeof(float));
+    memEstimate(memBuffer, numEdges * 6 * (long)sizeof(float));
+    memPrintEstimate(stdout);
+    atexit(memReportAtExit);
+    lines = (float*)memAlloc(memEdges, numEdges * 6 * sizeof(float));
+    if (lines == NULL) {
+        fprintf(stderr, "Cannot allocate %ld edges\n", numEdges);
+        exit(1);
+    }
 }
 
-void drawLine(Point3D p1, Point3D p2) {
-    glBegin(GL_LINES);
-    glVertex3f(p1.x, p1.y, p1.z);
-    glVertex3f(p2.x, p2.y, p2.z);
-    glEnd();
+// One step from a point in a random direction, drawn from the slot's stream,
+// stored as the edge into that slot
+Point3D step(Point3D point, uint64_t stream, long slot) {
+    float theta = slotRandom(stream, slot, 0) * 2.0 * M_PI; // Angle around the Z-axis
+    float phi = slotRandom(stream, slot, 1) * M_PI;        // Angle from the Z-axis
+
+    // Convert spherical coordinates to Cartesian coordinates
+    float x = point.x + sin(phi) * cos(theta);
+    float y = point.y + sin(phi) * sin(theta);
+    float z = point.z + cos(phi);
+
+    Point3D newPoint = {x, y, z};
+    float* edge = &lines[(slot - 1) * 6];
+    edge[0] = point.x;
+    edge[1] = point.y;
+    edge[2] = point.z;
+    edge[3] = x;
+    edge[4] = y;
+    edge[5] = z;
+    return newPoint;
 }
 
-void expand(Point3D point, int depth) {
+void expand(Point3D point, int depth, long slot, uint64_t stream) {
     if (depth >= MAX_DEPTH) return;
 
-    #pragma omp parallel for
     for (int i = 0; i < NUM_POINTS; i++) {
-        float theta = ((float)rand() / RAND_MAX) * 2.0 * M_PI; // Angle around the Z-axis
-        float phi = ((float)rand() / RAND_MAX) * M_PI;        // Angle from the Z-axis
+        long childSlot = slot + 1 + i * subtreeSize[depth + 1];
+        Point3D newPoint = step(point, stream, childSlot);
 
-        // Convert spherical coordinates to Cartesian coordinates
-        float x = point.x + sin(phi) * cos(theta);
-        float y = point.y + sin(phi) * sin(theta);
-        float z = point.z + cos(phi);
+        // Large subtrees become tasks; each one writes only its own slot range
+        #pragma omp task firstprivate(newPoint, childSlot) if(subtreeSize[depth + 1] >= TASK_MIN_SUBTREE)
+        expand(newPoint, depth + 1, childSlot, stream);
+    }
+}
 
-        Point3D newPoint = {x, y, z};
+// Regenerates subtree i of the origin with its next random stream
+void resampleSubtree(int i) {
+    uint64_t stream = mix64(seed ^ mix64(((uint64_t)i << 32) + generation[i]++));
+    long childSlot = 1 + i * subtreeSize[1];
+    Point3D origin = {0.0, 0.0, 0.0};
+    Point3D child = step(origin, stream, childSlot);
+    expand(child, 1, childSlot, stream);
+}
 
-        drawLine(point, newPoint);
-        expand(newPoint, depth + 1);
+// Resamples count subtrees round robin and uploads only their edge ranges
+void resample(int count) {
+    int first = nextResample;
+    if (count > NUM_POINTS) count = NUM_POINTS;
+    #pragma omp parallel
+    #pragma omp single
+    for (int k = 0; k < count; k++) {
+        #pragma omp task
+        resampleSubtree((first + k) % NUM_POINTS);
     }
+    nextResample = (first + count) % NUM_POINTS;
+
+    glBindBuffer(GL_ARRAY_BUFFER, lineBuffer);
+    for (int k = 0; k < count; k++) {
+        long offset = ((first + k) % NUM_POINTS) * subtreeSize[1] * 6; // Edges into the subtree's slots
+        glBufferSubData(GL_ARRAY_BUFFER, offset * sizeof(float), subtreeSize[1] * 6 * sizeof(float), &lines[offset]);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void createTree(void) {
+    #pragma omp parallel
+    #pragma omp single
+    for (int i = 0; i < NUM_POINTS; i++) {
+        #pragma omp task
+        resampleSubtree(i);
+    }
+
+    glGenBuffers(1, &lineBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, lineBuffer);
+    glBufferData(GL_ARRAY_BUFFER, numEdges * 6 * sizeof(float), lines, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (glGetError() == GL_OUT_OF_MEMORY) {
+        fprintf(stderr, "Cannot allocate a vertex buffer for %ld edges\n", numEdges);
+        exit(1);
+    }
+    // Driver memory, on the GPU or mirrored in RAM; it lives as long as the window
+    memAccount(memBuffer, numEdges * 6 * (long)sizeof(float));
+    startTime = omp_get_wtime();
+}
+
+void drawTree(void) {
+    glBindBuffer(GL_ARRAY_BUFFER, lineBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, NULL);
+    glDrawArrays(GL_LINES, 0, 2 * numEdges);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 void display(void) {
@@ -71,8 +184,11 @@ void display(void) {
               cameraX + lookX, cameraY + lookY, cameraZ + lookZ,
               0.0, 1.0, 0.0);
 
-    Point3D start = {0.0, 0.0, 0.0};
-    expand(start, 0);
+    if (resamplePerFrame > 0) {
+        resample(resamplePerFrame);
+    }
+    glRotatef(SPIN_DEGREES_PER_SECOND * (omp_get_wtime() - startTime), 0.0, 1.0, 0.0);
+    drawTree();
 
     glutSwapBuffers();
 }
@@ -143,7 +259,14 @@ int main(int argc, char **argv) {
     glutInitWindowPosition(100, 100);
     glutCreateWindow("Expansion in 3D Space");
 
+    // Optional seed argument replays the same sequence of trees, the second one
+    // is how many subtrees of the origin are redrawn each frame (0 = fixed tree,
+    // 100 = a whole new tree every frame)
+    seed = (argc > 1) ? strtoull(argv[1], NULL, 10) : (uint64_t)time(NULL);
+    resamplePerFrame = (argc > 2) ? atoi(argv[2]) : DEFAULT_RESAMPLE;
+
     init();
+    createTree();
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboardDown);
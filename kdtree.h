@@ -0,0 +1,418 @@
+// k-d tree over 3D positions for picking and range queries.
+// Positions are read from any array of structs whose first three floats are
+// x, y, z (System, Node). The tree keeps its own packed copy in leaf order.
+// When the simulation moves things, kdUpdate refits the bounding boxes in
+// O(N). It only rebuilds when the boxes have grown enough to slow queries
+// down.
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <omp.h>
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "memtrack.h"
+
+#define KD_LEAF_SIZE 8
+#define KD_TASK_MIN 16384 // Ranges smaller than this are built inline by one thread
+#define KD_REBUILD_GROWTH 2.0f // Rebuild once leaf boxes are this much larger than when built
+
+typedef struct {
+    float lo[3], hi[3];
+    long begin, end; // Range of entries in order/points
+    int left, right; // Children, -1 for leaves
+} KdNode;
+
+typedef struct {
+    long count;
+    long* order;   // Source index of each entry
+    float* points; // xyz of each entry, refreshed by kdUpdate
+    KdNode* nodes;
+    int numNodes;
+    float builtSpread; // Sum of leaf box diagonals right after the last build
+    void* storage;     // Caller's memory builds go into (kdUseStorage), NULL to allocate
+    long capacity;     // Points that storage has room for
+} KdTree;
+
+static inline const float* kdSource(const void* base, size_t stride, long i) {
+    return (const float*)((const char*)base + i * stride);
+}
+
+// Nodes in a balanced subtree over n entries; fixes every node's slot in
+// advance so subtrees can be built in parallel
+static inline int kdSubtreeNodes(long n) {
+    return n <= KD_LEAF_SIZE ? 1 : 1 + kdSubtreeNodes(n / 2) + kdSubtreeNodes(n - n / 2);
+}
+
+// Where the nodes start in storage laid out for count points: after order
+// and points, aligned for the longs in KdNode
+static inline long kdNodesOffset(long count) {
+    long bytes = (count + 1) * (long)(sizeof(long) + 3 * sizeof(float));
+    return (bytes + (long)sizeof(long) - 1) / (long)sizeof(long) * (long)sizeof(long);
+}
+
+// What kdBuild allocates for count points, for memory estimates and storage
+static inline long kdEstimateBytes(long count) {
+    long nodes = count > 0 ? kdSubtreeNodes(count) : 0;
+    return kdNodesOffset(count) + (nodes + 1) * (long)sizeof(KdNode);
+}
+
+static inline void kdSwap(KdTree* t, long a, long b) {
+    long o = t->order[a];
+    t->order[a] = t->order[b];
+    t->order[b] = o;
+    for (int k = 0; k < 3; k++) {
+        float v = t->points[a * 3 + k];
+        t->points[a * 3 + k] = t->points[b * 3 + k];
+        t->points[b * 3 + k] = v;
+    }
+}
+
+// Quickselect: entry mid gets its sorted position along axis
+static inline void kdSelect(KdTree* t, long begin, long end, long mid, int axis) {
+    while (end - begin > 1) {
+        float pivot = t->points[((begin + end) / 2) * 3 + axis];
+        long i = begin, j = end - 1;
+        while (i <= j) {
+            while (t->points[i * 3 + axis] < pivot) i++;
+            while (t->points[j * 3 + axis] > pivot) j--;
+            if (i <= j) kdSwap(t, i++, j--);
+        }
+        if (mid <= j) end = j + 1;
+        else if (mid >= i) begin = i;
+        else return;
+    }
+}
+
+static inline void kdLeafBox(KdTree* t, KdNode* node) {
+    for (int k = 0; k < 3; k++) {
+        node->lo[k] = FLT_MAX;
+        node->hi[k] = -FLT_MAX;
+    }
+    for (long i = node->begin; i < node->end; i++) {
+        for (int k = 0; k < 3; k++) {
+            float v = t->points[i * 3 + k];
+            if (v < node->lo[k]) node->lo[k] = v;
+            if (v > node->hi[k]) node->hi[k] = v;
+        }
+    }
+}
+
+static inline void kdUnionBox(KdTree* t, KdNode* node) {
+    KdNode* a = &t->nodes[node->left];
+    KdNode* b = &t->nodes[node->right];
+    for (int k = 0; k < 3; k++) {
+        node->lo[k] = fminf(a->lo[k], b->lo[k]);
+        node->hi[k] = fmaxf(a->hi[k], b->hi[k]);
+    }
+}
+
+static inline void kdBuildNode(KdTree* t, int id, long begin, long end) {
+    KdNode* node = &t->nodes[id];
+    node->begin = begin;
+    node->end = end;
+    kdLeafBox(t, node);
+    if (end - begin <= KD_LEAF_SIZE) {
+        node->left = node->right = -1;
+        return;
+    }
+
+    // Split the widest extent at the median
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (node->hi[k] - node->lo[k] > node->hi[axis] - node->lo[axis]) axis = k;
+    }
+    long mid = begin + (end - begin) / 2;
+    kdSelect(t, begin, end, mid, axis);
+
+    node->left = id + 1;
+    node->right = id + 1 + kdSubtreeNodes(mid - begin);
+    #pragma omp task if(end - begin >= KD_TASK_MIN)
+    kdBuildNode(t, node->left, begin, mid);
+    kdBuildNode(t, node->right, mid, end);
+    #pragma omp taskwait
+}
+
+static inline float kdLeafSpread(const KdTree* t) {
+    float spread = 0.0f;
+    for (int i = 0; i < t->numNodes; i++) {
+        const KdNode* node = &t->nodes[i];
+        if (node->left >= 0) continue;
+        float dx = node->hi[0] - node->lo[0], dy = node->hi[1] - node->lo[1], dz = node->hi[2] - node->lo[2];
+        spread += sqrtf(dx * dx + dy * dy + dz * dz);
+    }
+    return spread;
+}
+
+static inline void kdBuild(KdTree* t, const void* base, size_t stride, long count) {
+    if (count != t->count && t->storage != NULL) {
+        if (kdEstimateBytes(count) > kdEstimateBytes(t->capacity)) {
+            fprintf(stderr, "k-d tree storage for %ld points cannot hold %ld\n", t->capacity, count);
+            exit(1);
+        }
+        t->count = count;
+        t->numNodes = count > 0 ? kdSubtreeNodes(count) : 0;
+        t->order = (long*)t->storage;
+        t->points = (float*)(t->order + count + 1);
+        t->nodes = (KdNode*)((char*)t->storage + kdNodesOffset(count));
+    } else if (count != t->count) {
+        int tag = memTag("index");
+        memFree(t->order);
+        memFree(t->points);
+        memFree(t->nodes);
+        t->count = count;
+        t->numNodes = count > 0 ? kdSubtreeNodes(count) : 0;
+        t->order = (long*)memAlloc(tag, (count + 1) * sizeof(long));
+        t->points = (float*)memAlloc(tag, (count + 1) * 3 * sizeof(float));
+        t->nodes = (KdNode*)memAlloc(tag, (t->numNodes + 1) * sizeof(KdNode));
+        if (t->order == NULL || t->points == NULL || t->nodes == NULL) {
+            fprintf(stderr, "Cannot allocate a k-d tree over %ld points\n", count);
+            exit(1);
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < count; i++) {
+        const float* p = kdSource(base, stride, i);
+        t->order[i] = i;
+        t->points[i * 3 + 0] = p[0];
+        t->points[i * 3 + 1] = p[1];
+        t->points[i * 3 + 2] = p[2];
+    }
+    if (count == 0) return;
+
+    #pragma omp parallel
+    #pragma omp single
+    kdBuildNode(t, 0, 0, count);
+    t->builtSpread = kdLeafSpread(t);
+}
+
+// Brings the tree up to date with moved positions (same count, same order of
+// the source array): refit in O(N), rebuild only when queries would suffer
+static inline void kdUpdate(KdTree* t, const void* base, size_t stride, long count) {
+    if (count != t->count || t->nodes == NULL) {
+        kdBuild(t, base, stride, count);
+        return;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < count; i++) {
+        const float* p = kdSource(base, stride, t->order[i]);
+        t->points[i * 3 + 0] = p[0];
+        t->points[i * 3 + 1] = p[1];
+        t->points[i * 3 + 2] = p[2];
+    }
+
+    // Children always have larger slots than their parent, so leaves first
+    // (in parallel), then parents from the back
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < t->numNodes; i++) {
+        if (t->nodes[i].left < 0) kdLeafBox(t, &t->nodes[i]);
+    }
+    for (int i = t->numNodes - 1; i >= 0; i--) {
+        if (t->nodes[i].left >= 0) kdUnionBox(t, &t->nodes[i]);
+    }
+
+    if (kdLeafSpread(t) > KD_REBUILD_GROWTH * t->builtSpread) {
+        kdBuild(t, base, stride, count);
+    }
+}
+
+// The source array was permuted: entry i moved to newIndex[i]. The tree
+// keeps its shape, only the indices it returns change.
+static inline void kdRemap(KdTree* t, const long* newIndex) {
+    if (t->order == NULL) return;
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < t->count; i++) {
+        t->order[i] = newIndex[t->order[i]];
+    }
+}
+
+static inline float kdBoxDistance2(const KdNode* node, const float p[3]) {
+    float d2 = 0.0f;
+    for (int k = 0; k < 3; k++) {
+        float d = fmaxf(fmaxf(node->lo[k] - p[k], p[k] - node->hi[k]), 0.0f);
+        d2 += d * d;
+    }
+    return d2;
+}
+
+static inline float kdDistance2(const KdTree* t, long entry, const float p[3]) {
+    float dx = t->points[entry * 3 + 0] - p[0];
+    float dy = t->points[entry * 3 + 1] - p[1];
+    float dz = t->points[entry * 3 + 2] - p[2];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// k nearest: indices and squared distances, closest first, kept as a max-heap while searching
+static inline void kdKNearestNode(const KdTree* t, int id, const float p[3], int k,
+                                  long* indices, float* distances, int* found) {
+    const KdNode* node = &t->nodes[id];
+    if (*found == k && kdBoxDistance2(node, p) >= distances[0]) return;
+
+    if (node->left < 0) {
+        for (long i = node->begin; i < node->end; i++) {
+            float d2 = kdDistance2(t, i, p);
+            if (*found < k) {
+                // Sift up
+                int c = (*found)++;
+                while (c > 0 && distances[(c - 1) / 2] < d2) {
+                    distances[c] = distances[(c - 1) / 2];
+                    indices[c] = indices[(c - 1) / 2];
+                    c = (c - 1) / 2;
+                }
+                distances[c] = d2;
+                indices[c] = t->order[i];
+            } else if (d2 < distances[0]) {
+                // Replace the farthest and sift down
+                int c = 0;
+                for (;;) {
+                    int child = 2 * c + 1;
+                    if (child >= k) break;
+                    if (child + 1 < k && distances[child + 1] > distances[child]) child++;
+                    if (distances[child] <= d2) break;
+                    distances[c] = distances[child];
+                    indices[c] = indices[child];
+                    c = child;
+                }
+                distances[c] = d2;
+                indices[c] = t->order[i];
+            }
+        }
+        return;
+    }
+
+    int nearFirst = kdBoxDistance2(&t->nodes[node->left], p) <= kdBoxDistance2(&t->nodes[node->right], p);
+    kdKNearestNode(t, nearFirst ? node->left : node->right, p, k, indices, distances, found);
+    kdKNearestNode(t, nearFirst ? node->right : node->left, p, k, indices, distances, found);
+}
+
+static inline int kdKNearest(const KdTree* t, const float p[3], int k, long* indices, float* distances) {
+    int found = 0;
+    if (t->numNodes == 0 || k <= 0) return 0;
+    kdKNearestNode(t, 0, p, k, indices, distances, &found);
+
+    // Heap to ascending order
+    for (int end = found - 1; end > 0; end--) {
+        float d = distances[0];
+        long i = indices[0];
+        distances[0] = distances[end];
+        indices[0] = indices[end];
+        distances[end] = d;
+        indices[end] = i;
+        int c = 0;
+        for (;;) {
+            int child = 2 * c + 1;
+            if (child >= end) break;
+            if (child + 1 < end && distances[child + 1] > distances[child]) child++;
+            if (distances[child] <= distances[c]) break;
+            float td = distances[c];
+            long ti = indices[c];
+            distances[c] = distances[child];
+            indices[c] = indices[child];
+            distances[child] = td;
+            indices[child] = ti;
+            c = child;
+        }
+    }
+    return found;
+}
+
+static inline long kdNearest(const KdTree* t, const float p[3], float* distance2) {
+    long index = -1;
+    float d2 = FLT_MAX;
+    int found = 0;
+    if (t->numNodes > 0) kdKNearestNode(t, 0, p, 1, &index, &d2, &found);
+    if (distance2 != NULL) *distance2 = d2;
+    return index;
+}
+
+static inline void kdRadiusNode(const KdTree* t, int id, const float p[3], float r2,
+                                long* out, long capacity, long* found) {
+    const KdNode* node = &t->nodes[id];
+    if (kdBoxDistance2(node, p) > r2) return;
+
+    if (node->left < 0) {
+        for (long i = node->begin; i < node->end; i++) {
+            if (kdDistance2(t, i, p) <= r2) {
+                if (*found < capacity) out[*found] = t->order[i];
+                (*found)++;
+            }
+        }
+        return;
+    }
+    kdRadiusNode(t, node->left, p, r2, out, capacity, found);
+    kdRadiusNode(t, node->right, p, r2, out, capacity, found);
+}
+
+// Every point within radius of p: returns how many there are, stores up to capacity of them
+static inline long kdRadius(const KdTree* t, const float p[3], float radius, long* out, long capacity) {
+    long found = 0;
+    if (t->numNodes > 0) kdRadiusNode(t, 0, p, radius * radius, out, capacity, &found);
+    return found;
+}
+
+static inline void kdPickNode(const KdTree* t, int id, const float origin[3], const float dir[3],
+                              float tanAngle, long* best, float* bestAlong) {
+    const KdNode* node = &t->nodes[id];
+
+    // Bounding sphere of the box against the pick cone
+    float c[3], r2 = 0.0f;
+    for (int k = 0; k < 3; k++) {
+        c[k] = 0.5f * (node->lo[k] + node->hi[k]) - origin[k];
+        float h = 0.5f * (node->hi[k] - node->lo[k]);
+        r2 += h * h;
+    }
+    float radius = sqrtf(r2);
+    float along = c[0] * dir[0] + c[1] * dir[1] + c[2] * dir[2];
+    if (along + radius < 0.0f || along - radius > *bestAlong) return;
+    float across = sqrtf(fmaxf(c[0] * c[0] + c[1] * c[1] + c[2] * c[2] - along * along, 0.0f));
+    if (across - radius > fmaxf(along + radius, 0.0f) * tanAngle + radius) return;
+
+    if (node->left < 0) {
+        for (long i = node->begin; i < node->end; i++) {
+            float v[3] = {t->points[i * 3] - origin[0], t->points[i * 3 + 1] - origin[1], t->points[i * 3 + 2] - origin[2]};
+            float a = v[0] * dir[0] + v[1] * dir[1] + v[2] * dir[2];
+            if (a <= 0.0f || a >= *bestAlong) continue;
+            float across2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2] - a * a;
+            if (across2 <= a * a * tanAngle * tanAngle) {
+                *best = t->order[i];
+                *bestAlong = a;
+            }
+        }
+        return;
+    }
+    kdPickNode(t, node->left, origin, dir, tanAngle, best, bestAlong);
+    kdPickNode(t, node->right, origin, dir, tanAngle, best, bestAlong);
+}
+
+// Front-most point inside a narrow cone around a ray (dir normalised), or -1
+static inline long kdPick(const KdTree* t, const float origin[3], const float dir[3], float tanAngle) {
+    long best = -1;
+    float bestAlong = FLT_MAX;
+    if (t->numNodes > 0) kdPickNode(t, 0, origin, dir, tanAngle, &best, &bestAlong);
+    return best;
+}
+
+// Storage from kdUseStorage is the caller's to release
+static inline void kdFree(KdTree* t) {
+    if (t->storage == NULL) {
+        memFree(t->order);
+        memFree(t->points);
+        memFree(t->nodes);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+// Builds go into storage of kdEstimateBytes(capacity) bytes from now on, say
+// part of a file mapping, rather than into memory of the tree's own
+static inline void kdUseStorage(KdTree* t, void* storage, long capacity) {
+    kdFree(t);
+    t->storage = storage;
+    t->capacity = capacity;
+}
+
+#endif
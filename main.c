@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For thread pinning in bigalloc.h
 #include <GL/glut.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
@@ -6,18 +7,53 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h> // Include this header for memset
+#include <stdint.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "softrender.h"
+#include "bigalloc.h"
+#include "kdtree.h"
+#include "quality.h"
+#include "pacing.h"
+#include "metrics.h"
+#include "memtrack.h"
+#include "rng.h"
 
+#ifndef MAX_DEPTH
 #define MAX_DEPTH 3 // Adjusted for testing
+#endif
+#ifndef NUM_POINTS
 #define NUM_POINTS 100 // Adjusted for testing
+#endif
+#ifndef DIMENSIONS
+#define DIMENSIONS 3 // Space the tree expands into, 2 to 8; drawing keeps the first three axes
+#endif
+#if DIMENSIONS < 2 || DIMENSIONS > 8
+#error "DIMENSIONS must be between 2 and 8"
+#endif
+#define STORED_DIMENSIONS (DIMENSIONS < 3 ? 3 : DIMENSIONS) // 2D still stores a z, always 0
 #define GRAVITY_ZONE_RADIUS 5.0f
 #define MAX_SPEED 0.05f
 #define STRONG_FORCE_CONSTANT 0.001f
+#define TASK_MIN_SUBTREE 4096 // Subtrees smaller than this are generated inline by one thread
+#define TREE_BLOCK_BYTES (64L << 20) // Readahead unit when the tree is backed by a file
+#define FORCE_BLOCK 65536 // Consecutive slots whose forces are summed in index order, see updateTree
+#define PICK_TAN_ANGLE 0.01f // Pick cone half-angle, about 5 pixels at 800x600
+#define TREE_MASS NUM_POINTS // Total mass, so the whole tree pulls as hard as the root alone used to
 
+// Every kernel loops over the DIMENSIONS coordinates. The count is a
+// compile-time constant, so the loops unroll into the same straight-line code
+// x, y and z used to be, and the element-wise ones vectorise for higher
+// dimensions. x[0..2] come first, so drawing and the k-d tree (which read
+// the first three floats of a node) see the projection to 3D.
 typedef struct {
-    float x, y, z;
-    float vx, vy, vz; // Velocity components
-} Point3D;
+    float x[STORED_DIMENSIONS];
+    float v[STORED_DIMENSIONS]; // Velocity components
+} Point;
 
 float cameraX = 0.0f, cameraY = 0.0f, cameraZ = 10.0f;
 float cameraYaw = 0.0f, cameraPitch = 0.0f;
@@ -26,28 +62,157 @@ int lastMouseX, lastMouseY;
 
 int keys[256];
 
+// The whole tree lives in one flat array in depth-first order. Every node's
+// slot is known up front, so children are found by arithmetic, not pointers.
 typedef struct Node {
-    Point3D point;
-    struct Node* children[NUM_POINTS];
+    Point point;
     int depth;
 } Node;
 
-Node* createNode(Point3D point, int depth);
-void generatePoints(Node* node);
+void createTree(int background);
+void stopGenerator(void);
+void generateTree(void);
+void* generateInBackground(void* arg);
+void setTreeLevels(int levels);
+int attachReadyLevels(void);
+Node* allocateTree(long count);
+void* treeStorage(int tag, size_t bytes);
+void prefetchSubtree(Node* node);
 void drawNode(Node* node);
-void drawLine(Point3D p1, Point3D p2);
-void updateNode(Node* node, Node* root);
+void drawLine(const Point* p1, const Point* p2);
+void updateTree(void);
+void indexNodes(void);
 
 Node* root;
+long numNodes;
+long subtreeSize[MAX_DEPTH + 1]; // Nodes in a subtree whose root sits at each depth
+uint64_t seed;
+const char* treeFile = NULL; // When set, nodes live in this memory-mapped file instead of RAM
+int treeFileTemporary = 0;   // The file was picked to fit the memory budget and goes away once mapped
+const char* framePattern = NULL; // When set, frames are rendered in software to these files, no window
+int numFrames = 1;
+int frameWidth = 800, frameHeight = 600;
+int pinning = 0;
+int blockDepth = 0; // Shallowest depth whose subtrees fit in one readahead block
+long selectedNode = -1;
+int memTree, memForces, memRender, memEdges; // Tags, see memtrack.h
+QualityController quality;
+int physicsInterval = 1; // Frames per simulation step
+int drawStride = 1;      // Every n-th edge at the deepest drawn level
+int drawDepth = MAX_DEPTH;
+
+// The tree grows level by level on a background thread. The generator
+// publishes how many levels below the root it has finished (levelsReady,
+// atomic); the main thread attaches them between steps (treeLevels), and
+// drawing, physics and picking only ever look at attached levels.
+int levelsReady = 0;
+int treeLevels = 0;
+long levelSize[MAX_DEPTH + 1]; // Like subtreeSize, counting attached levels only
+pthread_t generatorThread;
+int generatorStop = 0; // Atomic, set at exit: the generator drops what is left
+double generateStart;
+
+long levelStart[MAX_DEPTH + 1]; // Nodes above depth d, so the k-th node at depth d is levelStart[d] + k overall
+float nodeMass; // Every node weighs the same
+float openingAngle = 0.7f; // A box pulls as one mass once its radius is below this times its distance
+float requestedAngle = 0.7f; // --theta, what openingAngle is at full quality
+
+// Forces go through a k-d tree over the attached nodes, which is also the
+// picking index. Siblings fan out around their parent, so subtrees of the
+// node tree overlap in space and would make poor groups; the k-d boxes are
+// the groups instead. Point j the index is built from is the j-th attached
+// node in depth-first order (attachedSlot), which is slot j once the whole
+// tree is attached. The index keeps its entries in leaf order (see
+// kdtree.h): indexedEntry[j] is where point j went, entryPosition holds the
+// full position of each entry in that order, boxCentre and boxRadius the
+// centre of mass of each box and how far from it its nodes reach. Refreshed
+// by indexNodes before every step and before picking after one. All of it
+// lives wherever the nodes do (treeStorage).
+KdTree nodeIndex;
+int nodeIndexStale = 1;
+long indexedNodes;
+float (*indexedPosition)[STORED_DIMENSIONS] = NULL; // What the index is built from, point j in row j
+long* indexedEntry = NULL;
+float (*entryPosition)[DIMENSIONS] = NULL;
+float (*boxCentre)[DIMENSIONS] = NULL;
+float* boxRadius = NULL;
+char* treeMap = NULL; // All of treeFile, mapped, when the tree is out of core
+size_t treeMapBytes = 0, treeMapUsed = 0;
+
+// What each quality level gives up: {physics interval, draw stride, depth
+// levels not drawn, opening angle in hundredths}. The angle makes a step
+// cheaper rather than rarer; it is never below --theta.
+static const int qualityLevels[][4] = {
+    {1, 1, 0, 0}, {1, 1, 0, 90}, {2, 1, 0, 90}, {2, 2, 0, 100}, {4, 4, 0, 100},
+    {4, 4, 1, 100}, {8, 8, 1, 120}, {8, 8, 2, 120}
+};
+#define NUM_QUALITY_LEVELS (int)(sizeof(qualityLevels) / sizeof(qualityLevels[0]))
+
+// Prometheus series, see metrics.h
+int metricSteps, metricFrames, metricStepSeconds, metricNodes, metricLevels, metricQuality;
+int metricMemory[MEM_MAX_TAGS], metricMemoryPeak[MEM_MAX_TAGS];
+
+void registerMetrics(void) {
+    metricSteps = metricsRegister("tree_steps_total", "counter", "Simulation steps taken");
+    metricFrames = metricsRegister("tree_frames_total", "counter", "Frames drawn");
+    metricStepSeconds = metricsRegister("tree_step_seconds", "gauge", "Duration of the last step");
+    metricNodes = metricsRegister("tree_nodes", "gauge", "Nodes in the tree");
+    metricLevels = metricsRegister("tree_levels_ready", "gauge", "Levels below the root generated so far");
+    metricQuality = metricsRegister("tree_quality_level", "gauge", "Adaptive quality level, 0 is full quality");
+    for (int t = 0; t < numMemTags; t++) {
+        char name[96];
+        snprintf(name, sizeof(name), "tree_memory_bytes{tag=\"%.23s\"}", memTags[t].name);
+        metricMemory[t] = metricsRegister(name, "gauge", "Memory allocated per subsystem");
+        snprintf(name, sizeof(name), "tree_memory_peak_bytes{tag=\"%.23s\"}", memTags[t].name);
+        metricMemoryPeak[t] = metricsRegister(name, "gauge", "Most memory ever allocated per subsystem");
+    }
+}
+
+// Called after each step and each frame (stepSeconds < 0 for a frame)
+void publishMetrics(double stepSeconds) {
+    if (stepSeconds >= 0.0) {
+        metricsAdd(metricSteps, 1.0);
+        metricsSet(metricStepSeconds, stepSeconds);
+    } else {
+        metricsAdd(metricFrames, 1.0);
+    }
+    metricsSet(metricNodes, (double)numNodes);
+    metricsSet(metricLevels, (double)treeLevels);
+    metricsSet(metricQuality, (double)quality.level);
+    for (int t = 0; t < numMemTags; t++) {
+        metricsSet(metricMemory[t], (double)memTags[t].live);
+        metricsSet(metricMemoryPeak[t], (double)memTags[t].peak);
+    }
+    metricsPublish();
+}
+
+// Child i of a node occupies the slot right after the subtrees of children 0..i-1
+static inline Node* childOf(Node* node, int i) {
+    return node + 1 + i * subtreeSize[node->depth + 1];
+}
+
+// Slot of the node with the given ordinal at a depth: the ordinal's digits in
+// base NUM_POINTS are the child indices along its path, the last one deepest
+static inline long slotOfOrdinal(int depth, long ordinal) {
+    long slot = 0;
+    for (int d = depth; d >= 1; d--) {
+        slot += 1 + (ordinal % NUM_POINTS) * subtreeSize[d];
+        ordinal /= NUM_POINTS;
+    }
+    return slot;
+}
+
+// A node's draws are keyed by its slot, which encodes its path from the root,
+// so the tree is identical for a given seed whatever the thread count
+static inline float slotRandom(long slot, int draw) {
+    return rngUniform(seed, slot, draw);
+}
 
 void init(void) {
     glClearColor(0.0, 0.0, 0.0, 0.0);
     glShadeModel(GL_FLAT);
     glEnable(GL_DEPTH_TEST);
-    srand(time(NULL)); // Initialize random seed only once
-    Point3D start = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
-    root = createNode(start, 0);
-    generatePoints(root);
+    createTree(1);
     glutSetCursor(GLUT_CURSOR_NONE);
     glutWarpPointer(glutGet(GLUT_WINDOW_WIDTH) / 2, glutGet(GLUT_WINDOW_HEIGHT) / 2);
     lastMouseX = glutGet(GLUT_WINDOW_WIDTH) / 2;
@@ -55,98 +220,631 @@ void init(void) {
     memset(keys, 0, sizeof(keys));
 }
 
-Node* createNode(Point3D point, int depth) {
-    Node* node = (Node*)malloc(sizeof(Node));
-    node->point = point;
-    node->depth = depth;
-    for (int i = 0; i < NUM_POINTS; i++) {
-        node->children[i] = NULL;
+// Allocates the tree and starts generating it. In the background the call
+// returns at once with only the root; otherwise it returns with every level
+// attached.
+void createTree(int background) {
+    subtreeSize[MAX_DEPTH] = 1;
+    for (int d = MAX_DEPTH - 1; d >= 0; d--) {
+        subtreeSize[d] = 1 + NUM_POINTS * subtreeSize[d + 1];
+    }
+    numNodes = subtreeSize[0];
+    while (blockDepth < MAX_DEPTH && subtreeSize[blockDepth] * (long)sizeof(Node) > TREE_BLOCK_BYTES) {
+        blockDepth++;
+    }
+    levelStart[0] = 0;
+    for (long d = 0, width = 1; d < MAX_DEPTH; d++, width *= NUM_POINTS) {
+        levelStart[d + 1] = levelStart[d] + width;
+    }
+
+    // Pages are first touched by generateLevel. Generated in the foreground
+    // (--render, --bench), the deepest level, nearly every node, is split
+    // over the main team's threads by parent, which hands each thread about
+    // the same root subtrees as updateTree's static schedule does, so with
+    // --pin the pages sit on the socket that steps them. In the background
+    // the generator has a team of its own, half as wide and pinned the same
+    // way (see generateInBackground), so the pages still land next to the
+    // threads that step them. The per-node force arrays are touched here, with
+    // the static schedule updateTree walks them in; the index's own arrays
+    // are first written by kdBuild and indexNodes in leaf order.
+    root = allocateTree(numNodes);
+    Point start = {{0.0f}, {0.0f}};
+    root->point = start;
+    root->depth = 0;
+    long boxes = kdSubtreeNodes(numNodes);
+    indexedPosition = treeStorage(memForces, numNodes * sizeof(*indexedPosition));
+    indexedEntry = treeStorage(memForces, numNodes * sizeof(*indexedEntry));
+    entryPosition = treeStorage(memForces, numNodes * sizeof(*entryPosition));
+    boxCentre = treeStorage(memForces, boxes * sizeof(*boxCentre));
+    boxRadius = treeStorage(memForces, boxes * sizeof(*boxRadius));
+    kdUseStorage(&nodeIndex, treeStorage(memTag("index"), kdEstimateBytes(numNodes)), numNodes);
+    #pragma omp parallel for schedule(static)
+    for (long j = 0; j < numNodes; j++) {
+        memset(indexedPosition[j], 0, sizeof(indexedPosition[j]));
+        indexedEntry[j] = 0;
+    }
+    setTreeLevels(0);
+
+    generateStart = omp_get_wtime();
+    if (background) {
+        if (pthread_create(&generatorThread, NULL, generateInBackground, NULL) != 0) {
+            fprintf(stderr, "Cannot start the generator thread\n");
+            exit(1);
+        }
+        atexit(stopGenerator);
+    } else {
+        generateTree();
+        attachReadyLevels();
     }
-    return node;
 }
 
-void generatePoints(Node* node) {
-    if (node->depth >= MAX_DEPTH) return;
+static inline size_t pageRound(size_t bytes) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
 
-    for (int i = 0; i < NUM_POINTS; i++) {
-        float theta = ((float)rand() / RAND_MAX) * 2.0 * M_PI; // Angle around the Z-axis
-        float phi = ((float)rand() / RAND_MAX) * M_PI;        // Angle from the Z-axis
+// The nodes followed by the force arrays and the index, each on pages of its own
+size_t treeStorageBytes(long nodes) {
+    long boxes = kdSubtreeNodes(nodes);
+    return pageRound(nodes * sizeof(Node)) + pageRound(nodes * sizeof(*indexedPosition)) +
+           pageRound(nodes * sizeof(*indexedEntry)) + pageRound(nodes * sizeof(*entryPosition)) +
+           pageRound(boxes * sizeof(*boxCentre)) + pageRound(boxes * sizeof(*boxRadius)) +
+           pageRound(kdEstimateBytes(nodes));
+}
 
-        // Convert spherical coordinates to Cartesian coordinates
-        float x = node->point.x + sin(phi) * cos(theta);
-        float y = node->point.y + sin(phi) * sin(theta);
-        float z = node->point.z + cos(phi);
+// An array the tree is made of: bigAlloc'd in RAM, or the next piece of the
+// tree file's mapping
+void* treeStorage(int tag, size_t bytes) {
+    if (treeMap == NULL) return bigAlloc(tag, bytes);
+    if (treeMapUsed + pageRound(bytes) > treeMapBytes) {
+        fprintf(stderr, "Tree file too small for its arrays\n");
+        exit(1);
+    }
+    void* p = treeMap + treeMapUsed;
+    treeMapUsed += pageRound(bytes);
+    return p;
+}
+
+// Depth-first order means every subtree is one contiguous run of the file, so
+// generation, updateTree and drawNode all stream through it front to back and
+// the kernel can page it in and out as it goes. The force arrays and the
+// index come after the nodes in the same file, so they page just the same
+// and only rendering is left for the budget.
+Node* allocateTree(long count) {
+    size_t bytes = (size_t)count * sizeof(Node);
+    if (treeFile == NULL) {
+        return (Node*)treeStorage(memTree, bytes);
+    }
+
+    treeMapBytes = treeStorageBytes(count);
+    int fd = open(treeFile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, treeMapBytes) != 0) {
+        perror(treeFile);
+        exit(1);
+    }
+    void* map = mmap(NULL, treeMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    madvise(map, bytes, MADV_SEQUENTIAL);
+    printf("Tree of %zu MB mapped from %s (%zu MB with forces and index)\n",
+           bytes >> 20, treeFile, treeMapBytes >> 20);
+    if (treeFileTemporary) unlink(treeFile);
+    // File pages belong to the page cache, which the kernel can write back
+    // and drop, so they are not counted against the budget
+    treeMap = map;
+    treeMapUsed = 0;
+    return (Node*)treeStorage(memTree, bytes);
+}
 
-        Point3D newPoint = {x, y, z, 0.0f, 0.0f, 0.0f};
-        node->children[i] = createNode(newPoint, node->depth + 1);
-        generatePoints(node->children[i]);
+void releaseTree(void) {
+    if (treeMap == NULL) {
+        bigFree(root);
+        bigFree(indexedPosition);
+        bigFree(indexedEntry);
+        bigFree(entryPosition);
+        bigFree(boxCentre);
+        bigFree(boxRadius);
+        bigFree(nodeIndex.storage);
+    } else {
+        munmap(treeMap, treeMapBytes);
+        treeMap = NULL;
     }
+    kdFree(&nodeIndex);
+    root = NULL;
+    indexedPosition = NULL;
+    indexedEntry = NULL;
+    entryPosition = NULL;
+    boxCentre = NULL;
+    boxRadius = NULL;
 }
 
-void drawLine(Point3D p1, Point3D p2) {
+// Fills in what a run needs per tag: the window, --render or --bench
+void estimateMemory(int bench) {
+    long nodes = 1;
+    for (long d = 0, width = 1; d < MAX_DEPTH; d++) {
+        width *= NUM_POINTS;
+        nodes += width;
+    }
+    long boxes = kdSubtreeNodes(nodes);
+    memClearEstimates();
+    if (treeFile == NULL) {
+        memEstimate(memTree, bigAllocBytes(nodes * sizeof(Node)));
+        memEstimate(memForces, bigAllocBytes(nodes * sizeof(*indexedPosition)) +
+                               bigAllocBytes(nodes * sizeof(*indexedEntry)) +
+                               bigAllocBytes(nodes * sizeof(*entryPosition)) +
+                               bigAllocBytes(boxes * sizeof(*boxCentre)) + bigAllocBytes(boxes * sizeof(*boxRadius)));
+        memEstimate(memTag("index"), bigAllocBytes(kdEstimateBytes(nodes)));
+    }
+    if (bench) {
+        memEstimate(memEdges, (nodes - 1) * (long)sizeof(SoftLine));
+    } else if (framePattern != NULL) {
+        memEstimate(memRender, softEstimateBytes(frameWidth, frameHeight, nodes - 1, 0));
+    }
+}
+
+// Keeps the run within --memory: the tree, its force arrays and index move to
+// a temporary file the kernel can page out. Returns -1 when even that does
+// not fit, before anything big is allocated.
+int planMemory(int bench) {
+    memTree = memTag("tree");
+    memForces = memTag("forces");
+    memRender = memTag("render");
+    memEdges = memTag("edges");
+    estimateMemory(bench);
+    if (memBudget > 0 && memEstimateTotal() > memBudget && treeFile == NULL) {
+        static char path[4096];
+        const char* directory = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+        snprintf(path, sizeof(path), "%s/tree-%d.bin", directory, (int)getpid());
+        treeFile = path;
+        treeFileTemporary = 1;
+        estimateMemory(bench);
+        printf("The tree does not fit the memory budget, keeping it in %s\n", path);
+    }
+    memPrintEstimate(stdout);
+    if (memBudget > 0 && memEstimateTotal() > memBudget) {
+        fprintf(stderr, "Needs more memory than the budget even with the tree in a file; "
+                        "lower NUM_POINTS or MAX_DEPTH, or raise --memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Ask the kernel to start reading a block-sized subtree before we get to it
+void prefetchSubtree(Node* node) {
+    if (treeFile == NULL) return;
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)node & ~(uintptr_t)(pageSize - 1);
+    uintptr_t end = (uintptr_t)(node + subtreeSize[node->depth]);
+    madvise((void*)start, end - start, MADV_WILLNEED);
+}
+
+// Children of every node at depth - 1, stored as offsets from their parent:
+// the parent may still be moving, attachLevel adds its position later
+void generateLevel(int depth) {
+    long parents = levelStart[depth] - levelStart[depth - 1];
+    #pragma omp parallel for schedule(static)
+    for (long k = 0; k < parents; k++) {
+        if (__atomic_load_n(&generatorStop, __ATOMIC_RELAXED)) continue;
+        Node* node = root + slotOfOrdinal(depth - 1, k);
+        for (int i = 0; i < NUM_POINTS; i++) {
+            Node* child = childOf(node, i);
+            long slot = child - root;
+
+            // Hyperspherical coordinates to Cartesian: each phi tips the step
+            // away from one of the last axes, theta turns what is left in the
+            // plane of the first two. In 3D this is the usual theta and phi.
+            Point offset = {{0.0f}, {0.0f}};
+            double r = 1.0;
+            for (int dim = 1; dim <= DIMENSIONS - 2; dim++) {
+                float phi = slotRandom(slot, dim) * M_PI; // Angle from axis DIMENSIONS - dim
+                offset.x[DIMENSIONS - dim] = r * cos(phi);
+                r *= sin(phi);
+            }
+            float theta = slotRandom(slot, 0) * 2.0 * M_PI; // Angle around the rest
+            offset.x[0] = r * cos(theta);
+            offset.x[1] = r * sin(theta);
+            child->point = offset;
+            child->depth = depth;
+        }
+    }
+}
+
+// Breadth first: a level is published only once all of it is written
+void generateTree(void) {
+    for (int depth = 1; depth <= MAX_DEPTH; depth++) {
+        generateLevel(depth);
+        if (__atomic_load_n(&generatorStop, __ATOMIC_RELAXED)) return; // Half a level is never published
+        __atomic_store_n(&levelsReady, depth, __ATOMIC_RELEASE);
+        printf("Level %d of %d ready after %.3fs\n", depth, MAX_DEPTH, omp_get_wtime() - generateStart);
+    }
+    printf("Generated %ld nodes in %.3fs with seed %llu\n",
+           numNodes, omp_get_wtime() - generateStart, (unsigned long long)seed);
+}
+
+// Generator thread body. Its parallel regions get a team of their own next to
+// the main team, which keeps stepping and drawing, so it takes half the
+// threads rather than doubling up every core. With --pin that team is pinned
+// over the same CPU list: generator thread t gets main thread 2t's CPU, and
+// its share of each level (a static schedule over parents, half as many
+// chunks) is the share main threads 2t and 2t + 1 step, so first touch puts
+// the pages on their socket.
+void* generateInBackground(void* arg) {
+    (void)arg;
+    unpinThread();
+    int threads = omp_get_max_threads() / 2;
+    omp_set_num_threads(threads > 0 ? threads : 1);
+    if (pinning) pinThreads();
+    generateTree();
+    return NULL;
+}
+
+// Lets the generator drop the rest of the tree and waits for it, so the
+// process never exits (or unmaps the tree) under a thread still writing it
+void stopGenerator(void) {
+    __atomic_store_n(&generatorStop, 1, __ATOMIC_RELAXED);
+    pthread_join(generatorThread, NULL);
+}
+
+void attachLevel(int depth) {
+    long parents = levelStart[depth] - levelStart[depth - 1];
+    #pragma omp parallel for schedule(static)
+    for (long k = 0; k < parents; k++) {
+        Node* node = root + slotOfOrdinal(depth - 1, k);
+        for (int i = 0; i < NUM_POINTS; i++) {
+            Node* child = childOf(node, i);
+            #pragma omp simd
+            for (int dim = 0; dim < DIMENSIONS; dim++) child->point.x[dim] += node->point.x[dim];
+        }
+    }
+}
+
+// Slot of the j-th attached node in depth-first order: the same way down as
+// in the whole tree, with the levels below treeLevels left out
+long attachedSlot(long j) {
+    long slot = 0;
+    for (int d = 0; j > 0; d++) {
+        j--;
+        long i = j / levelSize[d + 1];
+        j -= i * levelSize[d + 1];
+        slot += 1 + i * subtreeSize[d + 1];
+    }
+    return slot;
+}
+
+void setTreeLevels(int levels) {
+    treeLevels = levels;
+    levelSize[levels] = 1;
+    for (int d = levels - 1; d >= 0; d--) {
+        levelSize[d] = 1 + NUM_POINTS * levelSize[d + 1];
+    }
+    nodeMass = (float)TREE_MASS / levelSize[0];
+    indexedNodes = levelSize[0];
+    nodeIndexStale = 1;
+}
+
+// Main thread: takes over whatever levels the generator has finished.
+// Returns 1 if the tree grew.
+int attachReadyLevels(void) {
+    int ready = __atomic_load_n(&levelsReady, __ATOMIC_ACQUIRE);
+    if (ready == treeLevels) return 0;
+    for (int depth = treeLevels + 1; depth <= ready; depth++) {
+        attachLevel(depth);
+    }
+    setTreeLevels(ready);
+    return 1;
+}
+
+void drawLine(const Point* p1, const Point* p2) {
     glBegin(GL_LINES);
-    glVertex3f(p1.x, p1.y, p1.z);
-    glVertex3f(p2.x, p2.y, p2.z);
+    glVertex3fv(p1->x);
+    glVertex3fv(p2->x);
     glEnd();
 }
 
 void drawNode(Node* node) {
-    if (node->depth >= MAX_DEPTH) return;
+    int deepest = drawDepth < treeLevels ? drawDepth : treeLevels;
+    if (node->depth >= deepest) return;
 
-    for (int i = 0; i < NUM_POINTS; i++) {
-        if (node->children[i] != NULL) {
-            drawLine(node->point, node->children[i]->point);
-            drawNode(node->children[i]);
+    // Only the deepest drawn level is thinned out, it holds almost every edge
+    int stride = (node->depth + 1 == deepest) ? drawStride : 1;
+    for (int i = 0; i < NUM_POINTS; i += stride) {
+        Node* child = childOf(node, i);
+        if (child->depth == blockDepth && i + 1 < NUM_POINTS) {
+            prefetchSubtree(childOf(node, i + 1));
         }
+        drawLine(&node->point, &child->point);
+        drawNode(child);
     }
 }
 
-void applyForces(Node* node, Node* other) {
+// Pull towards a point mass (a subtree's centre)
+// Sums of squares run in axis order, so 3D adds up exactly as it did with x, y, z
+void applyForces(Node* node, const float centre[DIMENSIONS], float mass) {
     // Calculate distance between nodes
-    float dx = other->point.x - node->point.x;
-    float dy = other->point.y - node->point.y;
-    float dz = other->point.z - node->point.z;
-    float distance = sqrt(dx*dx + dy*dy + dz*dz);
+    float d[DIMENSIONS];
+    float distance2 = 0.0f;
+    for (int k = 0; k < DIMENSIONS; k++) {
+        d[k] = centre[k] - node->point.x[k];
+        distance2 += d[k] * d[k];
+    }
+    float distance = sqrt(distance2);
 
     // Apply strong nuclear force if within gravity zone
-    if (distance < GRAVITY_ZONE_RADIUS) {
-        float force = STRONG_FORCE_CONSTANT / (distance * distance);
-        node->point.vx += force * dx / distance;
-        node->point.vy += force * dy / distance;
-        node->point.vz += force * dz / distance;
+    if (distance > 0.0f && distance < GRAVITY_ZONE_RADIUS) {
+        float force = STRONG_FORCE_CONSTANT * mass / (distance * distance);
+        #pragma omp simd
+        for (int k = 0; k < DIMENSIONS; k++) node->point.v[k] += force * d[k] / distance;
     }
 }
 
 void updateVelocity(Node* node) {
     // Limit speed
-    float speed = sqrt(node->point.vx * node->point.vx + node->point.vy * node->point.vy + node->point.vz * node->point.vz);
+    float speed2 = 0.0f;
+    for (int k = 0; k < DIMENSIONS; k++) speed2 += node->point.v[k] * node->point.v[k];
+    float speed = sqrt(speed2);
     if (speed > MAX_SPEED) {
-        node->point.vx = (node->point.vx / speed) * MAX_SPEED;
-        node->point.vy = (node->point.vy / speed) * MAX_SPEED;
-        node->point.vz = (node->point.vz / speed) * MAX_SPEED;
+        #pragma omp simd
+        for (int k = 0; k < DIMENSIONS; k++) node->point.v[k] = (node->point.v[k] / speed) * MAX_SPEED;
     }
 
     // Update position
-    node->point.x += node->point.vx;
-    node->point.y += node->point.vy;
-    node->point.z += node->point.vz;
+    #pragma omp simd
+    for (int k = 0; k < DIMENSIONS; k++) node->point.x[k] += node->point.v[k];
 }
 
-void updateNode(Node* node, Node* root) {
-    if (node->depth >= MAX_DEPTH) return;
+static inline float distanceBetween(const float* a, const float* b) {
+    float distance2 = 0.0f;
+    for (int k = 0; k < DIMENSIONS; k++) distance2 += (a[k] - b[k]) * (a[k] - b[k]);
+    return sqrt(distance2);
+}
+
+// Centre of mass of a box from its entries (a leaf) or its two halves.
+// Sums are in double.
+void centreBox(int id) {
+    KdNode* box = &nodeIndex.nodes[id];
+    double sum[DIMENSIONS] = {0.0};
+    if (box->left < 0) {
+        for (long e = box->begin; e < box->end; e++) {
+            for (int k = 0; k < DIMENSIONS; k++) sum[k] += entryPosition[e][k];
+        }
+    } else {
+        for (int half = 0; half < 2; half++) {
+            int h = half ? box->right : box->left;
+            long count = nodeIndex.nodes[h].end - nodeIndex.nodes[h].begin;
+            for (int k = 0; k < DIMENSIONS; k++) sum[k] += (double)boxCentre[h][k] * count;
+        }
+    }
+    for (int k = 0; k < DIMENSIONS; k++) boxCentre[id][k] = sum[k] / (box->end - box->begin);
+}
+
+// Rebuilds the index over the attached nodes' current positions. Refitting
+// the old boxes (kdUpdate) is cheaper, but as the tree falls together they
+// stop matching where the nodes are and the walk opens ever more of them.
+void indexNodes(void) {
+    #pragma omp parallel for schedule(static)
+    for (long j = 0; j < indexedNodes; j++) {
+        memcpy(indexedPosition[j], root[attachedSlot(j)].point.x, sizeof(indexedPosition[j]));
+    }
+    kdBuild(&nodeIndex, indexedPosition, sizeof(*indexedPosition), indexedNodes);
+    #pragma omp parallel for schedule(static)
+    for (long e = 0; e < indexedNodes; e++) {
+        memcpy(entryPosition[e], indexedPosition[nodeIndex.order[e]], sizeof(entryPosition[e]));
+        indexedEntry[nodeIndex.order[e]] = e;
+    }
+
+    // Halves always have larger ids than their box, so leaves first (in
+    // parallel), then boxes from the back. The radius is the distance to the
+    // farthest entry, not a bound from the halves': a loose radius opens
+    // boxes for nothing, and the walk costs far more than these O(N log N).
+    #pragma omp parallel for schedule(static)
+    for (int id = 0; id < nodeIndex.numNodes; id++) {
+        if (nodeIndex.nodes[id].left < 0) centreBox(id);
+    }
+    for (int id = nodeIndex.numNodes - 1; id >= 0; id--) {
+        if (nodeIndex.nodes[id].left >= 0) centreBox(id);
+    }
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int id = 0; id < nodeIndex.numNodes; id++) {
+        float radius = 0.0f;
+        for (long e = nodeIndex.nodes[id].begin; e < nodeIndex.nodes[id].end; e++) {
+            radius = fmaxf(radius, distanceBetween(boxCentre[id], entryPosition[e]));
+        }
+        boxRadius[id] = radius;
+    }
+    nodeIndexStale = 0;
+}
+
+// Pull on the node at index entry from the box id. A box that looks smaller
+// than openingAngle from the node pulls as one mass at its centre, one wholly
+// outside the gravity zone not at all. Any other box, and always one that
+// holds the node, is opened: its halves are tried in turn, and a leaf's nodes
+// pull one by one. So whatever is near the node (its parent and siblings,
+// as often as not) is summed node by node and only distant groups are lumped.
+void applyBox(Node* node, long entry, int id) {
+    const KdNode* box = &nodeIndex.nodes[id];
+    if (entry < box->begin || entry >= box->end) {
+        float distance = distanceBetween(boxCentre[id], node->point.x);
+        if (distance - boxRadius[id] >= GRAVITY_ZONE_RADIUS) return;
+        if (boxRadius[id] < openingAngle * distance) {
+            applyForces(node, boxCentre[id], (box->end - box->begin) * nodeMass);
+            return;
+        }
+    }
+    if (box->left < 0) {
+        for (long e = box->begin; e < box->end; e++) {
+            if (e != entry) applyForces(node, entryPosition[e], nodeMass);
+        }
+        return;
+    }
+    applyBox(node, entry, box->left);
+    applyBox(node, entry, box->right);
+}
 
-    // Apply forces with respect to all other nodes in the structure
-    #pragma omp parallel for
+void moveNode(Node* node) {
+    if (node->depth >= treeLevels) return;
     for (int i = 0; i < NUM_POINTS; i++) {
-        if (node->children[i] != NULL) {
-            applyForces(node, root);
-            updateVelocity(node->children[i]);
-            updateNode(node->children[i], root);
+        Node* child = childOf(node, i);
+        if (child->depth == blockDepth && i + 1 < NUM_POINTS) {
+            prefetchSubtree(childOf(node, i + 1));
         }
+        updateVelocity(child);
+        moveNode(child);
     }
 }
 
+static int compareEntries(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+// One step for every node but the root, which stays put. Forces are summed
+// from the positions as they were into the velocities. Nodes go block by
+// block in slot order, front to back through memory (or the file) with the
+// same static schedule that first touched them; within a block they go in
+// index order, so nodes close in space walk the same boxes one after another
+// while the writes stay on the block's pages. Each node is written only by
+// its own thread and nothing moves until every force is in, so the result
+// does not depend on the thread count. Then the root's subtrees move in
+// parallel.
+void updateTree(void) {
+    if (treeLevels == 0) return;
+    indexNodes();
+    long blocks = (indexedNodes + FORCE_BLOCK - 1) / FORCE_BLOCK;
+    #pragma omp parallel
+    {
+        long* entries = malloc(FORCE_BLOCK * sizeof(*entries));
+        if (entries == NULL) {
+            fprintf(stderr, "Cannot allocate a force block\n");
+            exit(1);
+        }
+        #pragma omp for schedule(static)
+        for (long block = 0; block < blocks; block++) {
+            long first = block * FORCE_BLOCK, count = 0;
+            for (long j = first > 0 ? first : 1; j < first + FORCE_BLOCK && j < indexedNodes; j++) {
+                entries[count++] = indexedEntry[j];
+            }
+            qsort(entries, count, sizeof(*entries), compareEntries);
+            for (long k = 0; k < count; k++) {
+                long e = entries[k];
+                applyBox(root + attachedSlot(nodeIndex.order[e]), e, 0);
+            }
+        }
+        free(entries);
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < NUM_POINTS; i++) {
+        Node* child = childOf(root, i);
+        updateVelocity(child);
+        moveNode(child);
+    }
+    nodeIndexStale = 1;
+}
+
+// Tree edges for the software renderer; big subtrees are tasks and each edge
+// goes to the slot of the node it leads to
+void collectEdges(Node* node, SoftLine* lines) {
+    if (node->depth >= MAX_DEPTH) return;
+
+    for (int i = 0; i < NUM_POINTS; i++) {
+        Node* child = childOf(node, i);
+        SoftLine* line = &lines[child - root - 1];
+        memcpy(line->a, node->point.x, sizeof(line->a));
+        memcpy(line->b, child->point.x, sizeof(line->b));
+        memset(line->color, 255, 3);
+
+        #pragma omp task firstprivate(child) if(subtreeSize[child->depth] >= TASK_MIN_SUBTREE)
+        collectEdges(child, lines);
+    }
+}
+
+// Headless counterpart of stepTree() + display(): same camera, frames go to files
+void renderFrames(void) {
+    SoftRenderer renderer;
+    softInit(&renderer, frameWidth, frameHeight);
+    softPerspective(&renderer, 60.0, (float)frameWidth / frameHeight, 1.0, 100.0);
+
+    createTree(0);
+    double startTime = omp_get_wtime();
+    for (int frame = 0; frame < numFrames; frame++) {
+        double stepStart = omp_get_wtime();
+        updateTree();
+        if (metricsEnabled) publishMetrics(omp_get_wtime() - stepStart);
+
+        float lookX = sin(cameraYaw) * cos(cameraPitch);
+        float lookY = sin(cameraPitch);
+        float lookZ = -cos(cameraYaw) * cos(cameraPitch);
+        softLookAt(&renderer, cameraX, cameraY, cameraZ,
+                   cameraX + lookX, cameraY + lookY, cameraZ + lookZ,
+                   0.0, 1.0, 0.0);
+
+        softBegin(&renderer, 0, 0, 0);
+        SoftLine* lines = softReserveLines(&renderer, numNodes - 1);
+        #pragma omp parallel
+        #pragma omp single
+        collectEdges(root, lines);
+        softRender(&renderer);
+
+        char path[4096];
+        snprintf(path, sizeof(path), framePattern, frame);
+        if (softWriteFrame(&renderer, path) != 0) exit(1);
+        if (metricsEnabled) publishMetrics(-1.0);
+    }
+    double elapsed = omp_get_wtime() - startTime;
+    printf("Rendered %d frames of %ld edges in %.2fs (%.2f frames/s)\n",
+           numFrames, numNodes - 1, elapsed, numFrames / elapsed);
+    softFree(&renderer);
+    releaseTree();
+}
+
+// Headless timing run for bin/scaling.py: seconds spent generating the tree,
+// stepping it and collecting its edges, one "phase" line each
+void runBench(int steps) {
+    double startTime = omp_get_wtime();
+    createTree(0);
+    double generate = omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    for (int step = 0; step < steps; step++) {
+        updateTree();
+    }
+    double update = omp_get_wtime() - startTime;
+
+    SoftLine* lines = (SoftLine*)memAlloc(memEdges, (numNodes - 1) * sizeof(SoftLine));
+    if (lines == NULL) {
+        fprintf(stderr, "Cannot allocate %ld edges\n", numNodes - 1);
+        exit(1);
+    }
+    startTime = omp_get_wtime();
+    #pragma omp parallel
+    #pragma omp single
+    collectEdges(root, lines);
+    double edges = omp_get_wtime() - startTime;
+    memFree(lines);
+    releaseTree();
+
+    printf("bench nodes %ld dimensions %d threads %d steps %d\n", numNodes, DIMENSIONS, omp_get_max_threads(), steps);
+    printf("phase generate %.9f\n", generate);
+    printf("phase update %.9f\n", update);
+    printf("phase edges %.9f\n", edges);
+}
+
+void applyQuality(int level) {
+    physicsInterval = qualityLevels[level][0];
+    drawStride = qualityLevels[level][1];
+    drawDepth = MAX_DEPTH - qualityLevels[level][2];
+    if (drawDepth < 1) drawDepth = 1;
+    openingAngle = fmaxf(requestedAngle, qualityLevels[level][3] / 100.0f);
+}
+
 void display(void) {
+    if (qualityFrame(&quality)) {
+        applyQuality(quality.level);
+    }
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glLoadIdentity();
 
@@ -159,8 +857,17 @@ void display(void) {
               0.0, 1.0, 0.0);
 
     drawNode(root);
+    if (selectedNode >= 0) {
+        Point* p = &root[selectedNode].point;
+        glPushMatrix();
+        glTranslatef(p->x[0], p->x[1], p->x[2]);
+        glColor3f(1.0, 1.0, 0.0);
+        glutWireSphere(0.1, 8, 8);
+        glPopMatrix();
+    }
 
     glutSwapBuffers();
+    if (metricsEnabled) publishMetrics(-1.0);
 }
 
 void reshape(int w, int h) {
@@ -173,13 +880,15 @@ void reshape(int w, int h) {
 
 void keyboardDown(unsigned char key, int x, int y) {
     keys[key] = 1;
+    if (key == 'p') pacerTogglePause();
 }
 
 void keyboardUp(unsigned char key, int x, int y) {
     keys[key] = 0;
 }
 
-void updateCameraPosition() {
+// Returns 1 when a movement key is held, so the pacer knows to redraw
+int updateCameraPosition(void) {
     float lookX = sin(cameraYaw) * cos(cameraPitch);
     float lookZ = -cos(cameraYaw) * cos(cameraPitch);
 
@@ -199,16 +908,161 @@ void updateCameraPosition() {
         cameraX -= lookZ * cameraSpeed;
         cameraZ += lookX * cameraSpeed;
     }
-    glutPostRedisplay();
+    return keys['w'] || keys['s'] || keys['a'] || keys['d'];
+}
+
+// Per-frame callback of the pacer: takes over newly generated levels and moves
+// the camera, returns 1 when either changed the picture
+int animateTree(void) {
+    int grew = attachReadyLevels();
+    int moved = updateCameraPosition();
+    return grew || moved;
+}
+
+// One simulation tick, called by the frame pacer
+void stepTree(void) {
+    static long tick = 0;
+    if (tick++ % physicsInterval == 0) {
+        double startTime = omp_get_wtime();
+        updateTree();
+        double stepSeconds = omp_get_wtime() - startTime;
+        qualityStep(&quality, stepSeconds, physicsInterval);
+        if (metricsEnabled) publishMetrics(stepSeconds);
+    }
 }
 
-void idle() {
-    updateCameraPosition();
-    updateNode(root, root);
-    glutPostRedisplay();
+// Front-most node under the pixel, using the matrices of the last frame
+void pickNode(int x, int y) {
+    if (treeLevels < MAX_DEPTH) {
+        printf("Still generating the tree (%d of %d levels)\n", treeLevels, MAX_DEPTH);
+        return;
+    }
+    GLdouble model[16], projection[16];
+    GLint viewport[4];
+    glGetDoublev(GL_MODELVIEW_MATRIX, model);
+    glGetDoublev(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    GLdouble nx, ny, nz, fx, fy, fz;
+    double winY = viewport[3] - y - 1;
+    gluUnProject(x, winY, 0.0, model, projection, viewport, &nx, &ny, &nz);
+    gluUnProject(x, winY, 1.0, model, projection, viewport, &fx, &fy, &fz);
+    float origin[3] = {(float)nx, (float)ny, (float)nz};
+    float dir[3] = {(float)(fx - nx), (float)(fy - ny), (float)(fz - nz)};
+    float length = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+    for (int k = 0; k < 3; k++) dir[k] /= length;
+
+    // Refit once per simulation step, and only when someone clicks
+    if (nodeIndexStale) indexNodes();
+    long point = kdPick(&nodeIndex, origin, dir, PICK_TAN_ANGLE);
+    selectedNode = point < 0 ? -1 : attachedSlot(point);
+    if (selectedNode < 0) {
+        printf("Nothing under the cursor\n");
+        return;
+    }
+
+    // Path of child indices from the root, recovered from the slot
+    char path[16 * (MAX_DEPTH + 1)] = "root";
+    int pathLength = 4;
+    Node* node = root;
+    while (node != &root[selectedNode]) {
+        long offset = &root[selectedNode] - node - 1;
+        int i = (int)(offset / subtreeSize[node->depth + 1]);
+        pathLength += snprintf(path + pathLength, sizeof(path) - pathLength, "/%d", i);
+        node = childOf(node, i);
+    }
+
+    char position[16 * DIMENSIONS], velocity[16 * DIMENSIONS];
+    int positionLength = 0, velocityLength = 0;
+    for (int k = 0; k < DIMENSIONS; k++) {
+        positionLength += snprintf(position + positionLength, sizeof(position) - positionLength,
+                                   "%s%.3f", k ? ", " : "", node->point.x[k]);
+        velocityLength += snprintf(velocity + velocityLength, sizeof(velocity) - velocityLength,
+                                   "%s%.4f", k ? ", " : "", node->point.v[k]);
+    }
+    printf("Node %ld (%s), depth %d at (%s), velocity (%s)\n", selectedNode, path, node->depth, position, velocity);
+}
+
+void mouse(int button, int state, int x, int y) {
+    if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
+        pickNode(x, y);
+        pacerRequestRedraw();
+    }
 }
 
 int main(int argc, char **argv) {
+    // Optional seed argument reproduces a previous tree exactly, --mmap keeps
+    // the tree in a file so it can be larger than physical memory, --render
+    // writes frames (printf pattern, e.g. frames/%05d.png) without a display,
+    // --pin and --hugepages thp|explicit place threads and memory on big machines,
+    // --budget ms sets the frame time the viewer degrades to hold (0 = never),
+    // --fps, --ticks (steps per frame) and --vsync 0|1 pace the window,
+    // --metrics port|socket-path serves Prometheus metrics while running,
+    // --bench steps times generation, steps and edges without a window (see bin/scaling.py),
+    // --memory size (512M, 8G) is the most the run may allocate; over it, the run degrades or refuses,
+    // --theta angle is the Barnes-Hut opening angle: smaller is more accurate and slower
+    seed = (uint64_t)time(NULL);
+    const char* metricsAddress = NULL;
+    double budget = QUALITY_DEFAULT_BUDGET_MS;
+    double fps = PACING_DEFAULT_FPS;
+    int ticksPerFrame = 1, vsync = 1;
+    int benchSteps = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--pin") == 0) {
+            pinning = 1;
+        } else if (strcmp(argv[i], "--hugepages") == 0 && i + 1 < argc) {
+            hugePageMode = parseHugePages(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0 && i + 1 < argc) {
+            treeFile = argv[++i];
+        } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            framePattern = argv[++i];
+            softCheckPattern(framePattern);
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            numFrames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            softParseSize(argv[++i], &frameWidth, &frameHeight);
+        } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            budget = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            fps = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+            ticksPerFrame = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--vsync") == 0 && i + 1 < argc) {
+            vsync = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metricsAddress = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            benchSteps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+            memBudget = memParseSize(argv[++i]);
+        } else if (strcmp(argv[i], "--theta") == 0 && i + 1 < argc) {
+            openingAngle = requestedAngle = atof(argv[++i]);
+        } else if (isdigit((unsigned char)argv[i][0])) {
+            seed = strtoull(argv[i], NULL, 10);
+        }
+    }
+
+    if (planMemory(benchSteps > 0) != 0) return 1;
+    atexit(memReportAtExit);
+    if (pinning) {
+        pinThreads();
+    }
+    if (metricsAddress != NULL) {
+        registerMetrics();
+        if (metricsServe(metricsAddress) != 0) return 1;
+    }
+
+    if (benchSteps > 0) {
+        runBench(benchSteps);
+        return 0;
+    }
+    if (framePattern != NULL) {
+        renderFrames();
+        return 0;
+    }
+    qualityInit(&quality, budget, NUM_QUALITY_LEVELS - 1);
+    pacerInit(fps, ticksPerFrame, stepTree, animateTree, &quality);
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(800, 600);
@@ -220,7 +1074,8 @@ int main(int argc, char **argv) {
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboardDown);
     glutKeyboardUpFunc(keyboardUp);
-    glutIdleFunc(idle);
+    glutMouseFunc(mouse);
+    pacerStart(vsync);
     glutMainLoop();
     return 0;
 }
@@ -0,0 +1,156 @@
+// Memory accounting per subsystem.
+// Every big allocation carries a tag ("tree", "systems", "mesh", ...) and
+// each tag keeps its live and peak bytes, so a run that runs out of memory
+// says which part of it grew. memAlloc, memRealloc and memFree are malloc,
+// realloc and free with a tag (NULL still means out of memory); bigAlloc
+// counts its mappings the same way. Before a run the program adds up what
+// each tag will need with memEstimate and compares the sum with memBudget
+// (--memory), so it can degrade or refuse before allocating anything.
+// bigAlloc counts reserved address space, which only becomes resident as it
+// is touched, so live bytes are an upper bound on resident memory.
+// Tags are registered from the main thread; accounting is thread safe.
+
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEM_MAX_TAGS 24
+#define MEM_HEADER_BYTES 16 // Size and tag in front of every memAlloc block, keeps malloc's alignment
+
+typedef struct {
+    char name[24];
+    long live, peak;
+    long estimate; // Bytes this tag is expected to need, from memEstimate
+} MemTag;
+
+static MemTag memTags[MEM_MAX_TAGS + 1] = {[MEM_MAX_TAGS] = {"other"}};
+static int numMemTags = 0;
+static long memLive = 0, memPeak = 0;
+static long memBudget = 0; // Bytes, 0 = no limit
+
+// Slot of a tag, registered on first use. Past MEM_MAX_TAGS everything lands in "other".
+static inline int memTag(const char* name) {
+    for (int t = 0; t < numMemTags; t++) {
+        if (strcmp(memTags[t].name, name) == 0) return t;
+    }
+    if (numMemTags == MEM_MAX_TAGS) return MEM_MAX_TAGS;
+    snprintf(memTags[numMemTags].name, sizeof(memTags[numMemTags].name), "%s", name);
+    return numMemTags++;
+}
+
+static inline void memRaise(long* peak, long value) {
+    long seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(peak, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Records bytes allocated (positive) or released (negative) under a tag
+static inline void memAccount(int tag, long bytes) {
+    long live = __atomic_add_fetch(&memTags[tag].live, bytes, __ATOMIC_RELAXED);
+    long total = __atomic_add_fetch(&memLive, bytes, __ATOMIC_RELAXED);
+    if (bytes > 0) {
+        memRaise(&memTags[tag].peak, live);
+        memRaise(&memPeak, total);
+    }
+}
+
+static inline void* memAlloc(int tag, size_t bytes) {
+    char* block = (char*)malloc(bytes + MEM_HEADER_BYTES);
+    if (block == NULL) return NULL;
+    ((size_t*)block)[0] = bytes;
+    ((size_t*)block)[1] = (size_t)tag;
+    memAccount(tag, (long)bytes);
+    return block + MEM_HEADER_BYTES;
+}
+
+static inline void* memCalloc(int tag, size_t count, size_t size) {
+    void* p = memAlloc(tag, count * size);
+    if (p != NULL) memset(p, 0, count * size);
+    return p;
+}
+
+static inline void memFree(void* p) {
+    if (p == NULL) return;
+    char* block = (char*)p - MEM_HEADER_BYTES;
+    memAccount((int)((size_t*)block)[1], -(long)((size_t*)block)[0]);
+    free(block);
+}
+
+// Like realloc: on failure the old block stays valid and NULL comes back
+static inline void* memRealloc(int tag, void* p, size_t bytes) {
+    if (p == NULL) return memAlloc(tag, bytes);
+    char* block = (char*)p - MEM_HEADER_BYTES;
+    size_t old = ((size_t*)block)[0];
+    block = (char*)realloc(block, bytes + MEM_HEADER_BYTES);
+    if (block == NULL) return NULL;
+    ((size_t*)block)[0] = bytes;
+    memAccount((int)((size_t*)block)[1], (long)bytes - (long)old);
+    return block + MEM_HEADER_BYTES;
+}
+
+static inline void memEstimate(int tag, long bytes) {
+    memTags[tag].estimate += bytes;
+}
+
+static inline void memClearEstimates(void) {
+    for (int t = 0; t <= MEM_MAX_TAGS; t++) memTags[t].estimate = 0;
+}
+
+static inline long memEstimateTotal(void) {
+    long total = 0;
+    for (int t = 0; t <= MEM_MAX_TAGS; t++) total += memTags[t].estimate;
+    return total;
+}
+
+// "512M", "8G", "1.5GB" or a plain number of megabytes; returns bytes. 0 is
+// no limit, so anything that is not a size exits rather than read as 0.
+static inline long memParseSize(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    double unit = 1 << 20;
+    if (*end != '\0' && strchr("kKmMgGtT", *end) != NULL) {
+        if (*end == 'k' || *end == 'K') unit = 1 << 10;
+        if (*end == 'g' || *end == 'G') unit = 1 << 30;
+        if (*end == 't' || *end == 'T') unit = (double)(1L << 40);
+        end++;
+        if (*end == 'B') end++;
+    }
+    if (end == text || *end != '\0' || !(value >= 0.0) || value * unit > 9e18) {
+        fprintf(stderr, "Bad memory size \"%s\", expected a number of megabytes or e.g. 512M, 8G\n", text);
+        exit(1);
+    }
+    return (long)(value * unit);
+}
+
+static inline void memPrintEstimate(FILE* out) {
+    fprintf(out, "Memory estimate %.1f MB", memEstimateTotal() / 1048576.0);
+    for (int t = 0; t <= MEM_MAX_TAGS; t++) {
+        if (memTags[t].estimate > 0) fprintf(out, ", %s %.1f", memTags[t].name, memTags[t].estimate / 1048576.0);
+    }
+    if (memBudget > 0) fprintf(out, " (budget %.1f MB)", memBudget / 1048576.0);
+    fprintf(out, "\n");
+}
+
+// Live, peak and estimated megabytes per tag
+static inline void memReport(FILE* out) {
+    fprintf(out, "%-12s %10s %10s %10s\n", "memory (MB)", "live", "peak", "estimate");
+    for (int t = 0; t <= MEM_MAX_TAGS; t++) {
+        MemTag* tag = &memTags[t];
+        if (tag->peak == 0 && tag->estimate == 0) continue;
+        fprintf(out, "%-12s %10.1f %10.1f %10.1f\n", tag->name,
+                tag->live / 1048576.0, tag->peak / 1048576.0, tag->estimate / 1048576.0);
+    }
+    fprintf(out, "%-12s %10.1f %10.1f %10.1f\n", "total", memLive / 1048576.0, memPeak / 1048576.0,
+            memEstimateTotal() / 1048576.0);
+}
+
+// For atexit
+static inline void memReportAtExit(void) {
+    fflush(stdout);
+    memReport(stderr);
+}
+
+#endif
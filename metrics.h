@@ -0,0 +1,192 @@
+// Prometheus text endpoint for live runs.
+// The simulation thread registers its series once, then each step sets
+// values and publishes them. The server thread answers every HTTP request
+// with the last published snapshot. The snapshot is guarded by a seqlock:
+// the writer never waits, and a reader that overlaps a publish just copies
+// again. A slow scrape can never stall a step.
+// metricsServe takes a port on 127.0.0.1, or a path for a Unix socket
+// (curl --unix-socket path http://x/metrics).
+// Including files must define _GNU_SOURCE before any system header.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_MAX_SERIES 64
+
+typedef struct {
+    char name[96];  // Series name with labels, e.g. phase_seconds{phase="gravity"}
+    char help[96];
+    const char* type; // "gauge" or "counter"
+} MetricSeries;
+
+static MetricSeries metricSeries[METRICS_MAX_SERIES];
+static int numMetricSeries = 0;
+static double metricValues[METRICS_MAX_SERIES]; // Written by the simulation thread only
+static double metricSnapshot[METRICS_MAX_SERIES];
+static uint64_t metricSequence = 0; // Odd while a publish is in progress
+static int metricsEnabled = 0;
+
+// Before metricsServe only; returns the slot for metricsSet
+static inline int metricsRegister(const char* name, const char* type, const char* help) {
+    if (numMetricSeries == METRICS_MAX_SERIES) {
+        fprintf(stderr, "Too many metric series\n");
+        exit(1);
+    }
+    MetricSeries* series = &metricSeries[numMetricSeries];
+    snprintf(series->name, sizeof(series->name), "%s", name);
+    snprintf(series->help, sizeof(series->help), "%s", help);
+    series->type = type;
+    return numMetricSeries++;
+}
+
+static inline void metricsSet(int slot, double value) {
+    metricValues[slot] = value;
+}
+
+static inline void metricsAdd(int slot, double value) {
+    metricValues[slot] += value;
+}
+
+static inline void metricsPublish(void) {
+    if (!metricsEnabled) return;
+    uint64_t sequence = metricSequence + 1;
+    __atomic_store_n(&metricSequence, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i = 0; i < numMetricSeries; i++) {
+        __atomic_store(&metricSnapshot[i], &metricValues[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&metricSequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+static inline void metricsRead(double* values) {
+    for (;;) {
+        uint64_t before = __atomic_load_n(&metricSequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        for (int i = 0; i < numMetricSeries; i++) {
+            __atomic_load(&metricSnapshot[i], &values[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&metricSequence, __ATOMIC_RELAXED) == before) return;
+    }
+}
+
+static inline long metricsResidentBytes(void) {
+    long pages = 0, resident = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(file);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// HELP and TYPE once per metric family, i.e. per name before any labels
+static inline int metricsFormat(char* out, int capacity) {
+    double values[METRICS_MAX_SERIES];
+    metricsRead(values);
+    int length = 0;
+    const char* family = "";
+    int familyLength = 0;
+    for (int i = 0; i < numMetricSeries && length < capacity; i++) {
+        const char* name = metricSeries[i].name;
+        int nameLength = (int)strcspn(name, "{");
+        if (nameLength != familyLength || strncmp(name, family, nameLength) != 0) {
+            length += snprintf(out + length, capacity - length, "# HELP %.*s %s\n# TYPE %.*s %s\n",
+                               nameLength, name, metricSeries[i].help, nameLength, name, metricSeries[i].type);
+            family = name;
+            familyLength = nameLength;
+        }
+        if (length < capacity) length += snprintf(out + length, capacity - length, "%s %.10g\n", name, values[i]);
+    }
+    if (length < capacity) {
+        length += snprintf(out + length, capacity - length,
+                           "# HELP process_resident_memory_bytes Resident memory\n"
+                           "# TYPE process_resident_memory_bytes gauge\n"
+                           "process_resident_memory_bytes %ld\n", metricsResidentBytes());
+    }
+    return length < capacity ? length : capacity;
+}
+
+static void* metricsServer(void* arg) {
+    int listener = (int)(intptr_t)arg;
+    static char body[65536];
+    char header[256], request[4096];
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) continue;
+        // The request itself does not matter, every path gets the metrics
+        if (read(client, request, sizeof(request)) >= 0) {
+            int length = metricsFormat(body, sizeof(body));
+            int headerLength = snprintf(header, sizeof(header),
+                                        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                        "Content-Length: %d\r\nConnection: close\r\n\r\n", length);
+            if (write(client, header, headerLength) == headerLength) {
+                if (write(client, body, length) < 0) perror("metrics");
+            }
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+// Starts the endpoint on a background thread; returns 0 on success
+static inline int metricsServe(const char* address) {
+    int listener;
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        snprintf(local.sun_path, sizeof(local.sun_path), "%s", address);
+        unlink(address);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, (struct sockaddr*)&local, sizeof(local)) != 0) {
+            perror(address);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_port = htons((uint16_t)atoi(address));
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        if (listener >= 0) setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (listener < 0 || bind(listener, (struct sockaddr*)&local, sizeof(local)) != 0) {
+            perror("metrics port");
+            return -1;
+        }
+    }
+    if (listen(listener, 16) != 0) {
+        perror("listen");
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metricsServer, (void*)(intptr_t)listener) != 0) {
+        fprintf(stderr, "Cannot start the metrics thread\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    metricsEnabled = 1;
+    metricsPublish();
+    printf("Metrics at %s%s\n", strchr(address, '/') != NULL ? "unix:" : "http://127.0.0.1:", address);
+    return 0;
+}
+
+#endif
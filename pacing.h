@@ -0,0 +1,106 @@
+// Frame pacing for the GLUT viewers.
+// A GLUT timer fires at the target rate instead of an idle callback that
+// spins. Each tick advances the simulation a fixed number of steps (unless
+// paused), lets the camera move, and posts a redisplay only when one of them
+// changed something and the window is visible. With vsync on, swaps also
+// wait for the display's refresh.
+
+#ifndef PACING_H
+#define PACING_H
+
+#include <GL/glut.h>
+#include <omp.h>
+#include <stdio.h>
+#include "quality.h"
+
+#define PACING_DEFAULT_FPS 60.0
+
+// From GL/glx.h, declared here because Xlib's headers define macros (Complex,
+// Status, ...) that collide with names in the programs
+typedef void (*GLXextFuncPtr)(void);
+extern GLXextFuncPtr glXGetProcAddressARB(const GLubyte* name);
+
+typedef struct {
+    double interval;       // Seconds between ticks, 0 runs as fast as possible
+    int ticksPerFrame;     // Simulation steps per tick
+    int paused, visible, dirty;
+    double nextTick;
+    void (*step)(void);    // Advances the simulation by one step
+    int (*animate)(void);  // Moves the camera; returns 1 if the view changed
+    QualityController* quality;
+} FramePacer;
+
+static FramePacer pacer;
+
+static inline void pacerInit(double fps, int ticksPerFrame, void (*step)(void), int (*animate)(void),
+                             QualityController* quality) {
+    pacer.interval = fps > 0.0 ? 1.0 / fps : 0.0;
+    pacer.ticksPerFrame = ticksPerFrame > 0 ? ticksPerFrame : 1;
+    pacer.paused = 0;
+    pacer.visible = 1;
+    pacer.dirty = 1;
+    pacer.nextTick = 0.0;
+    pacer.step = step;
+    pacer.animate = animate;
+    pacer.quality = quality;
+}
+
+// Something outside the simulation changed the picture (input, selection)
+static inline void pacerRequestRedraw(void) {
+    pacer.dirty = 1;
+}
+
+static inline void pacerTogglePause(void) {
+    pacer.paused = !pacer.paused;
+    printf(pacer.paused ? "Paused\n" : "Running\n");
+}
+
+static inline void pacerTick(int value) {
+    (void)value;
+    int changed = pacer.dirty;
+    pacer.dirty = 0;
+    if (!pacer.paused && pacer.step != NULL) {
+        for (int i = 0; i < pacer.ticksPerFrame; i++) pacer.step();
+        changed = 1;
+    }
+    if (pacer.animate != NULL && pacer.animate()) changed = 1;
+
+    if (changed && pacer.visible) {
+        glutPostRedisplay();
+    } else if (pacer.quality != NULL) {
+        pacer.quality->lastFrame = 0.0; // A skipped frame is not a slow frame
+    }
+
+    // Keep a steady cadence; after falling behind, start again from now
+    double now = omp_get_wtime();
+    pacer.nextTick += pacer.interval;
+    if (pacer.nextTick < now) pacer.nextTick = now;
+    glutTimerFunc((unsigned int)((pacer.nextTick - now) * 1000.0), pacerTick, 0);
+}
+
+static inline void pacerVisibility(int state) {
+    pacer.visible = state == GLUT_VISIBLE;
+    if (pacer.visible) pacer.dirty = 1;
+}
+
+// Swap interval through whichever GLX extension the driver offers
+static inline void pacerSetVsync(int on) {
+    typedef int (*SwapIntervalFunc)(int);
+    SwapIntervalFunc swapInterval = (SwapIntervalFunc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalMESA");
+    if (swapInterval == NULL) {
+        swapInterval = (SwapIntervalFunc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalSGI");
+    }
+    if (swapInterval == NULL || swapInterval(on ? 1 : 0) != 0) {
+        fprintf(stderr, "Cannot change vsync on this driver\n");
+    }
+}
+
+// Call once the window exists, instead of glutIdleFunc
+static inline void pacerStart(int vsync) {
+    pacerSetVsync(vsync);
+    glutVisibilityFunc(pacerVisibility);
+    pacer.nextTick = omp_get_wtime();
+    glutTimerFunc(0, pacerTick, 0);
+}
+
+#endif
@@ -0,0 +1,79 @@
+// Frame-time budget for the GLUT viewers.
+// The viewer reports how long each simulation step took and calls
+// qualityFrame once per displayed frame. The controller keeps running
+// averages and moves a quality level up or down, with hysteresis. What is
+// held to the budget is the larger of the average frame and the stepping a
+// frame has to carry, the step time over the frames per step, so stepping
+// less often is a way down just like a cheaper step. Level 0 is full
+// quality. Each program decides what the higher levels give up (drawing
+// fewer things, coarser detail, cheaper or less frequent steps).
+
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include <omp.h>
+#include <stdio.h>
+
+#define QUALITY_DEFAULT_BUDGET_MS 33.0 // About 30 frames per second
+#define QUALITY_SMOOTHING 0.1          // Weight of the newest frame in the running averages
+#define QUALITY_SETTLE_FRAMES 10       // Frames measured after a change before judging again
+#define QUALITY_RECOVER_FRAMES 60      // Frames in a row well under budget before quality goes back up
+#define QUALITY_RECOVER_FRACTION 0.5   // "Well under": this fraction of the budget
+
+typedef struct {
+    double budget;             // Seconds per frame, 0 turns the controller off
+    int level, maxLevel;
+    double lastFrame;          // When the previous frame started, 0 before the first
+    double frameTime, stepTime;
+    int framesPerStep;         // The caller's physics interval at the last step
+    int samples, calm;
+} QualityController;
+
+static inline void qualityInit(QualityController* q, double budgetMs, int maxLevel) {
+    q->budget = budgetMs / 1000.0;
+    q->level = 0;
+    q->maxLevel = maxLevel;
+    q->lastFrame = 0.0;
+    q->frameTime = q->stepTime = 0.0;
+    q->framesPerStep = 1;
+    q->samples = q->calm = 0;
+}
+
+static inline void qualityStep(QualityController* q, double seconds, int framesPerStep) {
+    q->framesPerStep = framesPerStep > 0 ? framesPerStep : 1;
+    q->stepTime = q->stepTime == 0.0 ? seconds : q->stepTime + QUALITY_SMOOTHING * (seconds - q->stepTime);
+}
+
+// Measures the time since the previous frame and returns 1 when the level changed
+static inline int qualityFrame(QualityController* q) {
+    double now = omp_get_wtime();
+    double period = now - q->lastFrame;
+    int first = q->lastFrame == 0.0;
+    q->lastFrame = now;
+    if (q->budget <= 0.0 || first) return 0;
+
+    q->frameTime = q->samples == 0 ? period : q->frameTime + QUALITY_SMOOTHING * (period - q->frameTime);
+    if (++q->samples < QUALITY_SETTLE_FRAMES) return 0;
+
+    double stepping = q->stepTime / q->framesPerStep;
+    double cost = q->frameTime > stepping ? q->frameTime : stepping;
+    int level = q->level;
+    if (cost > q->budget && level < q->maxLevel) {
+        level++;
+    } else if (cost < q->budget * QUALITY_RECOVER_FRACTION && level > 0) {
+        if (++q->calm >= QUALITY_RECOVER_FRAMES) level--;
+    } else {
+        q->calm = 0;
+    }
+    if (level == q->level) return 0;
+
+    printf("Quality level %d/%d: %.1f ms per frame (%.1f ms steps every %d frames), budget %.1f ms\n",
+           level, q->maxLevel, q->frameTime * 1000.0, q->stepTime * 1000.0, q->framesPerStep, q->budget * 1000.0);
+    q->level = level;
+    q->samples = q->calm = 0;
+    q->stepTime = 0.0; // The new level may step faster, start the average over
+    q->lastFrame = 0.0; // The caller's switch-over cost lands in the next period, skip it
+    return 1;
+}
+
+#endif
@@ -0,0 +1,67 @@
+// Reproducible parallel sums.
+// A plain OpenMP reduction adds in an order that depends on the thread
+// count, so the low bits of a sum (and anything fed back from it) change with
+// OMP_NUM_THREADS. Here the caller writes one double per element, in
+// parallel. The terms are then cut into fixed blocks of REDUCE_BLOCK, each
+// block is added in index order, and the block sums are combined by a
+// pairwise tree of fixed shape. Neither the blocks nor the tree depend on the
+// threads, so the result is bit-identical on any number of cores. Pairwise
+// summation also keeps the rounding error at O(log n) instead of O(n).
+
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "memtrack.h"
+
+#define REDUCE_BLOCK 1024
+
+// Sums values[0..count) pairwise in place (values is overwritten)
+static inline double reducePairwise(double* values, long count) {
+    if (count == 0) return 0.0;
+    for (long width = 1; width < count; width *= 2) {
+        #pragma omp parallel for schedule(static) if(count / (2 * width) >= REDUCE_BLOCK)
+        for (long i = 0; i < count - width; i += 2 * width) {
+            values[i] += values[i + width];
+        }
+    }
+    return values[0];
+}
+
+static inline long reduceBlocks(long n) {
+    return (n + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+}
+
+// Sums terms[0..n). The block sums go after the terms, so the buffer needs
+// room for n + reduceBlocks(n) doubles (reduceTerms allocates that).
+static inline double reduceSum(double* terms, long n) {
+    long blocks = reduceBlocks(n);
+    double* sums = terms + n;
+    #pragma omp parallel for schedule(static)
+    for (long b = 0; b < blocks; b++) {
+        long end = (b + 1) * REDUCE_BLOCK < n ? (b + 1) * REDUCE_BLOCK : n;
+        double sum = 0.0;
+        for (long i = b * REDUCE_BLOCK; i < end; i++) sum += terms[i];
+        sums[b] = sum;
+    }
+    return reducePairwise(sums, blocks);
+}
+
+// Buffer for n terms and their block sums, grown as needed and kept between calls
+static inline double* reduceTerms(double** buffer, long* capacity, long n) {
+    long needed = n + reduceBlocks(n) + 1;
+    if (needed > *capacity) {
+        memFree(*buffer);
+        *buffer = (double*)memAlloc(memTag("reduce"), needed * sizeof(double));
+        if (*buffer == NULL) {
+            fprintf(stderr, "Cannot allocate %ld reduction terms\n", n);
+            exit(1);
+        }
+        *capacity = needed;
+    }
+    return *buffer;
+}
+
+#endif
@@ -0,0 +1,30 @@
+// Counter-based random numbers.
+// A draw is a pure function of (stream, item, draw): the item and the draw
+// number are hashed together, mixed into the stream (usually the seed) and
+// hashed again. Nothing is carried from one draw to the next, so a value does
+// not depend on which thread asks for it or in what order, and any one of
+// them can be recomputed on its own. The programs pick the item so that it
+// follows what the number belongs to (a tree slot, a system id, a walker).
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// SplitMix64's finaliser: every input bit reaches every output bit
+static inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rngBits(uint64_t stream, uint64_t item, uint64_t draw) {
+    return mix64(stream ^ mix64(item * 0x9e3779b97f4a7c15ULL + draw));
+}
+
+// 24 random bits in [0, 1)
+static inline float rngUniform(uint64_t stream, uint64_t item, uint64_t draw) {
+    return (float)(rngBits(stream, item, draw) >> 40) / 16777216.0f;
+}
+
+#endif
@@ -0,0 +1,538 @@
+// Software renderer for machines without a GPU or display.
+// Lines and point sprites go through the same matrices gluLookAt and
+// gluPerspective build, are binned into screen tiles, and each tile is
+// rasterised by one OpenMP thread against its own part of the depth buffer.
+// Frames are written as binary PPM, or PNG when the path ends in ".png".
+
+#ifndef SOFTRENDER_H
+#define SOFTRENDER_H
+
+#include <omp.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "memtrack.h"
+
+#define SOFT_TILE_SIZE 64
+#define SOFT_MAX_SPRITE_RADIUS 64.0f // Pixels, keeps sprites close to the camera cheap
+#define SOFT_MAX_SIZE 16384 // Pixels on a side, about 1.8 GB of frame and depth buffer
+
+enum { SOFT_LINE, SOFT_DISC, SOFT_SQUARE };
+
+typedef struct {
+    float a[3], b[3];
+    unsigned char color[3];
+} SoftLine;
+
+typedef struct {
+    float p[3];
+    float radius; // World units, like glutSolidSphere's radius
+    unsigned char color[3];
+    unsigned char shape; // SOFT_DISC or SOFT_SQUARE
+} SoftSprite;
+
+// A primitive after projection: pixel coordinates and depth in [0, 1]
+typedef struct {
+    float x0, y0, z0, x1, y1, z1;
+    float radius;
+    int tiles[4]; // First and last tile column and row it touches, tiles[0] < 0 if culled
+    unsigned char color[3];
+    unsigned char kind;
+} SoftPrimitive;
+
+typedef struct {
+    int width, height;
+    int tilesX, tilesY;
+    float view[4][4], projection[4][4], transform[4][4];
+    float pixelsPerUnit; // Projection scale in pixels at unit distance, for sprite sizes
+    unsigned char background[3];
+    unsigned char* color; // RGB rows, top row first
+    float* depth;
+
+    SoftLine* lines;
+    long numLines, lineCapacity;
+    SoftSprite* sprites;
+    long numSprites, spriteCapacity;
+
+    SoftPrimitive* primitives;
+    long primitiveCapacity;
+    long* binned; // Primitive indices grouped by tile
+    long binnedCapacity;
+    long* tileStart; // numTiles + 1 offsets into binned
+    long* threadCounts; // Per-thread, per-tile counts used while binning
+    int threadCountsThreads;
+} SoftRenderer;
+
+static inline void* softGrow(void* buffer, long* capacity, long needed, size_t size) {
+    if (needed <= *capacity) return buffer;
+    long newCapacity = *capacity > 0 ? *capacity : 1024;
+    while (newCapacity < needed) newCapacity *= 2;
+    buffer = memRealloc(memTag("render"), buffer, newCapacity * size);
+    if (buffer == NULL) {
+        fprintf(stderr, "Software renderer out of memory (%ld items)\n", needed);
+        exit(1);
+    }
+    *capacity = newCapacity;
+    return buffer;
+}
+
+// Upper bound on what a renderer drawing this many lines and sprites per frame
+// holds: the growable buffers double, and binning assumes one tile per primitive
+static inline long softEstimateBytes(int width, int height, long lines, long sprites) {
+    long perPrimitive = sizeof(SoftPrimitive) + sizeof(long);
+    long tiles = (long)((width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE) * ((height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE);
+    long png = ((long)width * 3 + 1) * height; // Raw rows, and a stored deflate copy of them, while a frame is written
+    png += 2 + png + (png + 65534) / 65535 * 5 + 4;
+    return (long)width * height * (3 + sizeof(float)) + (tiles + 1) * (1 + omp_get_max_threads()) * (long)sizeof(long) +
+           png + 2 * (lines * (long)(sizeof(SoftLine) + perPrimitive) + sprites * (long)(sizeof(SoftSprite) + perPrimitive));
+}
+
+static inline void softInit(SoftRenderer* r, int width, int height) {
+    memset(r, 0, sizeof(*r));
+    r->width = width;
+    r->height = height;
+    r->tilesX = (width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    r->tilesY = (height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    int tag = memTag("render");
+    r->color = (unsigned char*)memAlloc(tag, (size_t)width * height * 3);
+    r->depth = (float*)memAlloc(tag, (size_t)width * height * sizeof(float));
+    r->tileStart = (long*)memAlloc(tag, (r->tilesX * r->tilesY + 1) * sizeof(long));
+    if (r->color == NULL || r->depth == NULL || r->tileStart == NULL) {
+        fprintf(stderr, "Cannot allocate a %dx%d frame\n", width, height);
+        exit(1);
+    }
+}
+
+static inline void softFree(SoftRenderer* r) {
+    memFree(r->color);
+    memFree(r->depth);
+    memFree(r->lines);
+    memFree(r->sprites);
+    memFree(r->primitives);
+    memFree(r->binned);
+    memFree(r->tileStart);
+    memFree(r->threadCounts);
+}
+
+static inline void softMultiply(float out[4][4], float a[4][4], float b[4][4]) {
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++) {
+            out[i][j] = 0.0f;
+            for (int k = 0; k < 4; k++) out[i][j] += a[i][k] * b[k][j];
+        }
+}
+
+// Same matrix as gluLookAt
+static inline void softLookAt(SoftRenderer* r, float eyeX, float eyeY, float eyeZ,
+                              float centerX, float centerY, float centerZ,
+                              float upX, float upY, float upZ) {
+    float f[3] = {centerX - eyeX, centerY - eyeY, centerZ - eyeZ};
+    float length = sqrtf(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    for (int i = 0; i < 3; i++) f[i] /= length;
+
+    float s[3] = {f[1] * upZ - f[2] * upY, f[2] * upX - f[0] * upZ, f[0] * upY - f[1] * upX};
+    length = sqrtf(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+    for (int i = 0; i < 3; i++) s[i] /= length;
+
+    float u[3] = {s[1] * f[2] - s[2] * f[1], s[2] * f[0] - s[0] * f[2], s[0] * f[1] - s[1] * f[0]};
+    float eye[3] = {eyeX, eyeY, eyeZ};
+
+    memset(r->view, 0, sizeof(r->view));
+    for (int i = 0; i < 3; i++) {
+        r->view[0][i] = s[i];
+        r->view[1][i] = u[i];
+        r->view[2][i] = -f[i];
+    }
+    for (int i = 0; i < 3; i++) {
+        r->view[i][3] = -(r->view[i][0] * eye[0] + r->view[i][1] * eye[1] + r->view[i][2] * eye[2]);
+    }
+    r->view[3][3] = 1.0f;
+    softMultiply(r->transform, r->projection, r->view);
+}
+
+// Same matrix as gluPerspective
+static inline void softPerspective(SoftRenderer* r, float fovy, float aspect, float zNear, float zFar) {
+    float f = 1.0f / tanf(fovy * (float)M_PI / 360.0f);
+    memset(r->projection, 0, sizeof(r->projection));
+    r->projection[0][0] = f / aspect;
+    r->projection[1][1] = f;
+    r->projection[2][2] = (zFar + zNear) / (zNear - zFar);
+    r->projection[2][3] = 2.0f * zFar * zNear / (zNear - zFar);
+    r->projection[3][2] = -1.0f;
+    r->pixelsPerUnit = f * r->height * 0.5f;
+    softMultiply(r->transform, r->projection, r->view);
+}
+
+// Starts a frame: drops the previous frame's primitives
+static inline void softBegin(SoftRenderer* r, unsigned char red, unsigned char green, unsigned char blue) {
+    r->background[0] = red;
+    r->background[1] = green;
+    r->background[2] = blue;
+    r->numLines = 0;
+    r->numSprites = 0;
+}
+
+// Room for count lines that callers fill in themselves, possibly in parallel
+static inline SoftLine* softReserveLines(SoftRenderer* r, long count) {
+    r->lines = (SoftLine*)softGrow(r->lines, &r->lineCapacity, r->numLines + count, sizeof(SoftLine));
+    SoftLine* reserved = r->lines + r->numLines;
+    r->numLines += count;
+    return reserved;
+}
+
+static inline SoftSprite* softReserveSprites(SoftRenderer* r, long count) {
+    r->sprites = (SoftSprite*)softGrow(r->sprites, &r->spriteCapacity, r->numSprites + count, sizeof(SoftSprite));
+    SoftSprite* reserved = r->sprites + r->numSprites;
+    r->numSprites += count;
+    return reserved;
+}
+
+static inline void softTransform(const SoftRenderer* r, const float p[3], float clip[4]) {
+    for (int i = 0; i < 4; i++) {
+        clip[i] = r->transform[i][0] * p[0] + r->transform[i][1] * p[1] + r->transform[i][2] * p[2] + r->transform[i][3];
+    }
+}
+
+static inline void softToScreen(const SoftRenderer* r, const float clip[4], float* x, float* y, float* z) {
+    *x = (clip[0] / clip[3] * 0.5f + 0.5f) * r->width;
+    *y = (0.5f - clip[1] / clip[3] * 0.5f) * r->height;
+    *z = clip[2] / clip[3] * 0.5f + 0.5f;
+}
+
+static inline void softSetTiles(const SoftRenderer* r, SoftPrimitive* p, float minX, float minY, float maxX, float maxY) {
+    if (maxX < 0.0f || maxY < 0.0f || minX >= r->width || minY >= r->height) {
+        p->tiles[0] = -1;
+        return;
+    }
+    p->tiles[0] = minX < 0.0f ? 0 : (int)minX / SOFT_TILE_SIZE;
+    p->tiles[1] = maxX >= r->width ? r->tilesX - 1 : (int)maxX / SOFT_TILE_SIZE;
+    p->tiles[2] = minY < 0.0f ? 0 : (int)minY / SOFT_TILE_SIZE;
+    p->tiles[3] = maxY >= r->height ? r->tilesY - 1 : (int)maxY / SOFT_TILE_SIZE;
+}
+
+static inline void softProjectLine(const SoftRenderer* r, const SoftLine* line, SoftPrimitive* p) {
+    float a[4], b[4];
+    softTransform(r, line->a, a);
+    softTransform(r, line->b, b);
+
+    // Clip against the near plane (z >= -w in clip space)
+    float da = a[2] + a[3], db = b[2] + b[3];
+    if (da < 0.0f && db < 0.0f) {
+        p->tiles[0] = -1;
+        return;
+    }
+    if (da < 0.0f || db < 0.0f) {
+        float t = da / (da - db);
+        float* moved = da < 0.0f ? a : b;
+        for (int i = 0; i < 4; i++) moved[i] = a[i] + t * (b[i] - a[i]);
+    }
+
+    softToScreen(r, a, &p->x0, &p->y0, &p->z0);
+    softToScreen(r, b, &p->x1, &p->y1, &p->z1);
+    p->kind = SOFT_LINE;
+    memcpy(p->color, line->color, 3);
+    softSetTiles(r, p, fminf(p->x0, p->x1), fminf(p->y0, p->y1), fmaxf(p->x0, p->x1), fmaxf(p->y0, p->y1));
+}
+
+static inline void softProjectSprite(const SoftRenderer* r, const SoftSprite* sprite, SoftPrimitive* p) {
+    float c[4];
+    softTransform(r, sprite->p, c);
+    if (c[2] + c[3] < 0.0f || c[3] <= 0.0f) {
+        p->tiles[0] = -1;
+        return;
+    }
+
+    softToScreen(r, c, &p->x0, &p->y0, &p->z0);
+    p->radius = fminf(fmaxf(sprite->radius * r->pixelsPerUnit / c[3], 0.5f), SOFT_MAX_SPRITE_RADIUS);
+    p->kind = sprite->shape;
+    memcpy(p->color, sprite->color, 3);
+    softSetTiles(r, p, p->x0 - p->radius, p->y0 - p->radius, p->x0 + p->radius, p->y0 + p->radius);
+}
+
+static inline void softPlot(SoftRenderer* r, int x, int y, float z, const unsigned char color[3]) {
+    long pixel = (long)y * r->width + x;
+    if (z >= 0.0f && z < r->depth[pixel]) {
+        r->depth[pixel] = z;
+        memcpy(&r->color[pixel * 3], color, 3);
+    }
+}
+
+// DDA over the part of the segment that crosses the tile
+static inline void softRasterLine(SoftRenderer* r, const SoftPrimitive* p, int x0, int y0, int x1, int y1) {
+    float dx = p->x1 - p->x0, dy = p->y1 - p->y0, dz = p->z1 - p->z0;
+    int steps = (int)ceilf(fmaxf(fabsf(dx), fabsf(dy)));
+    if (steps < 1) steps = 1;
+
+    float tMin = 0.0f, tMax = 1.0f;
+    float starts[2] = {p->x0, p->y0}, deltas[2] = {dx, dy};
+    float lows[2] = {(float)x0 - 0.5f, (float)y0 - 0.5f}, highs[2] = {(float)x1 + 0.5f, (float)y1 + 0.5f};
+    for (int axis = 0; axis < 2; axis++) {
+        if (fabsf(deltas[axis]) < 1e-12f) {
+            if (starts[axis] < lows[axis] || starts[axis] > highs[axis]) return;
+            continue;
+        }
+        float tA = (lows[axis] - starts[axis]) / deltas[axis];
+        float tB = (highs[axis] - starts[axis]) / deltas[axis];
+        tMin = fmaxf(tMin, fminf(tA, tB));
+        tMax = fminf(tMax, fmaxf(tA, tB));
+    }
+    if (tMin > tMax) return;
+
+    for (int i = (int)floorf(tMin * steps); i <= (int)ceilf(tMax * steps) && i <= steps; i++) {
+        float t = (float)i / steps;
+        int x = (int)floorf(p->x0 + t * dx);
+        int y = (int)floorf(p->y0 + t * dy);
+        if (x < x0 || x > x1 || y < y0 || y > y1) continue;
+        softPlot(r, x, y, p->z0 + t * dz, p->color);
+    }
+}
+
+static inline void softRasterSprite(SoftRenderer* r, const SoftPrimitive* p, int x0, int y0, int x1, int y1) {
+    int minX = (int)floorf(p->x0 - p->radius), maxX = (int)floorf(p->x0 + p->radius);
+    int minY = (int)floorf(p->y0 - p->radius), maxY = (int)floorf(p->y0 + p->radius);
+    if (minX < x0) minX = x0;
+    if (minY < y0) minY = y0;
+    if (maxX > x1) maxX = x1;
+    if (maxY > y1) maxY = y1;
+
+    float radius2 = p->radius * p->radius;
+    for (int y = minY; y <= maxY; y++) {
+        for (int x = minX; x <= maxX; x++) {
+            float dx = x + 0.5f - p->x0, dy = y + 0.5f - p->y0;
+            if (p->kind == SOFT_DISC && dx * dx + dy * dy > radius2) continue;
+            softPlot(r, x, y, p->z0, p->color);
+        }
+    }
+}
+
+// Projects and bins everything added since softBegin, then rasterises the
+// tiles in parallel. Each thread bins a fixed contiguous range of primitives,
+// so every tile sees them in submission order and frames are identical for
+// any thread count.
+static inline void softRender(SoftRenderer* r) {
+    long numLines = r->numLines;
+    long total = numLines + r->numSprites;
+    int numTiles = r->tilesX * r->tilesY;
+    int threads = omp_get_max_threads();
+
+    r->primitives = (SoftPrimitive*)softGrow(r->primitives, &r->primitiveCapacity, total, sizeof(SoftPrimitive));
+    if (threads != r->threadCountsThreads) {
+        memFree(r->threadCounts);
+        r->threadCounts = (long*)memAlloc(memTag("render"), (size_t)threads * numTiles * sizeof(long));
+        r->threadCountsThreads = threads;
+    }
+
+    #pragma omp parallel num_threads(threads)
+    {
+        int thread = omp_get_thread_num();
+        int team = omp_get_num_threads();
+        long first = total * thread / team, last = total * (thread + 1) / team;
+        long* counts = r->threadCounts + (long)thread * numTiles;
+        memset(counts, 0, numTiles * sizeof(long));
+
+        for (long i = first; i < last; i++) {
+            SoftPrimitive* p = &r->primitives[i];
+            if (i < numLines) {
+                softProjectLine(r, &r->lines[i], p);
+            } else {
+                softProjectSprite(r, &r->sprites[i - numLines], p);
+            }
+            if (p->tiles[0] < 0) continue;
+            for (int ty = p->tiles[2]; ty <= p->tiles[3]; ty++)
+                for (int tx = p->tiles[0]; tx <= p->tiles[1]; tx++) counts[ty * r->tilesX + tx]++;
+        }
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            // Turn the counts into write cursors: tile by tile, thread by thread
+            long offset = 0;
+            for (int tile = 0; tile < numTiles; tile++) {
+                r->tileStart[tile] = offset;
+                for (int t = 0; t < team; t++) {
+                    long count = r->threadCounts[(long)t * numTiles + tile];
+                    r->threadCounts[(long)t * numTiles + tile] = offset;
+                    offset += count;
+                }
+            }
+            r->tileStart[numTiles] = offset;
+            r->binned = (long*)softGrow(r->binned, &r->binnedCapacity, offset, sizeof(long));
+        }
+
+        for (long i = first; i < last; i++) {
+            SoftPrimitive* p = &r->primitives[i];
+            if (p->tiles[0] < 0) continue;
+            for (int ty = p->tiles[2]; ty <= p->tiles[3]; ty++)
+                for (int tx = p->tiles[0]; tx <= p->tiles[1]; tx++) r->binned[counts[ty * r->tilesX + tx]++] = i;
+        }
+
+        #pragma omp barrier
+        #pragma omp for schedule(dynamic, 1)
+        for (int tile = 0; tile < numTiles; tile++) {
+            int x0 = (tile % r->tilesX) * SOFT_TILE_SIZE, y0 = (tile / r->tilesX) * SOFT_TILE_SIZE;
+            int x1 = x0 + SOFT_TILE_SIZE - 1, y1 = y0 + SOFT_TILE_SIZE - 1;
+            if (x1 >= r->width) x1 = r->width - 1;
+            if (y1 >= r->height) y1 = r->height - 1;
+
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    long pixel = (long)y * r->width + x;
+                    r->depth[pixel] = 1.0f;
+                    memcpy(&r->color[pixel * 3], r->background, 3);
+                }
+            }
+
+            for (long k = r->tileStart[tile]; k < r->tileStart[tile + 1]; k++) {
+                const SoftPrimitive* p = &r->primitives[r->binned[k]];
+                if (p->kind == SOFT_LINE) {
+                    softRasterLine(r, p, x0, y0, x1, y1);
+                } else {
+                    softRasterSprite(r, p, x0, y0, x1, y1);
+                }
+            }
+        }
+    }
+}
+
+static inline uint32_t softCrc(uint32_t crc, const unsigned char* data, size_t length) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static inline void softPngChunk(FILE* file, const char* type, const unsigned char* data, uint32_t length) {
+    unsigned char header[8] = {length >> 24, length >> 16, length >> 8, length, type[0], type[1], type[2], type[3]};
+    fwrite(header, 1, 8, file);
+    if (length > 0) fwrite(data, 1, length, file);
+    uint32_t crc = softCrc(softCrc(0, header + 4, 4), data, length);
+    unsigned char footer[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+    fwrite(footer, 1, 4, file);
+}
+
+// PNG without a zlib dependency: the image goes into stored (uncompressed)
+// deflate blocks, which every PNG reader accepts
+static inline int softWritePng(const SoftRenderer* r, FILE* file) {
+    size_t rowBytes = (size_t)r->width * 3 + 1;
+    size_t rawBytes = rowBytes * r->height;
+    size_t blocks = (rawBytes + 65534) / 65535;
+    size_t idatBytes = 2 + rawBytes + blocks * 5 + 4;
+    int tag = memTag("render");
+    unsigned char* raw = (unsigned char*)memAlloc(tag, rawBytes);
+    unsigned char* idat = (unsigned char*)memAlloc(tag, idatBytes);
+    if (raw == NULL || idat == NULL) {
+        memFree(raw);
+        memFree(idat);
+        return -1;
+    }
+
+    for (int y = 0; y < r->height; y++) {
+        raw[y * rowBytes] = 0; // No filter
+        memcpy(&raw[y * rowBytes + 1], &r->color[(size_t)y * r->width * 3], r->width * 3);
+    }
+
+    size_t out = 0;
+    idat[out++] = 0x78;
+    idat[out++] = 0x01;
+    uint32_t adlerA = 1, adlerB = 0;
+    for (size_t offset = 0; offset < rawBytes; offset += 65535) {
+        size_t length = rawBytes - offset < 65535 ? rawBytes - offset : 65535;
+        idat[out++] = offset + length == rawBytes ? 1 : 0;
+        idat[out++] = length & 0xff;
+        idat[out++] = length >> 8;
+        idat[out++] = ~length & 0xff;
+        idat[out++] = (~length >> 8) & 0xff;
+        memcpy(&idat[out], &raw[offset], length);
+        out += length;
+        for (size_t i = offset; i < offset + length; i++) {
+            adlerA = (adlerA + raw[i]) % 65521;
+            adlerB = (adlerB + adlerA) % 65521;
+        }
+    }
+    uint32_t adler = (adlerB << 16) | adlerA;
+    idat[out++] = adler >> 24;
+    idat[out++] = adler >> 16;
+    idat[out++] = adler >> 8;
+    idat[out++] = adler;
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    unsigned char ihdr[13] = {r->width >> 24, r->width >> 16, r->width >> 8, r->width,
+                              r->height >> 24, r->height >> 16, r->height >> 8, r->height,
+                              8, 2, 0, 0, 0}; // 8-bit RGB
+    fwrite(signature, 1, 8, file);
+    softPngChunk(file, "IHDR", ihdr, 13);
+    softPngChunk(file, "IDAT", idat, (uint32_t)out);
+    softPngChunk(file, "IEND", NULL, 0);
+
+    memFree(raw);
+    memFree(idat);
+    return 0;
+}
+
+static inline int softWriteFrame(const SoftRenderer* r, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    int result = 0;
+    size_t length = strlen(path);
+    if (length > 4 && strcmp(path + length - 4, ".png") == 0) {
+        result = softWritePng(r, file);
+    } else {
+        fprintf(file, "P6\n%d %d\n255\n", r->width, r->height);
+        fwrite(r->color, 3, (size_t)r->width * r->height, file);
+    }
+    fclose(file);
+    return result;
+}
+
+// --size: "1920x1080" into width and height. Anything else exits, so a typo
+// does not render at some other size.
+static inline void softParseSize(const char* text, int* width, int* height) {
+    int w, h, end = 0;
+    if (sscanf(text, "%dx%d%n", &w, &h, &end) != 2 || text[end] != '\0' || w < 1 || h < 1 ||
+        w > SOFT_MAX_SIZE || h > SOFT_MAX_SIZE) {
+        fprintf(stderr, "Bad frame size \"%s\", expected WIDTHxHEIGHT (e.g. 1920x1080, at most %dx%d)\n", text,
+                SOFT_MAX_SIZE, SOFT_MAX_SIZE);
+        exit(1);
+    }
+    *width = w;
+    *height = h;
+}
+
+// --render: the pattern is handed to snprintf with the frame number, so it
+// must hold exactly one integer conversion (%d, %05d, %x, ...); %% is a
+// literal percent sign
+static inline void softCheckPattern(const char* pattern) {
+    int conversions = 0;
+    for (const char* p = pattern; *p != '\0'; p++) {
+        if (*p != '%') continue;
+        if (*++p == '%') continue;
+        p += strspn(p, "-+ #0");
+        p += strspn(p, "0123456789");
+        if (*p == '.') p += 1 + strspn(p + 1, "0123456789");
+        if (*p == '\0' || strchr("diouxX", *p) == NULL) {
+            conversions = -1;
+            break;
+        }
+        conversions++;
+    }
+    if (conversions != 1) {
+        fprintf(stderr, "Bad frame pattern \"%s\", expected one %%d for the frame number (e.g. frames/%%05d.png)\n",
+                pattern);
+        exit(1);
+    }
+}
+
+#endif
@@ -0,0 +1,269 @@
+// Recorded trajectories: every step of a run, for playback without
+// re-simulating it.
+// A file is a TRAJECTORY_HEADER_BYTES header (magic, record size, records
+// per frame, seed) followed by fixed-size frames: a TrajectoryFrame, then the
+// program's records exactly as they sit in memory. Frame k is found by
+// arithmetic and never decoded, so the player maps the file and hands a
+// pointer into the mapping straight to the renderer. A run that stops
+// halfway leaves a playable file; a trailing partial frame is ignored.
+// While a file plays, a background thread keeps the frames ahead of the
+// viewer resident (madvise, then one read per page), so the viewer does not
+// stall on page faults and plays as fast as the disk delivers frames.
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRAJECTORY_MAGIC "TRAJ0001"
+#define TRAJECTORY_HEADER_BYTES 4096 // Keeps the first frame page aligned
+#define TRAJECTORY_PREFETCH_BYTES (256L << 20) // How far the prefetch thread reads ahead
+#define TRAJECTORY_PREFETCH_FRAMES 64
+
+typedef struct {
+    char magic[8];
+    int64_t recordBytes; // sizeof one record, so a file from another layout is refused
+    int64_t records;     // Per frame
+    uint64_t seed;
+} TrajectoryHeader;
+
+typedef struct {
+    int64_t step;
+    double energy;
+} TrajectoryFrame; // In front of every frame's records
+
+typedef struct {
+    int fd;
+    long records, recordBytes;
+    long frames; // Written so far
+} TrajectoryWriter;
+
+typedef struct {
+    const unsigned char* data; // The whole file, read-only
+    size_t size;
+    long records, recordBytes, frameBytes, frames;
+    uint64_t seed;
+    // Prefetch thread; the fields below are guarded by lock
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    long viewer;     // Frame on screen
+    int direction;   // +1 or -1, the way the viewer is moving
+    long readyUntil; // Frames from viewer up to here, in direction, are resident
+    long epoch;      // Bumped on every jump, so stale prefetches do not count
+    int quit;
+} TrajectoryReader;
+
+static inline int trajectoryWriteAll(int fd, const void* data, size_t bytes) {
+    const char* p = (const char*)data;
+    while (bytes > 0) {
+        ssize_t written = write(fd, p, bytes);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        bytes -= (size_t)written;
+    }
+    return 0;
+}
+
+static inline int trajectoryCreate(TrajectoryWriter* w, const char* path, long records, long recordBytes,
+                                   uint64_t seed) {
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    w->records = records;
+    w->recordBytes = recordBytes;
+    w->frames = 0;
+
+    unsigned char block[TRAJECTORY_HEADER_BYTES] = {0};
+    TrajectoryHeader header = {{0}, recordBytes, records, seed};
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    memcpy(block, &header, sizeof(header));
+    if (trajectoryWriteAll(w->fd, block, sizeof(block)) != 0) {
+        perror(path);
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Appends one frame of w->records records
+static inline int trajectoryAppend(TrajectoryWriter* w, long step, double energy, const void* records) {
+    TrajectoryFrame frame = {step, energy};
+    if (trajectoryWriteAll(w->fd, &frame, sizeof(frame)) != 0 ||
+        trajectoryWriteAll(w->fd, records, (size_t)w->records * w->recordBytes) != 0) {
+        return -1;
+    }
+    w->frames++;
+    return 0;
+}
+
+// Drops frame and every frame after it, so the next append takes its place
+static inline int trajectoryTruncate(TrajectoryWriter* w, long frame) {
+    off_t size = TRAJECTORY_HEADER_BYTES + (off_t)frame * (off_t)(sizeof(TrajectoryFrame) + w->records * w->recordBytes);
+    if (ftruncate(w->fd, size) != 0 || lseek(w->fd, size, SEEK_SET) < 0) return -1;
+    w->frames = frame;
+    return 0;
+}
+
+static inline void trajectoryClose(TrajectoryWriter* w) {
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+}
+
+static inline const TrajectoryFrame* trajectoryFrame(const TrajectoryReader* r, long frame) {
+    return (const TrajectoryFrame*)(r->data + TRAJECTORY_HEADER_BYTES + frame * r->frameBytes);
+}
+
+static inline const void* trajectoryRecords(const TrajectoryReader* r, long frame) {
+    return (const unsigned char*)trajectoryFrame(r, frame) + sizeof(TrajectoryFrame);
+}
+
+// Asks the kernel for a frame's pages and waits until they are in. The
+// frame after it is requested too, so the disk always has the next read
+// queued while this one is waited for.
+static inline void trajectoryLoad(const TrajectoryReader* r, long frame, int direction, long page) {
+    const unsigned char* start = (const unsigned char*)trajectoryFrame(r, frame);
+    const unsigned char* end = start + r->frameBytes;
+    const unsigned char* first = r->data + ((start - r->data) & ~(page - 1));
+    long after = frame + direction;
+    if (after >= 0 && after < r->frames) {
+        const unsigned char* next = (const unsigned char*)trajectoryFrame(r, after);
+        const unsigned char* from = r->data + ((next - r->data) & ~(page - 1));
+        madvise((void*)from, next + r->frameBytes - from, MADV_WILLNEED);
+    }
+    madvise((void*)first, end - first, MADV_WILLNEED);
+    unsigned char sum = 0;
+    for (const unsigned char* p = first; p < end; p += page) sum += *(volatile const unsigned char*)p;
+    (void)sum;
+}
+
+static inline void* trajectoryPrefetchThread(void* arg) {
+    TrajectoryReader* r = (TrajectoryReader*)arg;
+    long page = sysconf(_SC_PAGESIZE);
+    long ahead = TRAJECTORY_PREFETCH_BYTES / r->frameBytes;
+    if (ahead < 1) ahead = 1;
+    if (ahead > TRAJECTORY_PREFETCH_FRAMES) ahead = TRAJECTORY_PREFETCH_FRAMES;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->quit) {
+        long next = r->readyUntil + r->direction;
+        if (next < 0 || next >= r->frames || (next - r->viewer) * r->direction > ahead) {
+            pthread_cond_wait(&r->wake, &r->lock);
+            continue;
+        }
+        long epoch = r->epoch;
+        pthread_mutex_unlock(&r->lock);
+        trajectoryLoad(r, next, r->direction, page);
+        pthread_mutex_lock(&r->lock);
+        if (r->epoch == epoch) r->readyUntil = next;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Maps a recording of records of recordBytes each and starts prefetching from frame 0
+static inline int trajectoryOpen(TrajectoryReader* r, const char* path, long recordBytes) {
+    memset(r, 0, sizeof(*r));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < TRAJECTORY_HEADER_BYTES) {
+        fprintf(stderr, "%s is not a trajectory\n", path);
+        close(fd);
+        return -1;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    r->data = (const unsigned char*)data;
+    r->size = (size_t)st.st_size;
+
+    TrajectoryHeader header;
+    memcpy(&header, r->data, sizeof(header));
+    if (memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0 || header.records < 1) {
+        fprintf(stderr, "%s is not a trajectory\n", path);
+    } else if (header.recordBytes != recordBytes) {
+        fprintf(stderr, "%s holds %ld-byte records, this build uses %ld\n", path, (long)header.recordBytes,
+                recordBytes);
+    } else {
+        r->records = (long)header.records;
+        r->recordBytes = recordBytes;
+        r->frameBytes = (long)sizeof(TrajectoryFrame) + r->records * recordBytes;
+        r->frames = (long)((r->size - TRAJECTORY_HEADER_BYTES) / r->frameBytes);
+        r->seed = header.seed;
+        if (r->frames == 0) fprintf(stderr, "%s has no complete frame\n", path);
+    }
+    if (r->frames == 0) {
+        munmap(data, r->size);
+        r->data = NULL;
+        return -1;
+    }
+
+    r->direction = 1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    if (pthread_create(&r->thread, NULL, trajectoryPrefetchThread, r) != 0) {
+        fprintf(stderr, "Cannot start the prefetch thread\n");
+        munmap(data, r->size);
+        r->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Tells the prefetch thread where the viewer is and which way it moves
+static inline void trajectoryFollow(TrajectoryReader* r, long frame, int direction) {
+    pthread_mutex_lock(&r->lock);
+    long ahead = (r->readyUntil - frame) * direction;
+    if (direction != r->direction || (frame - r->viewer) * direction < 0 || ahead < 0) {
+        r->readyUntil = frame; // A jump: what was loaded is not ahead any more
+        r->epoch++;
+    }
+    r->viewer = frame;
+    r->direction = direction;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Furthest frame in the viewer's direction that is already resident
+static inline long trajectoryReadyUntil(TrajectoryReader* r) {
+    pthread_mutex_lock(&r->lock);
+    long ready = r->readyUntil;
+    pthread_mutex_unlock(&r->lock);
+    return ready;
+}
+
+static inline void trajectoryRelease(TrajectoryReader* r) {
+    if (r->data == NULL) return;
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+    munmap((void*)r->data, r->size);
+    r->data = NULL;
+}
+
+#endif